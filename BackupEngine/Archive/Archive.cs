@@ -13,8 +13,13 @@ namespace BackupEngine.Archive
         private readonly List<FilterGenerator> _filters = new List<FilterGenerator>();
 
         protected Archive()
+            : this(new CompressionFilterGenerator())
         {
-            _filters.Add(new CompressionFilterGenerator());
+        }
+
+        protected Archive(CompressionFilterGenerator compression)
+        {
+            _filters.Add(compression);
         }
 
         public abstract void Dispose();
@@ -24,6 +29,13 @@ namespace BackupEngine.Archive
             _filters.Add(fg);
         }
 
+        //Whether compression is the only filter, which native code can undo
+        //by itself.
+        protected bool OnlyCompressed
+        {
+            get { return _filters.Count == 1 && _filters[0] is CompressionFilterGenerator; }
+        }
+
         protected InputFilter DoInputFiltering(Stream stream, bool includeEncryption = true)
         {
             var ret = stream as InputFilter;
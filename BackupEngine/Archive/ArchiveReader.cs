@@ -13,6 +13,15 @@ namespace BackupEngine.Archive
 {
     public class ArchiveReader : Archive
     {
+        private struct Frame
+        {
+            public long Offset;
+            public long Size;
+            public int FirstStream;
+            public int EndStream;
+        }
+
+        private readonly string _path;
         private FileStream _stream;
         private List<ulong> _streamIds = new List<ulong>();
         private List<long> _streamSizes = new List<long>();
@@ -21,9 +30,27 @@ namespace BackupEngine.Archive
         private long _manifestOffset = -1;
         private long _manifestSize = -1;
         private long _baseObjectsOffset = -1;
+        private List<Frame> _frames = new List<Frame>();
+        //Where each stream starts in the unfiltered data of its frame.
+        private List<long> _streamOffsets = new List<long>();
+        //Where each frame starts in the file data, as if the stored part of
+        //every stream were concatenated, followed by where the last one ends.
+        private List<long> _frameStarts = new List<long>();
+        private Dictionary<int, List<StreamSegment>> _segments = new Dictionary<int, List<StreamSegment>>();
+        //Opens the archives of other versions, to read the chunks that this
+        //one refers to. The caller owns the archives it returns.
+        public Func<int, ArchiveReader> OpenVersion;
+        //The frame that referenced chunks were last read from, so that
+        //chunks read in order don't unfilter it from the start each time.
+        private FileStream _chunkFile;
+        private Stream _chunkFrameStream;
+        private int _chunkFrame = -1;
+        private long _chunkPosition;
+        private Stream _lastChunk;
 
         public ArchiveReader(string existingPath)
         {
+            _path = existingPath;
             _stream = new FileStream(existingPath, FileMode.Open, FileAccess.Read, FileShare.Read);
         }
 
@@ -50,9 +77,191 @@ namespace BackupEngine.Archive
             _baseObjectsOffset = _manifestOffset - VersionManifest.ArchiveMetadata.EntriesSizeInArchive;
             _streamIds = new List<ulong>(VersionManifest.ArchiveMetadata.StreamIds);
             _streamSizes = new List<long>(VersionManifest.ArchiveMetadata.StreamSizes);
+            _segments = new Dictionary<int, List<StreamSegment>>();
+            if (VersionManifest.ArchiveMetadata.StreamsSegments != null)
+                foreach (var stream in VersionManifest.ArchiveMetadata.StreamsSegments)
+                    _segments[stream.Stream] = stream.Segments ?? new List<StreamSegment>();
+            ReadSeekIndex();
             return VersionManifest;
         }
 
+        private void ReadSeekIndex()
+        {
+            //Archives without an index have their file data in one frame.
+            var index = VersionManifest.ArchiveMetadata.StreamsSeekIndex;
+            var offsets = new List<long> { 0 };
+            var firstStreams = new List<int> { 0 };
+            if (index != null && index.FrameOffsets != null && index.FirstStreams != null)
+            {
+                offsets = index.FrameOffsets;
+                firstStreams = index.FirstStreams;
+            }
+            _frames = new List<Frame>();
+            _streamOffsets = new List<long>();
+            _frameStarts = new List<long>();
+            long frameStart = 0;
+            for (int i = 0; i < offsets.Count; i++)
+            {
+                var frame = new Frame
+                {
+                    Offset = offsets[i],
+                    Size = (i + 1 < offsets.Count ? offsets[i + 1] : _baseObjectsOffset) - offsets[i],
+                    FirstStream = firstStreams[i],
+                    EndStream = i + 1 < firstStreams.Count ? firstStreams[i + 1] : _streamIds.Count,
+                };
+                _frames.Add(frame);
+                _frameStarts.Add(frameStart);
+                long offset = 0;
+                for (int j = frame.FirstStream; j < frame.EndStream; j++)
+                {
+                    _streamOffsets.Add(offset);
+                    offset += _streamSizes[j];
+                }
+                frameStart += offset;
+            }
+            _frameStarts.Add(frameStart);
+        }
+
+        private Stream OpenFrame(Frame frame, long skip, FileStream file)
+        {
+            if (OnlyCompressed)
+                return new ArchiveFrameStream(_path, frame.Offset, frame.Size, skip);
+            file.Seek(frame.Offset, SeekOrigin.Begin);
+            var ret = DoInputFiltering(new BoundedStream(file, frame.Size));
+            new BoundedStream(ret, skip).CopyTo(Stream.Null);
+            return ret;
+        }
+
+        //Reads length bytes of this version's file data, starting at offset,
+        //for a stream that refers to them. Reading forward within a frame
+        //continues from the previous read.
+        private Stream ReadChunks(long offset, long length)
+        {
+            if (VersionManifest == null)
+                ReadManifest();
+            if (_lastChunk != null)
+                _lastChunk.CopyTo(Stream.Null);
+            var frame = _frameStarts.BinaryFindFirst(x => x > offset) - 1;
+            if (offset < 0 || frame < 0 || frame >= _frames.Count || offset + length > _frameStarts[frame + 1])
+                throw new InvalidDataException();
+            if (frame != _chunkFrame || offset < _chunkPosition)
+            {
+                if (_chunkFrameStream != null)
+                    _chunkFrameStream.Dispose();
+                _chunkFrameStream = null;
+                if (_chunkFile == null)
+                    _chunkFile = new FileStream(_path, FileMode.Open, FileAccess.Read, FileShare.Read);
+                _chunkFrameStream = OpenFrame(_frames[frame], offset - _frameStarts[frame], _chunkFile);
+                _chunkFrame = frame;
+            }
+            else
+                new BoundedStream(_chunkFrameStream, offset - _chunkPosition).CopyTo(Stream.Null);
+            _chunkPosition = offset + length;
+            return _lastChunk = new BoundedStream(_chunkFrameStream, length);
+        }
+
+        private Stream ReadChunks(StreamSegment segment)
+        {
+            if (segment.Version == VersionManifest.VersionNumber)
+                return ReadChunks(segment.Offset, segment.Length);
+            if (OpenVersion == null)
+                throw new InvalidOperationException("The stream refers to other versions, but OpenVersion is not set.");
+            return OpenVersion(segment.Version).ReadChunks(segment.Offset, segment.Length);
+        }
+
+        //Stream i as stored, with the chunks it refers to filled in.
+        private Stream WithReferencedChunks(int i, Stream stored)
+        {
+            List<StreamSegment> segments;
+            if (!_segments.TryGetValue(i, out segments))
+                return stored;
+            return new SegmentedStreamReader(this, stored, segments);
+        }
+
+        //A stream whose stored data is interleaved with chunks stored before.
+        private class SegmentedStreamReader : Stream
+        {
+            private readonly ArchiveReader _archive;
+            private readonly Stream _stored;
+            private readonly List<StreamSegment> _segments;
+            private readonly long _length;
+            private int _segment = -1;
+            private Stream _current;
+
+            public SegmentedStreamReader(ArchiveReader archive, Stream stored, List<StreamSegment> segments)
+            {
+                _archive = archive;
+                _stored = stored;
+                _segments = segments;
+                _length = segments.Sum(x => x.Length);
+            }
+
+            public override int Read(byte[] buffer, int offset, int count)
+            {
+                while (true)
+                {
+                    if (_current == null)
+                    {
+                        if (++_segment >= _segments.Count)
+                            return 0;
+                        var segment = _segments[_segment];
+                        _current = segment.Reference
+                            ? _archive.ReadChunks(segment)
+                            : new BoundedStream(_stored, segment.Length);
+                    }
+                    var ret = _current.Read(buffer, offset, count);
+                    if (ret > 0 || count == 0)
+                        return ret;
+                    _current = null;
+                }
+            }
+
+            public override void Flush()
+            {
+            }
+
+            public override long Seek(long offset, SeekOrigin origin)
+            {
+                throw new InvalidOperationException();
+            }
+
+            public override void SetLength(long value)
+            {
+                throw new InvalidOperationException();
+            }
+
+            public override void Write(byte[] buffer, int offset, int count)
+            {
+                throw new InvalidOperationException();
+            }
+
+            public override bool CanRead
+            {
+                get { return true; }
+            }
+
+            public override bool CanSeek
+            {
+                get { return false; }
+            }
+
+            public override bool CanWrite
+            {
+                get { return false; }
+            }
+
+            public override long Length
+            {
+                get { return _length; }
+            }
+
+            public override long Position
+            {
+                get { throw new InvalidOperationException(); }
+                set { throw new InvalidOperationException(); }
+            }
+        }
+
         public List<FileSystemObject> ReadBaseObjects()
         {
             if (VersionManifest == null)
@@ -81,20 +290,58 @@ namespace BackupEngine.Archive
         {
             if (VersionManifest == null)
                 ReadManifest();
-            _stream.Seek(0, SeekOrigin.Begin);
-            using (var filteredStream = DoInputFiltering(_stream))
+            ForEachStream(_streamIds, callback);
+        }
+
+        //Calls callback for the streams of this archive whose ids are in
+        //streamIds, in archive order. Only the frames that hold them are
+        //unfiltered, each from the first of them to the last.
+        public void ForEachStream(IEnumerable<ulong> streamIds, Action<ulong, Stream> callback)
+        {
+            if (VersionManifest == null)
+                ReadManifest();
+            var wanted = new HashSet<ulong>(streamIds);
+            foreach (var frame in _frames)
             {
-                _streamIds.Zip(_streamSizes, (id, size) => 
+                int first = -1,
+                    last = -1;
+                for (int i = frame.FirstStream; i < frame.EndStream; i++)
+                {
+                    if (!wanted.Contains(_streamIds[i]))
+                        continue;
+                    if (first < 0)
+                        first = i;
+                    last = i;
+                }
+                if (first < 0)
+                    continue;
+                using (var filteredStream = OpenFrame(frame, _streamOffsets[first], _stream))
                 {
-                    // ReSharper disable once AccessToDisposedClosure
-                    var bounded = new BoundedStream(filteredStream, size);
-                    callback(id, bounded);
-                });
+                    for (int i = first; i <= last; i++)
+                    {
+                        var bounded = new BoundedStream(filteredStream, _streamSizes[i]);
+                        if (wanted.Contains(_streamIds[i]))
+                            callback(_streamIds[i], WithReferencedChunks(i, bounded));
+                        //Whatever the callback left unread is skipped, so that
+                        //the next stream starts in the right place.
+                        bounded.CopyTo(Stream.Null);
+                    }
+                }
             }
         }
 
         public override void Dispose()
         {
+            if (_chunkFrameStream != null)
+            {
+                _chunkFrameStream.Dispose();
+                _chunkFrameStream = null;
+            }
+            if (_chunkFile != null)
+            {
+                _chunkFile.Dispose();
+                _chunkFile = null;
+            }
             if (_stream != null)
             {
                 _stream.Dispose();
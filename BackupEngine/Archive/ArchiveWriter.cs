@@ -1,6 +1,7 @@
 using System;
 using System.Collections.Generic;
 using System.IO;
+using System.Linq;
 using System.Security.Cryptography;
 using Alphaleonis.Win32.Filesystem;
 using BackupEngine.FileSystem;
@@ -14,6 +15,12 @@ namespace BackupEngine.Archive
 {
     public class ArchiveWriter : Archive
     {
+        //A frame of file data is ended after the first stream that brings it
+        //to this size, so reading a stream unfilters at most this much before
+        //it. Each frame restarts compression, which costs little once it is a
+        //few times the dictionary size.
+        public const long FrameSize = 32 << 20;
+
         private enum ArchiveState
         {
             Initial = 0,
@@ -22,16 +29,30 @@ namespace BackupEngine.Archive
             Final = 3,
         }
 
-        private KernelTransaction _transaction;
-        private FileStream _fileStream;
+        //The archive is written under a temporary name, and only renamed to
+        //_path once it is complete.
+        private readonly string _path;
+        private readonly string _temporaryPath;
+        private WriteBehindFileStream _fileStream;
         private OutputFilter _hashedStream;
         private OutputFilter _outputFilter;
         private ArchiveState _state = ArchiveState.Initial;
         private readonly List<ulong> _streamIds = new List<ulong>();
         private readonly List<long> _streamSizes = new List<long>();
         private readonly List<long> _baseObjectEntrySizes = new List<long>();
+        private readonly List<long> _frameOffsets = new List<long>();
+        private readonly List<int> _frameFirstStreams = new List<int>();
+        private long _frameSize;
         private HashAlgorithm _hash;
         private long _initialFsoOffset;
+        //If set, chunks already in the store are written as references to
+        //where they were stored. See Deduplicate().
+        private ChunkStore _chunkStore;
+        private int _versionNumber;
+        //File data stored so far, as the streams' stored sizes add up.
+        private long _storedBytes;
+        private readonly List<SegmentedStream> _segmentedStreams = new List<SegmentedStream>();
+        private readonly HashSet<int> _referencedVersions = new HashSet<int>();
         public bool AnyFile { get; private set; }
 
         private HashAlgorithm NewHash()
@@ -52,55 +73,187 @@ namespace BackupEngine.Archive
         }
 
         public ArchiveWriter(string newPath)
+            : this(newPath, LzmaEncoderOptions.Default)
+        {
+        }
+
+        public ArchiveWriter(string newPath, LzmaEncoderOptions compressionOptions, bool unbuffered = false)
+            : base(new CompressionFilterGenerator(compressionOptions))
         {
-            _transaction = new KernelTransaction();
-            _fileStream = File.OpenTransacted(_transaction, newPath, FileMode.Create, FileAccess.Write, FileShare.None);
+            _path = newPath;
+            _temporaryPath = newPath + ".tmp";
+            _fileStream = new WriteBehindFileStream(_temporaryPath, unbuffered);
             _hashedStream = new HashCalculatorOutputFilter(_fileStream, NewHash());
-            
         }
 
-        public byte[] AddFile(ulong streamId, Stream file, HashType type = HashType.None)
+        //Splits the files added from now on into chunks, and stores only the
+        //ones chunkStore doesn't know, as part of version versionNumber. The
+        //new chunks are committed to chunkStore once the archive is complete.
+        public void Deduplicate(ChunkStore chunkStore, int versionNumber)
         {
             EnsureMaximumState(ArchiveState.PushingFiles);
-            if (_state == ArchiveState.Initial)
-            {
-                _outputFilter = DoOutputFiltering(_hashedStream);
-                _state = ArchiveState.PushingFiles;
-            }
+            _chunkStore = chunkStore;
+            _versionNumber = versionNumber;
+        }
+
+        //If signaturePath is set, the rsync signature of the file is computed
+        //from the same reads and saved there.
+        public byte[] AddFile(ulong streamId, Stream file, HashType type = HashType.None, string signaturePath = null)
+        {
+            EnsureMaximumState(ArchiveState.PushingFiles);
+            _state = ArchiveState.PushingFiles;
+            if (_outputFilter == null)
+                StartFrame();
             byte[] ret = null;
             _streamIds.Add(streamId);
-            _streamSizes.Add(file.Length);
             Stream stream = file;
             HashAlgorithm hash = null;
+            HashCalculatorInputFilter hashFilter = null;
             if (type != HashType.None)
             {
                 hash = Hash.New(type);
-                stream = new HashCalculatorInputFilter(stream, hash);
+                stream = hashFilter = new HashCalculatorInputFilter(stream, hash);
             }
-            stream.CopyTo(_outputFilter);
-            if (type != HashType.None)
+            SignatureCalculatorInputFilter signature = null;
+            if (signaturePath != null)
+                stream = signature = new SignatureCalculatorInputFilter(stream, file.Length);
+            _outputFilter.BeginFile(file.Length);
+            long storedSize = file.Length;
+            if (_chunkStore == null)
+                stream.CopyTo(_outputFilter);
+            else
+                storedSize = CopyDeduplicated(stream);
+            _streamSizes.Add(storedSize);
+            _storedBytes += storedSize;
+            if (signature != null)
             {
-                stream.Dispose();
+                signature.Save(signaturePath);
+                signature.Dispose();
+            }
+            if (hashFilter != null)
+            {
+                hashFilter.Dispose();
                 hash.FinishHashing();
                 ret = hash.Hash;
             }
             AnyFile = true;
+            _frameSize += storedSize;
+            if (_frameSize >= FrameSize)
+                EndFrame();
             return ret;
         }
 
-        public void AddFso(FileSystemObject fso)
+        //Copies stream to the archive a chunk at a time, and returns how much
+        //of it was stored rather than referenced.
+        private long CopyDeduplicated(Stream stream)
         {
-            EnsureMaximumState(ArchiveState.PushingFsos);
-            if (_state == ArchiveState.Initial)
+            var segments = new List<StreamSegment>();
+            var buffer = new byte[1 << 16];
+            var chunk = new byte[Chunker.MaxChunkSize];
+            var digest = new byte[ChunkStore.HashSize];
+            int chunkFill = 0;
+            long stored = 0;
+            using (var chunker = new Chunker())
             {
-                _initialFsoOffset = _hashedStream.BytesWritten;
-                _outputFilter = DoOutputFiltering(_hashedStream);
-                _state = ArchiveState.PushingFsos;
+                int read;
+                while ((read = stream.Read(buffer, 0, buffer.Length)) > 0)
+                {
+                    for (int offset = 0; offset < read; )
+                    {
+                        int chunkLength;
+                        var n = chunker.Scan(buffer, offset, read - offset, digest, out chunkLength);
+                        Array.Copy(buffer, offset, chunk, chunkFill, n);
+                        chunkFill += n;
+                        offset += n;
+                        if (chunkLength == 0)
+                            continue;
+                        stored += StoreChunk(chunk, chunkFill, digest, stored, segments);
+                        chunkFill = 0;
+                    }
+                }
+                if (chunker.Finish(digest) != 0)
+                    stored += StoreChunk(chunk, chunkFill, digest, stored, segments);
             }
-            else if (_state == ArchiveState.PushingFiles)
+            if (segments.Any(x => x.Reference))
             {
-                _outputFilter.Flush();
-                _outputFilter.Dispose();
+                _segmentedStreams.Add(new SegmentedStream
+                {
+                    Stream = _streamIds.Count - 1,
+                    Segments = segments,
+                });
+            }
+            return stored;
+        }
+
+        //Writes the chunk, unless it was stored before, and returns how many
+        //bytes were written.
+        private long StoreChunk(byte[] chunk, int length, byte[] digest, long storedSoFar, List<StreamSegment> segments)
+        {
+            ChunkLocation location;
+            if (_chunkStore.Lookup(digest, out location) && location.Length == length)
+            {
+                AddSegment(segments, new StreamSegment
+                {
+                    Length = length,
+                    Offset = location.Offset,
+                    Reference = true,
+                    Version = location.Version,
+                });
+                if (location.Version != _versionNumber)
+                    _referencedVersions.Add(location.Version);
+                return 0;
+            }
+            _chunkStore.Insert(digest, new ChunkLocation
+            {
+                Version = _versionNumber,
+                Offset = _storedBytes + storedSoFar,
+                Length = length,
+            });
+            _outputFilter.Write(chunk, 0, length);
+            AddSegment(segments, new StreamSegment { Length = length });
+            return length;
+        }
+
+        //Appends segment, or extends the last one if segment continues it.
+        private static void AddSegment(List<StreamSegment> segments, StreamSegment segment)
+        {
+            if (segments.Count > 0)
+            {
+                var last = segments[segments.Count - 1];
+                bool continues = segment.Reference
+                    ? last.Reference && last.Version == segment.Version && last.Offset + last.Length == segment.Offset
+                    : !last.Reference;
+                if (continues)
+                {
+                    last.Length += segment.Length;
+                    return;
+                }
+            }
+            segments.Add(segment);
+        }
+
+        private void StartFrame()
+        {
+            _frameOffsets.Add(_hashedStream.BytesWritten);
+            _frameFirstStreams.Add(_streamIds.Count);
+            _frameSize = 0;
+            _outputFilter = DoOutputFiltering(_hashedStream);
+        }
+
+        private void EndFrame()
+        {
+            _outputFilter.Flush();
+            _outputFilter.Dispose();
+            _outputFilter = null;
+        }
+
+        public void AddFso(FileSystemObject fso)
+        {
+            EnsureMaximumState(ArchiveState.PushingFsos);
+            if (_state != ArchiveState.PushingFsos)
+            {
+                if (_outputFilter != null)
+                    EndFrame();
                 _initialFsoOffset = _hashedStream.BytesWritten;
                 _outputFilter = DoOutputFiltering(_hashedStream);
                 _state = ArchiveState.PushingFsos;
@@ -119,13 +272,25 @@ namespace BackupEngine.Archive
             _outputFilter.Dispose();
             _outputFilter = null;
 
+            //The chunks referenced must outlive this version.
+            versionManifest.VersionDependencies = versionManifest.VersionDependencies
+                .Concat(_referencedVersions)
+                .Distinct()
+                .Sorted()
+                .ToList();
             versionManifest.ArchiveMetadata = new ArchiveMetadata
             {
                 EntrySizes = new List<long>(_baseObjectEntrySizes),
                 StreamIds = new List<ulong>(_streamIds),
                 StreamSizes = new List<long>(_streamSizes),
+                StreamsSeekIndex = new SeekIndex
+                {
+                    FrameOffsets = new List<long>(_frameOffsets),
+                    FirstStreams = new List<int>(_frameFirstStreams),
+                },
                 //CompressionMethod = CompressionMethod,
                 EntriesSizeInArchive = _hashedStream.BytesWritten - _initialFsoOffset,
+                StreamsSegments = _segmentedStreams.Count > 0 ? new List<SegmentedStream>(_segmentedStreams) : null,
             };
 
             long manifestLength;
@@ -144,12 +309,13 @@ namespace BackupEngine.Archive
             _hash.FinishHashing();
             bytes = _hash.Hash;
             _fileStream.Write(bytes, 0, bytes.Length);
-            _fileStream.Flush();
+            _fileStream.FlushToDisk();
             _fileStream.Dispose();
-            _transaction.Commit();
             _fileStream = null;
-            _transaction.Dispose();
-            _transaction = null;
+            File.Move(_temporaryPath, _path, MoveOptions.ReplaceExisting);
+            //Only now can the chunks stored here be referenced.
+            if (_chunkStore != null)
+                _chunkStore.Commit();
             _state = ArchiveState.Final;
         }
 
@@ -167,13 +333,10 @@ namespace BackupEngine.Archive
             }
             if (_fileStream != null)
             {
+                //Never finished.
                 _fileStream.Dispose();
                 _fileStream = null;
-            }
-            if (_transaction != null)
-            {
-                _transaction.Dispose();
-                _transaction = null;
+                File.Delete(_temporaryPath);
             }
         }
     }
@@ -0,0 +1,164 @@
+﻿using System;
+using System.ComponentModel;
+using System.Runtime.InteropServices;
+
+namespace BackupEngine.Archive
+{
+    //Where a copy of a chunk is stored: Offset is in the file data of the
+    //version, as if the stored part of its streams were concatenated.
+    public struct ChunkLocation
+    {
+        public int Version;
+        public long Offset;
+        public int Length;
+    }
+
+    //The persistent index of the chunks stored by every version, from their
+    //hashes to where they were stored. See ChunkStore.h.
+    public class ChunkStore : IDisposable
+    {
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private extern static int chunk_store_open(out IntPtr store, string path, uint strongHashAlgorithm);
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private extern static void chunk_store_close(IntPtr store);
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private extern static int chunk_store_lookup(IntPtr store, byte[] hash, out ulong version, out ulong offset, out uint length);
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private extern static int chunk_store_insert(IntPtr store, byte[] hash, ulong version, ulong offset, uint length);
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private extern static int chunk_store_commit(IntPtr store);
+
+        //Must match StrongHashAlgorithm in StrongHash.h. A chunk is taken to
+        //be the one stored before if only their hashes match, so the hash
+        //must be cryptographic.
+        public const uint Sha1StrongHash = 0;
+        public const int HashSize = 20;
+        private const int ErrorAlreadyExists = 183;
+        private const int ErrorNotFound = 1168;
+
+        private IntPtr _store;
+
+        public ChunkStore(string path)
+        {
+            var result = chunk_store_open(out _store, path, Sha1StrongHash);
+            if (result != 0)
+                throw new Win32Exception(result);
+        }
+
+        public bool Lookup(byte[] hash, out ChunkLocation location)
+        {
+            ulong version, offset;
+            uint length;
+            location = new ChunkLocation();
+            var result = chunk_store_lookup(_store, hash, out version, out offset, out length);
+            if (result == ErrorNotFound)
+                return false;
+            if (result != 0)
+                throw new Win32Exception(result);
+            location.Version = (int)version;
+            location.Offset = (long)offset;
+            location.Length = (int)length;
+            return true;
+        }
+
+        //Inserted chunks can be looked up right away, but are only saved by
+        //Commit().
+        public void Insert(byte[] hash, ChunkLocation location)
+        {
+            var result = chunk_store_insert(_store, hash, (ulong)location.Version, (ulong)location.Offset, (uint)location.Length);
+            if (result != 0 && result != ErrorAlreadyExists)
+                throw new Win32Exception(result);
+        }
+
+        public void Commit()
+        {
+            var result = chunk_store_commit(_store);
+            if (result != 0)
+                throw new Win32Exception(result);
+        }
+
+        public void Dispose()
+        {
+            Dispose(true);
+            GC.SuppressFinalize(this);
+        }
+
+        protected virtual void Dispose(bool disposing)
+        {
+            if (_store == IntPtr.Zero)
+                return;
+            chunk_store_close(_store);
+            _store = IntPtr.Zero;
+        }
+
+        ~ChunkStore()
+        {
+            Dispose(false);
+        }
+    }
+
+    //Splits data fed to it into content-defined chunks, and hashes each one
+    //for the ChunkStore.
+    public class Chunker : IDisposable
+    {
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private extern static int chunker_create(out IntPtr chunker, uint averageSize, uint strongHashAlgorithm);
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private extern static int chunker_scan(IntPtr chunker, byte[] buffer, int offset, int length, byte[] digest, out uint chunkLength);
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private extern static void chunker_finish(IntPtr chunker, byte[] digest, out uint chunkLength);
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private extern static void chunker_release(IntPtr chunker);
+
+        public const int AverageChunkSize = 8 << 10;
+        //ContentDefinedChunker never makes chunks longer than this.
+        public const int MaxChunkSize = AverageChunkSize * 4;
+
+        private IntPtr _chunker;
+
+        public Chunker()
+        {
+            var result = chunker_create(out _chunker, AverageChunkSize, ChunkStore.Sha1StrongHash);
+            if (result != 0)
+                throw new Win32Exception(result);
+        }
+
+        //Consumes bytes of the current chunk and returns how many. If the
+        //chunk ended there, chunkLength is set to its length and its hash is
+        //written to digest; otherwise chunkLength is 0.
+        public int Scan(byte[] buffer, int offset, int count, byte[] digest, out int chunkLength)
+        {
+            uint length;
+            var ret = chunker_scan(_chunker, buffer, offset, count, digest, out length);
+            chunkLength = (int)length;
+            return ret;
+        }
+
+        //Ends the last chunk, if any data was scanned since the previous one.
+        public int Finish(byte[] digest)
+        {
+            uint length;
+            chunker_finish(_chunker, digest, out length);
+            return (int)length;
+        }
+
+        public void Dispose()
+        {
+            Dispose(true);
+            GC.SuppressFinalize(this);
+        }
+
+        protected virtual void Dispose(bool disposing)
+        {
+            if (_chunker == IntPtr.Zero)
+                return;
+            chunker_release(_chunker);
+            _chunker = IntPtr.Zero;
+        }
+
+        ~Chunker()
+        {
+            Dispose(false);
+        }
+    }
+}
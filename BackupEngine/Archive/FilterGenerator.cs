@@ -13,6 +13,17 @@ namespace BackupEngine.Archive
 
     public class CompressionFilterGenerator : FilterGenerator
     {
+        private readonly LzmaEncoderOptions? _options;
+
+        public CompressionFilterGenerator()
+        {
+        }
+
+        public CompressionFilterGenerator(LzmaEncoderOptions options)
+        {
+            _options = options;
+        }
+
         public override InputFilter FilterInput(Stream stream, bool leaveOpen)
         {
             return new LzmaInputFilter(stream, leaveOpen);
@@ -20,6 +31,8 @@ namespace BackupEngine.Archive
 
         public override OutputFilter FilterOutput(Stream stream, bool leaveOpen)
         {
+            if (_options.HasValue)
+                return new LzmaOutputFilter(stream, _options.Value, leaveOpen);
             return new LzmaOutputFilter(stream, leaveOpen);
         }
 
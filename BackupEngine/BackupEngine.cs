@@ -10,6 +10,7 @@ using BackupEngine.FileSystem.FileSystemObjects;
 using BackupEngine.FileSystem.FileSystemObjects.Exceptions;
 using BackupEngine.Serialization;
 using BackupEngine.Util;
+using BackupEngine.Util.Streams;
 
 namespace BackupEngine
 {
@@ -115,6 +116,21 @@ namespace BackupEngine
             return GetVersionPath(version) + ".sha256";
         }
 
+        internal string GetSignatureDirectory(int version)
+        {
+            return Path.Combine(TargetLocation, string.Format("version{0}.signatures", version.ToString("00000000")));
+        }
+
+        internal string GetChunkStorePath()
+        {
+            return Path.Combine(TargetLocation, "chunks.idx");
+        }
+
+        internal string GetSignaturePath(int version, ulong streamId)
+        {
+            return Path.Combine(GetSignatureDirectory(version), string.Format("{0}.sig", streamId.ToString("x16")));
+        }
+
         protected ArchiveReader OpenLatestVersion()
         {
             return new ArchiveReader(GetVersionPath(Versions.Back()));
@@ -122,7 +138,8 @@ namespace BackupEngine
 
         private void SetVersions()
         {
-            var regex = new Regex(@".*\\?version([0-9]+)\.arc", RegexOptions.IgnoreCase);
+            //Anchored, so that unfinished versions (.arc.tmp) are not listed.
+            var regex = new Regex(@".*\\?version([0-9]+)\.arc$", RegexOptions.IgnoreCase);
             Versions.AddRange(Directory.EnumerateFiles(TargetLocation)
                 .Select(x => regex.Match(x))
                 .Where(x => x.Success)
@@ -170,6 +187,16 @@ namespace BackupEngine
             get { return HashType.Default; }
         }
 
+        //Files for which this returns true get an rsync signature saved next to
+        //the version while they are archived, so that the next version can
+        //compute their deltas without reading this one back. Nothing consumes
+        //the signatures until rsync mode is implemented, so none are made by
+        //default.
+        public virtual bool ShouldGenerateSignature(FileSystemObject newFile)
+        {
+            return false;
+        }
+
         private SystemOperations.VolumeSnapshot _currentSnapshot;
         private Dictionary<string, SystemOperations.VolumeInfo> _currentVolumes;
         private List<Tuple<Regex, string>> _pathMapper;
@@ -242,6 +269,20 @@ namespace BackupEngine
         }
 
         public bool UseSnapshots = true;
+        //How new versions are compressed. A field left at 0 is chosen by the
+        //encoder, except Preset; see LzmaEncoderOptions.
+        public LzmaEncoderOptions CompressionOptions = LzmaEncoderOptions.Default;
+        //If set, native reads from the volumes being backed up (and their
+        //shadows) are paced to this budget for the duration of the backup.
+        public SystemOperations.IoBudget SourceIoBudget;
+        //Read the files being archived, and write the archive, without going
+        //through the system cache, so that a backup doesn't evict everything
+        //else from memory.
+        public bool UnbufferedIo;
+        //Store data that any version already stored, in any file, as a
+        //reference to that copy. Versions made this way depend on the ones
+        //they refer to.
+        public bool Deduplicate;
 
         public void PerformBackup()
         {
@@ -249,7 +290,7 @@ namespace BackupEngine
             _currentVolumes = SystemOperations.EnumerateVolumes().Where(x => IsBackupable(x.DriveType)).ToDictionary(x => x.VolumePath);
             if (!UseSnapshots)
             {
-                PerformBackupInner(startTime);
+                WithSourceIoBudget(_currentVolumes.Keys, () => PerformBackupInner(startTime));
                 return;
             }
             Console.WriteLine("Creating shadows.");
@@ -261,11 +302,33 @@ namespace BackupEngine
                     break;
                 }
                 SetPathMapper();
-                PerformBackupInner(startTime);
+                var volumes = _currentVolumes.Keys.Concat(_currentSnapshot.Shadows.Select(x => x.SnapshotDeviceObject.EnsureLastCharacterIsNotBackslash() + @"\"));
+                WithSourceIoBudget(volumes, () => PerformBackupInner(startTime));
             }
             _currentSnapshot = null;
         }
 
+        private void WithSourceIoBudget(IEnumerable<string> volumes, Action action)
+        {
+            if (SourceIoBudget == null)
+            {
+                action();
+                return;
+            }
+            var list = volumes.ToList();
+            foreach (var volume in list)
+                SystemOperations.SetVolumeIoBudget(volume, SourceIoBudget);
+            try
+            {
+                action();
+            }
+            finally
+            {
+                foreach (var volume in list)
+                    SystemOperations.SetVolumeIoBudget(volume, null);
+            }
+        }
+
         private void PerformBackupInner(DateTime startTime)
         {
             Console.WriteLine("Performing backup.");
@@ -345,6 +408,15 @@ namespace BackupEngine
         public void RestoreBackup()
         {
             VersionForRestore latestVersion = null;
+            //Archives opened to read the chunks that others refer to.
+            var chunkSources = new Dictionary<int, ArchiveReader>();
+            Func<int, ArchiveReader> openVersion = x =>
+            {
+                ArchiveReader ret;
+                if (!chunkSources.TryGetValue(x, out ret))
+                    chunkSources[x] = ret = new ArchiveReader(GetVersionPath(x));
+                return ret;
+            };
             try
             {
                 Console.WriteLine("Initializing structures...");
@@ -379,7 +451,8 @@ namespace BackupEngine
                 {
                     using (var archive = new ArchiveReader(GetVersionPath(versionNumber)))
                     {
-                        archive.Begin((streamId, stream) =>
+                        archive.OpenVersion = openVersion;
+                        archive.ForEachStream(restoreLater.Select(x => x.StreamUniqueId), (streamId, stream) =>
                         {
                             var index = restoreLater.BinaryFindFirst(x => x.StreamUniqueId >= streamId);
                             if (index >= restoreLater.Count)
@@ -408,6 +481,7 @@ namespace BackupEngine
             {
                 if (latestVersion != null)
                     latestVersion.Dispose();
+                chunkSources.Values.ForEach(x => x.Dispose());
             }
         }
 
@@ -491,13 +565,24 @@ namespace BackupEngine
             return newStream;
         }
 
+        //Only native reads can be unbuffered or paced to SourceIoBudget.
+        private Stream OpenForArchiving(FileSystemObject fso)
+        {
+            if (UnbufferedIo || SourceIoBudget != null)
+                return new NativeFileInputStream(fso.MappedPath, UnbufferedIo);
+            return fso.OpenForExclusiveRead();
+        }
+
         private void GenerateArchive(DateTime startTime, Func<FileSystemObject, Dictionary<Guid, BackupStream>, BackupStream> streamGenerator, int versionNumber = 0)
         {
             var firstStreamId = NextStreamUniqueId;
             var firstDiffId = NextDifferentialChainUniqueId;
             var versionPath = GetVersionPath(versionNumber);
-            using (var archive = new ArchiveWriter(versionPath))
+            using (var chunkStore = Deduplicate ? new ChunkStore(GetChunkStorePath()) : null)
+            using (var archive = new ArchiveWriter(versionPath, CompressionOptions, UnbufferedIo))
             {
+                if (chunkStore != null)
+                    archive.Deduplicate(chunkStore, versionNumber);
                 var streamDict = GenerateStreams(streamGenerator);
                 var versionDependencies = new HashSet<int>();
 
@@ -515,9 +600,18 @@ namespace BackupEngine
                         var fso = backupStream.FileSystemObjects[0];
                         var compute = fso.GetHash(HashAlgorithm) == null;
                         var type = compute ? HashAlgorithm : HashType.None;
-                        var digest = archive.AddFile(backupStream.UniqueId, fso.OpenForExclusiveRead(), type);
-                        if (compute)
-                            fso.Hashes[HashAlgorithm] = digest;
+                        string signaturePath = null;
+                        if (ShouldGenerateSignature(fso))
+                        {
+                            Directory.CreateDirectory(GetSignatureDirectory(versionNumber));
+                            signaturePath = GetSignaturePath(versionNumber, backupStream.UniqueId);
+                        }
+                        using (var file = OpenForArchiving(fso))
+                        {
+                            var digest = archive.AddFile(backupStream.UniqueId, file, type, signaturePath);
+                            if (compute)
+                                fso.Hashes[HashAlgorithm] = digest;
+                        }
                     }
                 }
 
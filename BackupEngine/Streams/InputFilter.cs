@@ -74,5 +74,14 @@ namespace BackupEngine.Util.Streams
             Stream.Write(buffer, offset, count);
             BytesWritten += count;
         }
+
+        //Announces that a file of the given size is written next, for filters
+        //that adapt to their input. Passed down the chain by default.
+        public virtual void BeginFile(long size)
+        {
+            var next = Stream as OutputFilter;
+            if (next != null)
+                next.BeginFile(size);
+        }
     }
 }
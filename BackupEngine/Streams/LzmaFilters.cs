@@ -1,4 +1,5 @@
 ﻿using System;
+using System.ComponentModel;
 using System.IO;
 using System.Runtime.InteropServices;
 
@@ -29,10 +30,61 @@ namespace BackupEngine.Util.Streams
         }
     }
 
+    //Decompresses one frame of an archive whose only filter is compression,
+    //starting a given number of bytes into it.
+    internal class ArchiveFrameStream : NativeInputStream
+    {
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private extern static int open_archive_frame(out IntPtr stream, string path, ulong frameOffset, ulong frameSize, ulong skip);
+
+        private static IntPtr Open(string path, long frameOffset, long frameSize, long skip)
+        {
+            IntPtr ret;
+            var result = open_archive_frame(out ret, path, (ulong)frameOffset, (ulong)frameSize, (ulong)skip);
+            if (result != 0)
+                throw new Win32Exception(result);
+            return ret;
+        }
+
+        public ArchiveFrameStream(string path, long frameOffset, long frameSize, long skip)
+            : base(Open(path, frameOffset, frameSize, skip))
+        {
+        }
+    }
+
+    //Mirrors LzmaEncoderOptions in lzma.h. Fields left at 0 are chosen by
+    //the encoder, which fills in every field with what it actually used.
+    //Preset is the exception: 0 is the fastest level, so default(...) asks
+    //for it. Start from Default instead.
+    [StructLayout(LayoutKind.Sequential)]
+    public struct LzmaEncoderOptions
+    {
+        public ulong BlockSize;
+        public ulong DictionarySize;
+        //In bytes. Threads are dropped first to fit it, then the dictionary
+        //is shrunk, unless it was given.
+        public ulong MemoryLimit;
+        //Output only.
+        public ulong MemoryUsage;
+        public uint Preset;
+        public uint Extreme;
+        //0 for one per processor.
+        public uint Threads;
+
+        public static LzmaEncoderOptions Default
+        {
+            get { return new LzmaEncoderOptions { Preset = 7 }; }
+        }
+    }
+
     public class LzmaOutputStream : NativeOutputStream
     {
         [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
         private extern static IntPtr filter_output_stream_through_lzma(IntPtr stream);
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private extern static int filter_output_stream_through_lzma_with_options(out IntPtr result, IntPtr stream, ref LzmaEncoderOptions options);
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private extern static void lzma_output_stream_begin_file(IntPtr stream, ulong size);
 
         private static IntPtr Filter(EncapsulatableOutputStream stream)
         {
@@ -47,10 +99,39 @@ namespace BackupEngine.Util.Streams
             }
         }
 
+        private static IntPtr Filter(EncapsulatableOutputStream stream, ref LzmaEncoderOptions options)
+        {
+            var encapsulated = EncapsulateDotNetOutputStream(stream);
+            try
+            {
+                IntPtr ret;
+                var result = filter_output_stream_through_lzma_with_options(out ret, encapsulated, ref options);
+                if (result != 0)
+                    throw new Win32Exception(result);
+                return ret;
+            }
+            finally
+            {
+                release_output_stream(encapsulated);
+            }
+        }
+
         public LzmaOutputStream(EncapsulatableOutputStream stream)
             : base(Filter(stream))
         {
         }
+
+        public LzmaOutputStream(EncapsulatableOutputStream stream, ref LzmaEncoderOptions options)
+            : base(Filter(stream, ref options))
+        {
+        }
+
+        //Lets the encoder pick filters (BCJ, delta) for the file that the
+        //next write starts.
+        public void BeginFile(long size)
+        {
+            lzma_output_stream_begin_file(Handle, (ulong)size);
+        }
     }
 
     public class LzmaInputFilter : InputFilter
@@ -81,17 +162,37 @@ namespace BackupEngine.Util.Streams
     {
         private Stream _filteredStream;
 
+        //The settings the encoder chose.
+        public LzmaEncoderOptions Options { get; private set; }
+
         private static Stream Filter(Stream stream)
         {
             return new LzmaOutputStream(new EncapsulatedOutputStream(stream));
         }
 
+        private static Stream Filter(Stream stream, ref LzmaEncoderOptions options)
+        {
+            return new LzmaOutputStream(new EncapsulatedOutputStream(stream), ref options);
+        }
+
         public LzmaOutputFilter(Stream stream, bool keepOpen = true)
             : base(Filter(stream), keepOpen)
         {
             _filteredStream = stream;
         }
 
+        public LzmaOutputFilter(Stream stream, LzmaEncoderOptions options, bool keepOpen = true)
+            : base(Filter(stream, ref options), keepOpen)
+        {
+            _filteredStream = stream;
+            Options = options;
+        }
+
+        public override void BeginFile(long size)
+        {
+            ((LzmaOutputStream)Stream).BeginFile(size);
+        }
+
         protected override void InternalDispose()
         {
             if (_filteredStream == null)
@@ -1,5 +1,8 @@
 ﻿using System;
+using System.ComponentModel;
+using System.IO;
 using System.Runtime.InteropServices;
+using BackupEngine.FileSystem;
 
 namespace BackupEngine.Util.Streams
 {
@@ -94,7 +97,40 @@ namespace BackupEngine.Util.Streams
 
         protected override int InternalRead(byte[] buffer, int offset, int count)
         {
-            return read_from_input_stream(_stream, buffer, offset, count);
+            var ret = read_from_input_stream(_stream, buffer, offset, count);
+            if (ret < 0)
+                throw new IOException("Native stream read failed.", new Win32Exception(-ret));
+            return ret;
+        }
+    }
+
+    //Reads a file from native code, which paces the reads to the I/O budget
+    //of the volume and, if asked, bypasses the system cache.
+    public class NativeFileInputStream : NativeInputStream
+    {
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private extern static int open_file_input_stream(out IntPtr stream, string path, bool unbuffered);
+
+        private readonly long _length;
+
+        private static IntPtr Open(string path, bool unbuffered)
+        {
+            IntPtr ret;
+            var result = open_file_input_stream(out ret, path, unbuffered);
+            if (result != 0)
+                throw new Win32Exception(result);
+            return ret;
+        }
+
+        public NativeFileInputStream(string path, bool unbuffered = false)
+            : base(Open(path, unbuffered))
+        {
+            _length = FileSystemOperations.GetFileSize(path);
+        }
+
+        public override long Length
+        {
+            get { return _length; }
         }
     }
 
@@ -103,9 +139,9 @@ namespace BackupEngine.Util.Streams
         private IntPtr _stream;
 
         [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
-        private extern static void write_to_output_stream(IntPtr stream, byte[] buffer, int offset, int length);
+        private extern static int write_to_output_stream(IntPtr stream, byte[] buffer, int offset, int length);
         [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
-        private extern static void flush_output_stream(IntPtr stream);
+        private extern static int flush_output_stream(IntPtr stream);
         [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
         public extern static void release_output_stream(IntPtr stream);
 
@@ -175,6 +211,11 @@ namespace BackupEngine.Util.Streams
             _stream = stream;
         }
 
+        protected IntPtr Handle
+        {
+            get { return _stream; }
+        }
+
         protected override void Dispose(bool disposing)
         {
             if (_stream != IntPtr.Zero)
@@ -191,12 +232,53 @@ namespace BackupEngine.Util.Streams
 
         public override void Flush()
         {
-            flush_output_stream(_stream);
+            var result = flush_output_stream(_stream);
+            if (result != 0)
+                throw new Win32Exception(result);
         }
 
         public override void Write(byte[] buffer, int offset, int count)
         {
-            write_to_output_stream(_stream, buffer, offset, count);
+            var result = write_to_output_stream(_stream, buffer, offset, count);
+            if (result != 0)
+                throw new Win32Exception(result);
+        }
+    }
+
+    //Creates a file and writes it from a native background thread, so that
+    //the caller only waits for the disk when the chunks in flight are full.
+    public class WriteBehindFileStream : NativeOutputStream
+    {
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private extern static int open_write_behind_output_stream(out IntPtr stream, string path, bool unbuffered);
+
+        private static IntPtr Open(string path, bool unbuffered)
+        {
+            IntPtr ret;
+            var result = open_write_behind_output_stream(out ret, path, unbuffered);
+            if (result != 0)
+                throw new Win32Exception(result);
+            return ret;
+        }
+
+        public WriteBehindFileStream(string path, bool unbuffered = false)
+            : base(Open(path, unbuffered))
+        {
+        }
+
+        //Filters flush at every frame boundary, where waiting for the disk
+        //would stall the writer. Errors still surface on later writes, and
+        //FlushToDisk() has the last word.
+        public override void Flush()
+        {
+        }
+
+        //Waits for everything written so far to reach the disk, and throws
+        //if any of it couldn't be written. Disposing without calling this
+        //loses errors.
+        public void FlushToDisk()
+        {
+            base.Flush();
         }
     }
 }
@@ -0,0 +1,69 @@
+﻿using System;
+using System.ComponentModel;
+using System.IO;
+using System.Runtime.InteropServices;
+
+namespace BackupEngine.Util.Streams
+{
+    //Computes the rsync signature of the data read through it, to be saved
+    //for the next incremental backup.
+    public class SignatureCalculatorInputFilter : InputFilter
+    {
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private extern static int signature_builder_create(out IntPtr builder, ulong expectedFileSize, uint strongHashAlgorithm);
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private extern static void signature_builder_update(IntPtr builder, byte[] buffer, int offset, int length);
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private extern static int signature_builder_save(IntPtr builder, string path);
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private extern static void signature_builder_release(IntPtr builder);
+
+        //Must match StrongHashAlgorithm in StrongHash.h.
+        public const uint Murmur3StrongHash = 1;
+
+        private IntPtr _builder;
+
+        public SignatureCalculatorInputFilter(Stream stream, long expectedLength, bool keepOpen = true)
+            : base(stream, keepOpen)
+        {
+            var result = signature_builder_create(out _builder, (ulong)expectedLength, Murmur3StrongHash);
+            if (result != 0)
+                throw new Win32Exception(result);
+        }
+
+        protected override int InternalRead(byte[] buffer, int offset, int count)
+        {
+            var ret = base.InternalRead(buffer, offset, count);
+            signature_builder_update(_builder, buffer, offset, ret);
+            return ret;
+        }
+
+        //Finishes the signature and writes it to path. Nothing more can be
+        //read afterwards.
+        public void Save(string path)
+        {
+            var result = signature_builder_save(_builder, path);
+            if (result != 0)
+                throw new Win32Exception(result);
+        }
+
+        private void ReleaseBuilder()
+        {
+            if (_builder == IntPtr.Zero)
+                return;
+            signature_builder_release(_builder);
+            _builder = IntPtr.Zero;
+        }
+
+        protected override void Dispose(bool disposing)
+        {
+            ReleaseBuilder();
+            base.Dispose(disposing);
+        }
+
+        ~SignatureCalculatorInputFilter()
+        {
+            Dispose(false);
+        }
+    }
+}
@@ -77,6 +77,29 @@ namespace BackupEngine.Util
             }
         }
 
+        [DllImport("BackupEngineNativePart64.dll", CharSet = CharSet.Unicode, CallingConvention = CallingConvention.Cdecl)]
+        private static extern void set_volume_io_budget(string path, double bytesPerSecond, double operationsPerSecond, double latencyTargetMs);
+
+        //Mirrors IoBudget in IoThrottle.h. A field left at 0 sets no limit.
+        public class IoBudget
+        {
+            public double BytesPerSecond;
+            public double OperationsPerSecond;
+            //While requests take longer than this on average, the rates are
+            //lowered below the budget.
+            public double LatencyTargetMs;
+        }
+
+        //Paces the native reads and writes to the volume that contains path.
+        //A null budget removes the limit.
+        public static void SetVolumeIoBudget(string path, IoBudget budget)
+        {
+            if (budget == null)
+                set_volume_io_budget(path, 0, 0, 0);
+            else
+                set_volume_io_budget(path, budget.BytesPerSecond, budget.OperationsPerSecond, budget.LatencyTargetMs);
+        }
+
         public static List<VolumeInfo> EnumerateVolumes()
         {
             var ret = new List<VolumeInfo>();
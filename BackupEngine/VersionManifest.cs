@@ -26,6 +26,14 @@ namespace BackupEngine
         public List<long> EntrySizes;
         public List<ulong> StreamIds;
         public List<long> StreamSizes;
+        //protobuf-net numbers implicit fields in name order, so new fields
+        //must sort after the ones above. Null in archives whose file data is
+        //a single frame.
+        public SeekIndex StreamsSeekIndex;
+        //The streams that are partly or wholly made of chunks stored before,
+        //by this version or by others. For the rest, the stored data is the
+        //whole stream. Null if there are none.
+        public List<SegmentedStream> StreamsSegments;
 
         public void EnsureNonNull()
         {
@@ -44,4 +52,39 @@ namespace BackupEngine
         //
         //public CompressionMethodType CompressionMethod;
     }
+
+    //File data is split into frames, each filtered on its own, so that a
+    //stream can be read without unfiltering everything before it. Frames
+    //only start between streams.
+    [ProtoContract(ImplicitFields = ImplicitFields.AllPublic)]
+    public class SeekIndex
+    {
+        //Where each frame starts in the archive. A frame ends where the next
+        //one starts, or where the base objects start.
+        public List<long> FrameOffsets;
+        //The index of the first stream of each frame.
+        public List<int> FirstStreams;
+    }
+
+    [ProtoContract(ImplicitFields = ImplicitFields.AllPublic)]
+    public class SegmentedStream
+    {
+        //The index of the stream in StreamIds.
+        public int Stream;
+        //The stream is these segments, one after the other.
+        public List<StreamSegment> Segments;
+    }
+
+    [ProtoContract(ImplicitFields = ImplicitFields.AllPublic)]
+    public class StreamSegment
+    {
+        public long Length;
+        //Where the data is, in the file data of Version as a ChunkLocation.
+        //Only for references.
+        public long Offset;
+        //If not set, the segment is the next Length bytes stored for the
+        //stream itself.
+        public bool Reference;
+        public int Version;
+    }
 }
@@ -0,0 +1,112 @@
+#include "stdafx.h"
+#include "BlockPipeline.h"
+
+namespace{
+
+class StallTimer{
+	LARGE_INTEGER start;
+public:
+	StallTimer(){
+		QueryPerformanceCounter(&this->start);
+	}
+	double seconds() const{
+		LARGE_INTEGER now, frequency;
+		QueryPerformanceCounter(&now);
+		QueryPerformanceFrequency(&frequency);
+		return double(now.QuadPart - this->start.QuadPart) / frequency.QuadPart;
+	}
+};
+
+}
+
+PipelineStatistics &PipelineStatistics::operator+=(const PipelineStatistics &other){
+	this->blocks += other.blocks;
+	this->producer_stalls += other.producer_stalls;
+	this->producer_stall_seconds += other.producer_stall_seconds;
+	this->consumer_stalls += other.consumer_stalls;
+	this->consumer_stall_seconds += other.consumer_stall_seconds;
+	return *this;
+}
+
+BlockPipeline::BlockPipeline(size_t block_size, unsigned depth):
+		pool(std::max<size_t>(block_size, 1)),
+		slots(std::max<unsigned>(depth, 1)),
+		sizes(std::max<unsigned>(depth, 1)),
+		block_size(std::max<size_t>(block_size, 1)),
+		written(0),
+		producer_view_of_read(0),
+		read(0),
+		consumer_view_of_written(0),
+		closed(false){}
+
+byte_t *BlockPipeline::begin_write(){
+	const auto depth = this->slots.size();
+	auto written = this->written.load(std::memory_order_relaxed);
+	if (written - this->producer_view_of_read >= depth){
+		this->producer_view_of_read = this->read.load(std::memory_order_acquire);
+		if (written - this->producer_view_of_read >= depth){
+			StallTimer timer;
+			this->statistics.producer_stalls++;
+			auto slot_free = [&](){
+				this->producer_view_of_read = this->read.load(std::memory_order_acquire);
+				return written - this->producer_view_of_read < depth;
+			};
+			// The event stays set if the consumer signalled it since the
+			// last wait, so it cannot miss a slot freed in between.
+			if (!spin_until(slot_free))
+				while (!slot_free())
+					this->producer_event.wait();
+			this->statistics.producer_stall_seconds += timer.seconds();
+		}
+	}
+	auto &slot = this->slots[written % depth];
+	if (!slot.data())
+		slot = this->pool.acquire();
+	return slot.data();
+}
+
+void BlockPipeline::end_write(size_t size){
+	auto written = this->written.load(std::memory_order_relaxed);
+	this->sizes[written % this->slots.size()] = std::min(size, this->block_size);
+	this->written.store(written + 1, std::memory_order_release);
+	this->consumer_event.set();
+}
+
+void BlockPipeline::close(){
+	this->closed.store(true, std::memory_order_release);
+	this->consumer_event.set();
+}
+
+bool BlockPipeline::begin_read(const byte_t *&data, size_t &size){
+	auto read = this->read.load(std::memory_order_relaxed);
+	if (this->consumer_view_of_written == read){
+		this->consumer_view_of_written = this->written.load(std::memory_order_acquire);
+		if (this->consumer_view_of_written == read){
+			StallTimer timer;
+			this->statistics.consumer_stalls++;
+			auto block_ready = [&](){
+				// Blocks are all written before the pipeline is closed, so
+				// check for it first.
+				auto closed = this->closed.load(std::memory_order_acquire);
+				this->consumer_view_of_written = this->written.load(std::memory_order_acquire);
+				return closed || this->consumer_view_of_written != read;
+			};
+			if (!spin_until(block_ready))
+				while (!block_ready())
+					this->consumer_event.wait();
+			this->statistics.consumer_stall_seconds += timer.seconds();
+			if (this->consumer_view_of_written == read)
+				return false;
+		}
+	}
+	auto index = read % this->slots.size();
+	data = this->slots[index].data();
+	size = this->sizes[index];
+	return true;
+}
+
+void BlockPipeline::end_read(){
+	this->read.store(this->read.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	this->statistics.blocks++;
+	this->producer_event.set();
+}
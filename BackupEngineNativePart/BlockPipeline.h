@@ -0,0 +1,105 @@
+#pragma once
+#include "Threads.h"
+#include "BufferPool.h"
+#include <atomic>
+
+struct PipelineStatistics{
+	// Blocks that went through the pipeline.
+	std::uint64_t blocks;
+	// How many times, and for how long in total, the producer had to wait
+	// for a free slot.
+	std::uint64_t producer_stalls;
+	double producer_stall_seconds;
+	// How many times, and for how long in total, the consumer had to wait
+	// for a block.
+	std::uint64_t consumer_stalls;
+	double consumer_stall_seconds;
+
+	PipelineStatistics():
+		blocks(0),
+		producer_stalls(0),
+		producer_stall_seconds(0),
+		consumer_stalls(0),
+		consumer_stall_seconds(0){}
+	PipelineStatistics &operator+=(const PipelineStatistics &);
+};
+
+/*
+Hands blocks of up to block_size bytes from exactly one producer thread to
+exactly one consumer thread, through a ring of depth slots. Slot memory is
+allocated the first time a slot is used and recycled from then on, so the
+memory used is bounded by depth * block_size no matter how far the consumer
+falls behind; a producer that finds the ring full waits for the consumer.
+Slots come from a BufferPool, so they are page-aligned and can be handed to
+unbuffered I/O directly.
+
+Neither side takes a lock, and a side that finds the ring full or empty
+polls for a little while before sleeping, so while both keep up a hand-off
+costs a few atomic operations.
+
+Producer:
+	auto p = pipeline.begin_write();
+	// fill up to pipeline.get_block_size() bytes at p
+	pipeline.end_write(size);
+	...
+	pipeline.close();
+
+Consumer:
+	while (pipeline.begin_read(p, size)){
+		// use [p; p + size)
+		pipeline.end_read();
+	}
+*/
+class BlockPipeline{
+	BufferPool pool;
+	std::vector<WritableBuffer> slots;
+	std::vector<size_t> sizes;
+	size_t block_size;
+	// Only ever incremented; a count modulo the depth is a slot index. Each
+	// is written by one side and kept on its own cache line, along with that
+	// side's last look at the other's count.
+	std::atomic<size_t> written;
+	size_t producer_view_of_read;
+	char padding1[64];
+	std::atomic<size_t> read;
+	size_t consumer_view_of_written;
+	char padding2[64];
+	std::atomic<bool> closed;
+	AutoResetEvent producer_event;
+	AutoResetEvent consumer_event;
+	// The producer only updates the producer fields, and the consumer the
+	// rest.
+	PipelineStatistics statistics;
+
+	BlockPipeline(const BlockPipeline &){}
+	void operator=(const BlockPipeline &){}
+public:
+	static const unsigned default_depth = 8;
+
+	BlockPipeline(size_t block_size = 1, unsigned depth = default_depth);
+	size_t get_block_size() const{
+		return this->block_size;
+	}
+	size_t get_depth() const{
+		return this->slots.size();
+	}
+
+	// Producer side. Returns the slot to fill next, waiting for one to be
+	// free if needed.
+	byte_t *begin_write();
+	// Publishes the slot returned by the last begin_write().
+	void end_write(size_t size);
+	// No more blocks will be written.
+	void close();
+
+	// Consumer side. Waits for the next block; returns false once the
+	// pipeline is closed and drained.
+	bool begin_read(const byte_t *&data, size_t &size);
+	// Gives the slot returned by the last begin_read() back to the producer.
+	void end_read();
+
+	// Only meaningful once both sides are done.
+	const PipelineStatistics &get_statistics() const{
+		return this->statistics;
+	}
+};
@@ -0,0 +1,170 @@
+#include "stdafx.h"
+#include "BufferPool.h"
+#include "Threads.h"
+#ifndef _MSC_VER
+#include <cstdlib>
+#endif
+
+struct BufferPoolState{
+	Mutex mutex;
+	size_t buffer_size;
+	PooledBuffer *free_list;
+	size_t allocation_count;
+	// One for the pool object, plus one for every buffer that exists, in
+	// use or not.
+	size_t references;
+	bool closed;
+};
+
+static byte_t *allocate_aligned(size_t size){
+#ifdef _MSC_VER
+	auto ret = (byte_t *)_aligned_malloc(size, BufferPool::alignment);
+#else
+	void *ret;
+	if (posix_memalign(&ret, BufferPool::alignment, size))
+		ret = nullptr;
+#endif
+	if (!ret)
+		throw std::bad_alloc();
+	return (byte_t *)ret;
+}
+
+static void free_aligned(byte_t *p){
+#ifdef _MSC_VER
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+static void free_buffer(PooledBuffer *buffer){
+	free_aligned(buffer->memory);
+	delete buffer;
+}
+
+static void release_buffer(SharedBuffer *buffer){
+	if (buffer->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		buffer->release(buffer);
+}
+
+static void recycle_buffer(SharedBuffer *shared){
+	auto buffer = static_cast<PooledBuffer *>(shared);
+	auto state = buffer->pool;
+	bool destroy_state;
+	{
+		AutoMutex am(state->mutex);
+		if (!state->closed){
+			buffer->next_free = state->free_list;
+			state->free_list = buffer;
+			return;
+		}
+		destroy_state = !--state->references;
+	}
+	free_buffer(buffer);
+	if (destroy_state)
+		delete state;
+}
+
+WritableBuffer::WritableBuffer(WritableBuffer &&other): buffer(other.buffer), m_capacity(other.m_capacity){
+	other.buffer = nullptr;
+	other.m_capacity = 0;
+}
+
+WritableBuffer &WritableBuffer::operator=(WritableBuffer &&other){
+	if (this != &other){
+		this->reset();
+		std::swap(this->buffer, other.buffer);
+		std::swap(this->m_capacity, other.m_capacity);
+	}
+	return *this;
+}
+
+void WritableBuffer::reset(){
+	if (this->buffer)
+		release_buffer(this->buffer);
+	this->buffer = nullptr;
+	this->m_capacity = 0;
+}
+
+BufferView WritableBuffer::publish(size_t size){
+	if (!this->buffer)
+		return BufferView();
+	BufferView ret(this->buffer, this->buffer->memory, std::min(size, this->m_capacity));
+	// The reference moves to the view.
+	this->buffer = nullptr;
+	this->m_capacity = 0;
+	return ret;
+}
+
+void BufferView::reset(){
+	if (this->buffer)
+		release_buffer(this->buffer);
+	this->buffer = nullptr;
+	this->m_data = nullptr;
+	this->m_size = 0;
+}
+
+BufferPool::BufferPool(size_t buffer_size): state(new BufferPoolState){
+	this->state->buffer_size = std::max<size_t>(buffer_size, 1);
+	this->state->free_list = nullptr;
+	this->state->allocation_count = 0;
+	this->state->references = 1;
+	this->state->closed = false;
+}
+
+BufferPool::~BufferPool(){
+	PooledBuffer *list;
+	bool destroy_state;
+	{
+		AutoMutex am(this->state->mutex);
+		this->state->closed = true;
+		list = this->state->free_list;
+		this->state->free_list = nullptr;
+		for (auto p = list; p; p = p->next_free)
+			this->state->references--;
+		destroy_state = !--this->state->references;
+	}
+	while (list){
+		auto next = list->next_free;
+		free_buffer(list);
+		list = next;
+	}
+	// Buffers still referenced elsewhere keep the state alive and free it
+	// when the last of them is released.
+	if (destroy_state)
+		delete this->state;
+}
+
+WritableBuffer BufferPool::acquire(){
+	auto state = this->state;
+	{
+		AutoMutex am(state->mutex);
+		if (state->free_list){
+			auto ret = state->free_list;
+			state->free_list = ret->next_free;
+			ret->references.store(1, std::memory_order_relaxed);
+			return WritableBuffer(ret, state->buffer_size);
+		}
+	}
+	std::unique_ptr<PooledBuffer> ret(new PooledBuffer);
+	ret->pool = state;
+	ret->memory = allocate_aligned(state->buffer_size);
+	ret->references.store(1, std::memory_order_relaxed);
+	ret->release = recycle_buffer;
+	ret->next_free = nullptr;
+	{
+		AutoMutex am(state->mutex);
+		state->references++;
+		state->allocation_count++;
+	}
+	return WritableBuffer(ret.release(), state->buffer_size);
+}
+
+size_t BufferPool::get_buffer_size() const{
+	return this->state->buffer_size;
+}
+
+size_t BufferPool::get_allocation_count() const{
+	AutoMutex am(this->state->mutex);
+	return this->state->allocation_count;
+}
@@ -0,0 +1,140 @@
+#pragma once
+#include <atomic>
+
+class BufferPool;
+class BufferView;
+struct BufferPoolState;
+
+// Memory that BufferViews point into. release() is called once the last
+// reference is dropped, to recycle or free it.
+struct SharedBuffer{
+	std::atomic<long> references;
+	void (*release)(SharedBuffer *);
+};
+
+// A block of memory owned by a BufferPool. Never handled directly; see
+// WritableBuffer and BufferView.
+struct PooledBuffer : public SharedBuffer{
+	BufferPoolState *pool;
+	byte_t *memory;
+	PooledBuffer *next_free;
+};
+
+/*
+Exclusive access to a buffer just taken from a pool. Whoever fills it calls
+publish() once done, which gives up write access in exchange for a read-only
+view. Destroying it without publishing returns the buffer to the pool.
+*/
+class WritableBuffer{
+	PooledBuffer *buffer;
+	size_t m_capacity;
+
+	WritableBuffer(const WritableBuffer &){}
+	void operator=(const WritableBuffer &){}
+public:
+	WritableBuffer(): buffer(nullptr), m_capacity(0){}
+	WritableBuffer(PooledBuffer *buffer, size_t capacity): buffer(buffer), m_capacity(capacity){}
+	WritableBuffer(WritableBuffer &&);
+	WritableBuffer &operator=(WritableBuffer &&);
+	~WritableBuffer(){
+		this->reset();
+	}
+	void reset();
+	byte_t *data() const{
+		return this->buffer ? this->buffer->memory : nullptr;
+	}
+	size_t capacity() const{
+		return this->m_capacity;
+	}
+	// Returns a view of the first size bytes and leaves this object empty.
+	BufferView publish(size_t size);
+};
+
+/*
+A read-only window into a shared buffer, usually a pooled one. Copies share
+the buffer; a pooled buffer goes back to its pool when the last view of it is
+destroyed, which may happen on any thread and after the pool itself is gone.
+*/
+class BufferView{
+	SharedBuffer *buffer;
+	const byte_t *m_data;
+	size_t m_size;
+
+	void add_reference() const{
+		if (this->buffer)
+			this->buffer->references.fetch_add(1, std::memory_order_relaxed);
+	}
+public:
+	BufferView(): buffer(nullptr), m_data(nullptr), m_size(0){}
+	// Takes over a reference the caller already holds.
+	BufferView(SharedBuffer *buffer, const byte_t *data, size_t size): buffer(buffer), m_data(data), m_size(size){}
+	BufferView(const BufferView &other): buffer(other.buffer), m_data(other.m_data), m_size(other.m_size){
+		this->add_reference();
+	}
+	BufferView(BufferView &&other): buffer(other.buffer), m_data(other.m_data), m_size(other.m_size){
+		other.buffer = nullptr;
+		other.m_data = nullptr;
+		other.m_size = 0;
+	}
+	BufferView &operator=(const BufferView &other){
+		other.add_reference();
+		this->reset();
+		this->buffer = other.buffer;
+		this->m_data = other.m_data;
+		this->m_size = other.m_size;
+		return *this;
+	}
+	BufferView &operator=(BufferView &&other){
+		if (this != &other){
+			this->reset();
+			std::swap(this->buffer, other.buffer);
+			std::swap(this->m_data, other.m_data);
+			std::swap(this->m_size, other.m_size);
+		}
+		return *this;
+	}
+	~BufferView(){
+		this->reset();
+	}
+	void reset();
+	const byte_t *data() const{
+		return this->m_data;
+	}
+	size_t size() const{
+		return this->m_size;
+	}
+	// A view of [offset; offset + size) of this one, sharing its buffer.
+	BufferView slice(size_t offset, size_t size) const{
+		offset = std::min(offset, this->m_size);
+		size = std::min(size, this->m_size - offset);
+		this->add_reference();
+		return BufferView(this->buffer, this->m_data + offset, size);
+	}
+	void remove_prefix(size_t n){
+		n = std::min(n, this->m_size);
+		this->m_data += n;
+		this->m_size -= n;
+	}
+};
+
+/*
+Hands out page-aligned buffers of a fixed size and takes them back once
+nothing references them. New memory is only allocated when every buffer made
+so far is still in use, so a producer and consumer that keep a bounded
+number of buffers alive stop allocating after the first few.
+*/
+class BufferPool{
+	BufferPoolState *state;
+
+	BufferPool(const BufferPool &){}
+	void operator=(const BufferPool &){}
+public:
+	static const size_t alignment = 4096;
+
+	BufferPool(size_t buffer_size = alignment);
+	~BufferPool();
+	WritableBuffer acquire();
+	size_t get_buffer_size() const;
+	// Number of buffers allocated over the lifetime of the pool.
+	size_t get_allocation_count() const;
+};
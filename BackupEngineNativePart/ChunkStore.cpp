@@ -0,0 +1,315 @@
+#include "stdafx.h"
+#include "ChunkStore.h"
+#include "MiscFunctions.h"
+#include "MiscTypes.h"
+#include "streams.h"
+#include "ExportedFunctions.h"
+
+static const char chunk_store_magic[8] = { 'B', 'E', 'C', 'H', 'U', 'N', 'K', 'S' };
+static const u32 chunk_store_version = 1;
+static const unsigned bloom_bits_per_entry = 10;
+
+// Hashes are already uniformly distributed, so their bytes can be used as
+// integers directly.
+static u64 hash_word(const byte_t *hash, size_t i){
+	u64 ret;
+	memcpy(&ret, hash + i * sizeof(ret), sizeof(ret));
+	return ret;
+}
+
+// Orders like memcmp() on the first 8 bytes.
+static u64 hash_prefix(const byte_t *hash){
+	u64 ret = 0;
+	for (size_t i = 0; i < sizeof(ret); i++)
+		ret = (ret << 8) | hash[i];
+	return ret;
+}
+
+ChunkStore::ChunkStore(const wchar_t *path, StrongHashAlgorithm algorithm):
+		path(path),
+		file(INVALID_HANDLE_VALUE),
+		strong_hash_algorithm(algorithm),
+		entry_count(0),
+		bloom_hashes(0){
+	this->open();
+}
+
+ChunkStore::~ChunkStore(){
+	this->close();
+}
+
+void ChunkStore::close(){
+	if (valid_handle(this->file))
+		CloseHandle(this->file);
+	this->file = INVALID_HANDLE_VALUE;
+}
+
+void ChunkStore::open(){
+	this->close();
+	this->entry_count = 0;
+	this->fences.clear();
+	this->bloom.clear();
+	this->bloom_hashes = 0;
+	auto path = path_from_string(this->path.c_str());
+	this->file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (!valid_handle(this->file)){
+		auto error = GetLastError();
+		if (error != ERROR_FILE_NOT_FOUND)
+			throw Win32Error(error);
+		return;
+	}
+
+	Header header;
+	this->read_at(0, &header, sizeof(header));
+	if (memcmp(header.magic, chunk_store_magic, sizeof(header.magic)) || header.version != chunk_store_version)
+		throw ChunkStoreFormatError();
+	if (header.strong_hash_algorithm != (u32)this->strong_hash_algorithm)
+		throw ChunkStoreFormatError();
+	this->entry_count = header.entry_count;
+	auto page_count = (this->entry_count + entries_per_page - 1) / entries_per_page;
+	file_offset_t offset = sizeof(header) + this->entry_count * sizeof(Entry);
+	this->fences.resize((size_t)page_count);
+	if (page_count)
+		this->read_at(offset, &this->fences[0], (size_t)page_count * sizeof(u64));
+	offset += page_count * sizeof(u64);
+	this->bloom.resize((size_t)header.bloom_words);
+	this->bloom_hashes = header.bloom_hashes;
+	if (this->bloom.size())
+		this->read_at(offset, &this->bloom[0], this->bloom.size() * sizeof(u64));
+}
+
+void ChunkStore::read_at(file_offset_t offset, void *buffer, size_t size){
+	LARGE_INTEGER li;
+	li.QuadPart = offset;
+	if (!SetFilePointerEx(this->file, li, nullptr, FILE_BEGIN))
+		throw Win32Error();
+	while (size){
+		DWORD bytes_read;
+		if (!ReadFile(this->file, buffer, (DWORD)std::min<size_t>(size, 1 << 30), &bytes_read, nullptr))
+			throw Win32Error();
+		if (!bytes_read)
+			throw ChunkStoreFormatError();
+		buffer = (char *)buffer + bytes_read;
+		size -= bytes_read;
+	}
+}
+
+// The filter's size is a power of two, so that bit indices are just masked.
+static void bloom_add(std::vector<u64> &bloom, u32 hashes, const byte_t *hash){
+	const u64 mask = bloom.size() * 64 - 1;
+	auto h1 = hash_word(hash, 0),
+		h2 = hash_word(hash, 1) | 1;
+	for (u32 i = 0; i < hashes; i++){
+		auto bit = (h1 + i * h2) & mask;
+		bloom[(size_t)(bit / 64)] |= (u64)1 << (bit % 64);
+	}
+}
+
+bool ChunkStore::bloom_test(const byte_t *hash) const{
+	if (!this->bloom.size())
+		return false;
+	const u64 mask = this->bloom.size() * 64 - 1;
+	auto h1 = hash_word(hash, 0),
+		h2 = hash_word(hash, 1) | 1;
+	for (u32 i = 0; i < this->bloom_hashes; i++){
+		auto bit = (h1 + i * h2) & mask;
+		if (!((this->bloom[(size_t)(bit / 64)] >> (bit % 64)) & 1))
+			return false;
+	}
+	return true;
+}
+
+bool ChunkStore::find_on_disk(const byte_t *hash, Entry &dst){
+	if (!this->entry_count)
+		return false;
+	auto prefix = hash_prefix(hash);
+	// Entries with this prefix may start in the page before the first page
+	// whose fence is not smaller than it.
+	auto page = (size_t)(std::lower_bound(this->fences.begin(), this->fences.end(), prefix) - this->fences.begin());
+	if (page)
+		page--;
+	Entry entries[entries_per_page];
+	for (; page < this->fences.size() && this->fences[page] <= prefix; page++){
+		auto first = (u64)page * entries_per_page;
+		auto count = (size_t)std::min<u64>(entries_per_page, this->entry_count - first);
+		this->read_at(sizeof(Header) + first * sizeof(Entry), entries, count * sizeof(Entry));
+		Entry key;
+		memcpy(key.hash, hash, hash_size);
+		auto i = std::lower_bound(entries, entries + count, key);
+		if (i != entries + count && !memcmp(i->hash, hash, hash_size)){
+			dst = *i;
+			return true;
+		}
+		if (i != entries + count)
+			break;
+	}
+	return false;
+}
+
+bool ChunkStore::lookup(const byte_t *hash, chunk_location &dst){
+	Entry entry;
+	memcpy(entry.hash, hash, hash_size);
+	auto i = this->pending.find(entry);
+	if (i != this->pending.end())
+		entry = *i;
+	else if (!this->bloom_test(hash) || !this->find_on_disk(hash, entry))
+		return false;
+	dst.archive_id = entry.archive_id;
+	dst.offset = entry.offset;
+	dst.length = entry.length;
+	return true;
+}
+
+bool ChunkStore::insert(const byte_t *hash, const chunk_location &location){
+	chunk_location existing;
+	if (this->lookup(hash, existing))
+		return false;
+	Entry entry;
+	memcpy(entry.hash, hash, hash_size);
+	entry.length = location.length;
+	entry.archive_id = location.archive_id;
+	entry.offset = location.offset;
+	this->pending.insert(entry);
+	return true;
+}
+
+void ChunkStore::commit(){
+	if (!this->pending.size())
+		return;
+	std::vector<Entry> pending(this->pending.begin(), this->pending.end());
+	std::sort(pending.begin(), pending.end());
+	auto total = this->entry_count + pending.size();
+
+	u64 bloom_bits = 1 << 16;
+	while (bloom_bits < total * bloom_bits_per_entry)
+		bloom_bits <<= 1;
+	std::vector<u64> bloom((size_t)(bloom_bits / 64), 0);
+	// About ln(2) times the bits per entry.
+	const u32 bloom_hashes = 7;
+
+	auto temp_path = this->path + L".new";
+	{
+		FileOutputStream output(temp_path.c_str());
+		Header header;
+		zero_struct(header);
+		memcpy(header.magic, chunk_store_magic, sizeof(header.magic));
+		header.version = chunk_store_version;
+		header.strong_hash_algorithm = (u32)this->strong_hash_algorithm;
+		header.entry_count = total;
+		header.bloom_words = bloom.size();
+		header.bloom_hashes = bloom_hashes;
+		output.write(&header, sizeof(header));
+
+		// Merge the entries on disk with the pending ones, a page at a time.
+		std::vector<u64> fences;
+		fences.reserve((size_t)((total + entries_per_page - 1) / entries_per_page));
+		std::vector<Entry> old_entries(entries_per_page),
+			page;
+		page.reserve(entries_per_page);
+		u64 old_read = 0;
+		size_t old_position = 0,
+			old_available = 0;
+		auto next_pending = pending.begin();
+		for (u64 written = 0; written < total; written++){
+			if (old_position == old_available && old_read < this->entry_count){
+				old_available = (size_t)std::min<u64>(entries_per_page, this->entry_count - old_read);
+				this->read_at(sizeof(Header) + old_read * sizeof(Entry), &old_entries[0], old_available * sizeof(Entry));
+				old_read += old_available;
+				old_position = 0;
+			}
+			const Entry *entry;
+			if (old_position < old_available && (next_pending == pending.end() || old_entries[old_position] < *next_pending))
+				entry = &old_entries[old_position++];
+			else
+				entry = &*next_pending++;
+			if (!page.size())
+				fences.push_back(hash_prefix(entry->hash));
+			page.push_back(*entry);
+			bloom_add(bloom, bloom_hashes, entry->hash);
+			if (page.size() == entries_per_page || written + 1 == total){
+				output.write(&page[0], page.size() * sizeof(Entry));
+				page.clear();
+			}
+		}
+		output.write(&fences[0], fences.size() * sizeof(u64));
+		output.write(&bloom[0], bloom.size() * sizeof(u64));
+		output.flush();
+	}
+
+	this->close();
+	auto from = path_from_string(temp_path.c_str()),
+		to = path_from_string(this->path.c_str());
+	if (!MoveFileExW(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+		throw Win32Error();
+	this->pending.clear();
+	this->open();
+}
+
+EXPORT_THIS int chunk_store_open(void **object, const wchar_t *path, unsigned strong_hash_algorithm){
+	*object = nullptr;
+	try{
+		*object = new ChunkStore(path, (StrongHashAlgorithm)strong_hash_algorithm);
+	}catch (Win32Error &e){
+		return e.error;
+	}catch (ChunkStoreFormatError &){
+		return ERROR_INVALID_DATA;
+	}catch (std::bad_alloc &){
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}catch (std::exception &){
+		return ERROR_INVALID_DATA;
+	}
+	return 0;
+}
+
+EXPORT_THIS void chunk_store_close(void *object){
+	delete (ChunkStore *)object;
+}
+
+EXPORT_THIS int chunk_store_lookup(void *object, const std::uint8_t *hash, std::uint64_t *archive_id, std::uint64_t *offset, std::uint32_t *length){
+	chunk_location location;
+	try{
+		if (!((ChunkStore *)object)->lookup(hash, location))
+			return ERROR_NOT_FOUND;
+	}catch (Win32Error &e){
+		return e.error;
+	}catch (std::exception &){
+		return ERROR_INVALID_DATA;
+	}
+	*archive_id = location.archive_id;
+	*offset = location.offset;
+	*length = location.length;
+	return 0;
+}
+
+EXPORT_THIS int chunk_store_insert(void *object, const std::uint8_t *hash, std::uint64_t archive_id, std::uint64_t offset, std::uint32_t length){
+	chunk_location location;
+	location.archive_id = archive_id;
+	location.offset = offset;
+	location.length = length;
+	try{
+		if (!((ChunkStore *)object)->insert(hash, location))
+			return ERROR_ALREADY_EXISTS;
+	}catch (Win32Error &e){
+		return e.error;
+	}catch (std::bad_alloc &){
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}catch (std::exception &){
+		return ERROR_INVALID_DATA;
+	}
+	return 0;
+}
+
+EXPORT_THIS int chunk_store_commit(void *object){
+	try{
+		((ChunkStore *)object)->commit();
+	}catch (Win32Error &e){
+		return e.error;
+	}catch (ChunkStoreFormatError &){
+		return ERROR_INVALID_DATA;
+	}catch (std::bad_alloc &){
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}catch (std::exception &){
+		return ERROR_INVALID_DATA;
+	}
+	return 0;
+}
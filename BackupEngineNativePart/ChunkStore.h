@@ -0,0 +1,104 @@
+#pragma once
+#include "StrongHash.h"
+#include <unordered_set>
+
+struct chunk_location{
+	u64 archive_id;
+	file_offset_t offset;
+	u32 length;
+};
+
+/*
+A persistent index from the strong hash of a chunk to where a copy of the
+chunk has already been stored, so that data seen before can be stored as a
+reference to that copy.
+
+On disk, the index is a single file:
+
+	header
+	entries, sorted by hash
+	fences: the first 8 bytes of the first hash of each page of entries
+	Bloom filter over every hash
+
+Only the header, the fences and the Bloom filter are kept in memory; for
+tens of millions of chunks that is a few tens of MiB. A lookup that passes
+the filter reads a single page of entries. Inserted chunks are kept in a
+hash table in memory and can be found right away, but they only reach the
+file when commit() merges them into a new index, which then replaces the
+old one.
+*/
+class ChunkStore{
+public:
+	static const size_t hash_size = strong_hash_size;
+#pragma pack(push, 1)
+	struct Entry{
+		byte_t hash[hash_size];
+		u32 length;
+		u64 archive_id;
+		file_offset_t offset;
+
+		bool operator<(const Entry &b) const{
+			return memcmp(this->hash, b.hash, hash_size) < 0;
+		}
+		bool operator==(const Entry &b) const{
+			return !memcmp(this->hash, b.hash, hash_size);
+		}
+	};
+	struct Header{
+		char magic[8];
+		u32 version;
+		u32 strong_hash_algorithm;
+		u64 entry_count;
+		u64 bloom_words;
+		u32 bloom_hashes;
+		u32 reserved;
+	};
+#pragma pack(pop)
+	static const size_t entries_per_page = 4096 / sizeof(Entry);
+private:
+	struct EntryHasher{
+		size_t operator()(const Entry &entry) const{
+			size_t ret;
+			memcpy(&ret, entry.hash, sizeof(ret));
+			return ret;
+		}
+	};
+
+	std::wstring path;
+	HANDLE file;
+	StrongHashAlgorithm strong_hash_algorithm;
+	u64 entry_count;
+	std::vector<u64> fences;
+	std::vector<u64> bloom;
+	u32 bloom_hashes;
+	std::unordered_set<Entry, EntryHasher> pending;
+
+	ChunkStore(const ChunkStore &){}
+	void operator=(const ChunkStore &){}
+	void close();
+	void open();
+	void read_at(file_offset_t offset, void *buffer, size_t size);
+	bool bloom_test(const byte_t *hash) const;
+	bool find_on_disk(const byte_t *hash, Entry &dst);
+public:
+	// Opens the index at path, or starts an empty one if it doesn't exist.
+	ChunkStore(const wchar_t *path, StrongHashAlgorithm = default_strong_hash_algorithm);
+	~ChunkStore();
+	StrongHashAlgorithm get_strong_hash_algorithm() const{
+		return this->strong_hash_algorithm;
+	}
+	u64 size() const{
+		return this->entry_count + this->pending.size();
+	}
+	bool lookup(const byte_t *hash, chunk_location &dst);
+	// Returns false without changing anything if the hash is already known.
+	bool insert(const byte_t *hash, const chunk_location &);
+	void commit();
+};
+
+class ChunkStoreFormatError : public std::exception{
+public:
+	const char *what() const override{
+		return "The chunk index is damaged or was written by an incompatible version.";
+	}
+};
@@ -0,0 +1,240 @@
+#include "stdafx.h"
+#include "ContentDefinedChunker.h"
+#include "StreamBlockReader.h"
+#include "MiscFunctions.h"
+#include "ExportedFunctions.h"
+
+namespace{
+
+struct GearTable{
+	u64 values[256];
+	GearTable(){
+		// splitmix64, so that the table is fixed without being spelled out.
+		u64 state = 0x4745415243444321ULL;
+		for (auto &value : this->values){
+			u64 z = (state += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			value = z ^ (z >> 31);
+		}
+	}
+};
+
+const GearTable gear;
+
+// Every bit of the Gear hash depends only on the bytes shifted into it since,
+// so only the highest bits see the whole 64-byte window.
+u64 high_bits_mask(unsigned bits){
+	return bits ? ~(u64)0 << (64 - bits) : 0;
+}
+
+}
+
+ContentDefinedChunker::ContentDefinedChunker(const Parameters &parameters): parameters(parameters){
+	unsigned bits = 6;
+	while (((size_t)1 << bits) < this->parameters.average_size)
+		bits++;
+	this->parameters.average_size = (size_t)1 << bits;
+	this->parameters.min_size = std::min(this->parameters.min_size, this->parameters.average_size);
+	this->parameters.max_size = std::max(this->parameters.max_size, this->parameters.average_size);
+	this->small_mask = high_bits_mask(bits + 2);
+	this->large_mask = high_bits_mask(bits - 2);
+	this->reset();
+}
+
+size_t ContentDefinedChunker::scan(const byte_t *buffer, size_t size, bool &boundary){
+	boundary = false;
+	size_t i = 0;
+	// Cut points are never looked for before min_size, so those bytes are
+	// skipped without hashing.
+	if (this->length < this->parameters.min_size){
+		i = std::min(size, this->parameters.min_size - this->length);
+		this->length += i;
+	}
+	auto hash = this->hash;
+	auto start = this->length - i;
+	if (this->length < this->parameters.average_size){
+		auto end = std::min(size, i + (this->parameters.average_size - this->length));
+		for (; i < end; i++){
+			hash = (hash << 1) + gear.values[buffer[i]];
+			if (!(hash & this->small_mask)){
+				boundary = true;
+				i++;
+				break;
+			}
+		}
+		this->length = start + i;
+	}
+	if (!boundary && this->length >= this->parameters.average_size){
+		auto end = std::min(size, i + (this->parameters.max_size - this->length));
+		for (; i < end; i++){
+			hash = (hash << 1) + gear.values[buffer[i]];
+			if (!(hash & this->large_mask)){
+				boundary = true;
+				i++;
+				break;
+			}
+		}
+		this->length = start + i;
+		if (this->length == this->parameters.max_size)
+			boundary = true;
+	}
+	if (boundary)
+		this->reset();
+	else
+		this->hash = hash;
+	return i;
+}
+
+ChunkedFile::ChunkedFile(const std::wstring &path, const ContentDefinedChunker::Parameters &parameters, StrongHashAlgorithm algorithm):
+		strong_hash_algorithm(algorithm){
+	ContentDefinedChunker chunker(parameters);
+	this->parameters = chunker.get_parameters();
+	this->chunks.reserve((size_t)(get_file_size(path.c_str()) / this->parameters.average_size + 1));
+
+	BlockByBlockReader reader(path.c_str(), 1 << 20);
+	StrongHash hash(algorithm);
+	FileDigest digest;
+	BufferView buffer;
+	chunk_table_item item;
+	item.file_offset = 0;
+	file_offset_t offset = 0;
+	while (reader.next_block(buffer)){
+		digest.update(buffer.data(), buffer.size());
+		const byte_t *p = buffer.data();
+		size_t size = buffer.size();
+		while (size){
+			bool boundary;
+			auto n = chunker.scan(p, size, boundary);
+			hash.update(p, n);
+			p += n;
+			size -= n;
+			offset += n;
+			if (!boundary)
+				continue;
+			item.length = offset - item.file_offset;
+			hash.final(item.complex_hash);
+			this->chunks.push_back(item);
+			item.file_offset = offset;
+		}
+	}
+	if (offset > item.file_offset){
+		item.length = offset - item.file_offset;
+		hash.final(item.complex_hash);
+		this->chunks.push_back(item);
+	}
+	digest.final(this->digest);
+}
+
+namespace{
+
+struct chunk_lookup_item{
+	const byte_t *complex_hash;
+	file_size_t length;
+	file_offset_t file_offset;
+
+	bool operator<(const chunk_lookup_item &b) const{
+		int cmp = memcmp(this->complex_hash, b.complex_hash, sizeof(chunk_table_item().complex_hash));
+		if (cmp)
+			return cmp < 0;
+		if (this->length != b.length)
+			return this->length < b.length;
+		return this->file_offset < b.file_offset;
+	}
+};
+
+void append_command(std::vector<rsync_command> &dst, file_offset_t offset, file_size_t length, bool copy_from_old){
+	if (dst.size()){
+		auto &last = dst.back();
+		if (last.copy_from_old() == copy_from_old && last.file_offset + last.get_length() == offset){
+			last.length += length;
+			return;
+		}
+	}
+	rsync_command command;
+	command.file_offset = offset;
+	command.length = length;
+	command.set_copy_from_old(copy_from_old);
+	dst.push_back(command);
+}
+
+}
+
+std::shared_ptr<std::vector<rsync_command> > ChunkedFile::compare(const ChunkedFile &old_file) const{
+	std::vector<chunk_lookup_item> lookup;
+	lookup.reserve(old_file.chunks.size());
+	for (auto &chunk : old_file.chunks){
+		chunk_lookup_item item = { chunk.complex_hash, chunk.length, chunk.file_offset };
+		lookup.push_back(item);
+	}
+	std::sort(lookup.begin(), lookup.end());
+
+	std::shared_ptr<std::vector<rsync_command> > ret(new std::vector<rsync_command>);
+	for (auto &chunk : this->chunks){
+		// Lowest offset with this hash and length, if any.
+		chunk_lookup_item key = { chunk.complex_hash, chunk.length, 0 };
+		auto i = std::lower_bound(lookup.begin(), lookup.end(), key);
+		if (i != lookup.end() && i->length == chunk.length && !memcmp(i->complex_hash, chunk.complex_hash, sizeof(chunk.complex_hash)))
+			append_command(*ret, i->file_offset, chunk.length, true);
+		else
+			append_command(*ret, chunk.file_offset, chunk.length, false);
+	}
+	return ret;
+}
+
+namespace{
+
+// Chunks a stream fed a buffer at a time, hashing each chunk as it goes.
+struct HashingChunker{
+	ContentDefinedChunker chunker;
+	StrongHash hash;
+	u32 length;
+
+	HashingChunker(const ContentDefinedChunker::Parameters &parameters, StrongHashAlgorithm algorithm):
+		chunker(parameters),
+		hash(algorithm),
+		length(0){}
+};
+
+}
+
+EXPORT_THIS int chunker_create(void **object, std::uint32_t average_size, unsigned strong_hash_algorithm){
+	*object = nullptr;
+	if (!is_known_strong_hash_algorithm(strong_hash_algorithm))
+		return ERROR_INVALID_PARAMETER;
+	try{
+		*object = new HashingChunker(ContentDefinedChunker::Parameters(average_size), (StrongHashAlgorithm)strong_hash_algorithm);
+	}catch (std::bad_alloc &){
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+	return 0;
+}
+
+EXPORT_THIS int chunker_scan(void *object, const std::uint8_t *buffer, int offset, int length, std::uint8_t *digest, std::uint32_t *chunk_length){
+	auto chunker = (HashingChunker *)object;
+	bool boundary;
+	auto n = chunker->chunker.scan(buffer + offset, length, boundary);
+	chunker->hash.update(buffer + offset, n);
+	chunker->length += (u32)n;
+	*chunk_length = 0;
+	if (boundary){
+		chunker->hash.final(digest);
+		*chunk_length = chunker->length;
+		chunker->length = 0;
+	}
+	return (int)n;
+}
+
+EXPORT_THIS void chunker_finish(void *object, std::uint8_t *digest, std::uint32_t *chunk_length){
+	auto chunker = (HashingChunker *)object;
+	*chunk_length = chunker->length;
+	if (!chunker->length)
+		return;
+	chunker->hash.final(digest);
+	chunker->chunker.reset();
+	chunker->length = 0;
+}
+
+EXPORT_THIS void chunker_release(void *object){
+	delete (HashingChunker *)object;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include "MiscTypes.h"
+#include "StrongHash.h"
+#include "FileDigest.h"
+
+/*
+Splits data into chunks at content-defined boundaries, so that inserting or
+removing bytes only changes the chunks around the edit. Boundaries are found
+with a Gear rolling hash, which depends on the last 64 bytes, and FastCDC's
+normalized chunking: before a chunk reaches the average size a harder
+condition (two more hash bits) must be met, and after it an easier one (two
+fewer), which keeps chunk sizes close to the average. No chunk is shorter
+than min_size unless it is the last, and none is longer than max_size.
+*/
+class ContentDefinedChunker{
+public:
+	struct Parameters{
+		size_t min_size,
+			average_size,
+			max_size;
+		Parameters(size_t average_size = 8 << 10):
+			min_size(average_size / 4),
+			average_size(average_size),
+			max_size(average_size * 4){}
+	};
+private:
+	Parameters parameters;
+	u64 small_mask,
+		large_mask;
+	u64 hash;
+	size_t length;
+public:
+	// average_size is rounded up to a power of two, and min_size and
+	// max_size are clamped around it.
+	ContentDefinedChunker(const Parameters & = Parameters());
+	const Parameters &get_parameters() const{
+		return this->parameters;
+	}
+	// Consumes bytes of the current chunk from buffer and returns how many.
+	// If the chunk ended at that point, boundary is set and the next call
+	// starts a new chunk.
+	size_t scan(const byte_t *buffer, size_t size, bool &boundary);
+	// Length of the current chunk so far.
+	size_t get_length() const{
+		return this->length;
+	}
+	void reset(){
+		this->hash = 0;
+		this->length = 0;
+	}
+};
+
+struct chunk_table_item{
+	file_offset_t file_offset;
+	file_size_t length;
+	byte_t complex_hash[20];
+};
+
+// The chunk table of a file, in file order.
+class ChunkedFile{
+	std::vector<chunk_table_item> chunks;
+	byte_t digest[file_digest_size];
+	ContentDefinedChunker::Parameters parameters;
+	StrongHashAlgorithm strong_hash_algorithm;
+public:
+	ChunkedFile(const std::wstring &path, const ContentDefinedChunker::Parameters & = ContentDefinedChunker::Parameters(), StrongHashAlgorithm = default_strong_hash_algorithm);
+	const std::vector<chunk_table_item> &get_chunks() const{
+		return this->chunks;
+	}
+	const byte *get_digest() const{
+		return this->digest;
+	}
+	StrongHashAlgorithm get_strong_hash_algorithm() const{
+		return this->strong_hash_algorithm;
+	}
+	/*
+	Returns the commands that rebuild this file from old_file, in the same form
+	FileComparer produces: chunks whose strong hash and length appear in
+	old_file are copied from it, the rest are taken from this file. Both files
+	must have been chunked with the same strong hash algorithm.
+	*/
+	std::shared_ptr<std::vector<rsync_command> > compare(const ChunkedFile &old_file) const;
+};
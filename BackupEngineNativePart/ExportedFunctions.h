@@ -2,6 +2,7 @@
 #include "streams.h"
 #define EXPORT_THIS extern "C" _declspec(dllexport)
 typedef void (*string_callback_t)(const wchar_t *);
+struct LzmaEncoderOptions;
 
 EXPORT_THIS bool is_reparse_point(const wchar_t *_path);
 EXPORT_THIS int get_reparse_point_target(const wchar_t *_path, unsigned long *unrecognized, string_callback_t f);
@@ -38,13 +39,54 @@ EXPORT_THIS int enumerate_volumes(enumerate_volumes_callback_t);
 EXPORT_THIS int enumerate_mounted_paths(const wchar_t *volume_path, string_callback_t cb);
 EXPORT_THIS void *encapsulate_dot_net_input_stream(DotNetInputStream::read_callback_t, DotNetInputStream::eof_callback_t, DotNetInputStream::release_callback_t);
 EXPORT_THIS void *encapsulate_dot_net_output_stream(DotNetOutputStream::write_callback_t, DotNetOutputStream::flush_callback_t, DotNetOutputStream::release_callback_t);
+// Returns the number of bytes read, or a negated Win32 error code.
 EXPORT_THIS int read_from_input_stream(void *stream, std::uint8_t *buffer, int offset, int length);
-EXPORT_THIS void write_to_output_stream(void *stream, std::uint8_t *buffer, int offset, int length);
-EXPORT_THIS void flush_output_stream(void *stream);
+// Both return a Win32 error code; errors of a write-behind stream show up
+// here, a call or two after the write that failed.
+EXPORT_THIS int write_to_output_stream(void *stream, std::uint8_t *buffer, int offset, int length);
+EXPORT_THIS int flush_output_stream(void *stream);
+// Both return a Win32 error code. See ReadAheadParameters::unbuffered.
+EXPORT_THIS int open_file_input_stream(void **stream, const wchar_t *path, bool unbuffered);
+EXPORT_THIS int open_write_behind_output_stream(void **stream, const wchar_t *path, bool unbuffered);
 EXPORT_THIS void release_input_stream(void *);
 EXPORT_THIS void release_output_stream(void *);
 EXPORT_THIS void *filter_input_stream_through_lzma(void *);
 EXPORT_THIS void *filter_output_stream_through_lzma(void *);
+// Fills in options with the settings chosen; see LzmaEncoderOptions. Returns
+// a Win32 error code, ERROR_INVALID_PARAMETER if the encoder can't be set up
+// with these options (e.g. the memory limit is too low for any dictionary).
+EXPORT_THIS int filter_output_stream_through_lzma_with_options(void **result, void *, LzmaEncoderOptions *options);
+EXPORT_THIS void lzma_output_stream_begin_file(void *, std::uint64_t size);
+EXPORT_THIS int open_archive_frame(void **stream, const wchar_t *path, std::uint64_t frame_offset, std::uint64_t frame_size, std::uint64_t skip);
+EXPORT_THIS int chunk_store_open(void **object, const wchar_t *path, unsigned strong_hash_algorithm);
+EXPORT_THIS void chunk_store_close(void *object);
+// Returns ERROR_NOT_FOUND if the hash isn't in the index.
+EXPORT_THIS int chunk_store_lookup(void *object, const std::uint8_t *hash, std::uint64_t *archive_id, std::uint64_t *offset, std::uint32_t *length);
+// Returns ERROR_ALREADY_EXISTS, and changes nothing, if the hash is known.
+EXPORT_THIS int chunk_store_insert(void *object, const std::uint8_t *hash, std::uint64_t archive_id, std::uint64_t offset, std::uint32_t length);
+EXPORT_THIS int chunk_store_commit(void *object);
+EXPORT_THIS int chunker_create(void **object, std::uint32_t average_size, unsigned strong_hash_algorithm);
+// Consumes bytes of the current chunk and returns how many. If the chunk ended
+// there, its strong hash is written to digest and its length to
+// *chunk_length; otherwise *chunk_length is set to 0.
+EXPORT_THIS int chunker_scan(void *object, const std::uint8_t *buffer, int offset, int length, std::uint8_t *digest, std::uint32_t *chunk_length);
+// Ends the current chunk, if it isn't empty, as chunker_scan() would.
+EXPORT_THIS void chunker_finish(void *object, std::uint8_t *digest, std::uint32_t *chunk_length);
+EXPORT_THIS void chunker_release(void *object);
+typedef void(*rsync_command_callback_t)(std::uint64_t file_offset, std::uint64_t length, bool copy_from_old);
+// Compares new_path against the file whose signature is at old_signature_path,
+// on thread_count threads (0 for one per processor), and calls callback for
+// each command that rebuilds the new file: copy length bytes from file_offset
+// of the old file, or take them from file_offset of the new one. If
+// new_signature_path is not null, the signature of the new file is saved
+// there. Returns a Win32 error code, ERROR_INVALID_DATA if the old signature
+// can't be used.
+EXPORT_THIS int compute_file_delta(const wchar_t *old_signature_path, const wchar_t *new_path, const wchar_t *new_signature_path, unsigned thread_count, rsync_command_callback_t callback);
+EXPORT_THIS int signature_builder_create(void **object, std::uint64_t expected_file_size, unsigned strong_hash_algorithm);
+EXPORT_THIS void signature_builder_update(void *object, const std::uint8_t *buffer, int offset, int length);
+EXPORT_THIS int signature_builder_save(void *object, const wchar_t *path);
+EXPORT_THIS void signature_builder_release(void *object);
+EXPORT_THIS void set_volume_io_budget(const wchar_t *path, double bytes_per_second, double operations_per_second, double latency_target_ms);
 EXPORT_THIS bool obtain_special_file_privileges();
 EXPORT_THIS bool fast_file_expansion(HANDLE handle, std::uint64_t new_size);
 typedef void(*keypair_callback_t)(const wchar_t *priv, const wchar_t *pub);
@@ -5,46 +5,11 @@
 #include "MiscTypes.h"
 #include "StreamBlockReader.h"
 #include "RsyncableFile.h"
-#include "binary_search.h"
-
-void simple_buffer::realloc(size_t capacity){
-	if (capacity != this->m_capacity){
-		if (capacity)
-			this->m_buffer.reset(new byte_t[capacity], [](byte_t *p){ delete[] p; });
-		else
-			this->m_buffer.reset();
-		this->m_capacity = capacity;
-	}
-	this->size = 0;
-}
-
-byte_t *simple_buffer::data(){
-	return this->m_buffer.get();
-}
-
-const byte_t *simple_buffer::data() const{
-	return this->m_buffer.get();
-}
-
-void simple_buffer::operator=(const circular_buffer &buffer){
-	this->realloc(buffer.size());
-	this->size = 0;
-	buffer.process_whole([this](const byte_t *buffer, size_t size){
-		memcpy(this->m_buffer.get() + this->size, buffer, size);
-		this->size += size;
-	});
-}
+#include "ExportedFunctions.h"
 
-template <typename T>
-int unsignedcmp(T a, T b){
-	if (a < b)
-		return -1;
-	else if (a > b)
-		return 1;
-	return 0;
-}
-
-AbstractFileComparer::AbstractFileComparer(): thread(nullptr){
+AbstractFileComparer::AbstractFileComparer(file_offset_t start_offset, file_offset_t end_offset):
+		start_offset(start_offset),
+		end_offset(end_offset){
 	this->result.reset(new std::vector<rsync_command>);
 }
 
@@ -56,31 +21,34 @@ void AbstractFileComparer::process(){
 	};
 	this->state = State::Initial;
 	this->started();
-	while (this->state != State::Final)
-		(this->*functions[(int)this->state])();
+	try{
+		while (this->state != State::Final)
+			(this->*functions[(int)this->state])();
+	}catch (...){
+		// The table thread must not be left waiting on a pipeline that is
+		// about to be destroyed.
+		this->finished();
+		throw;
+	}
 	this->finished();
 }
 
 void AbstractFileComparer::started(){
 	this->state = State::Initial;
 	if (this->thread_required())
-		this->thread = CreateThread(nullptr, 0, static_thread_func, this, 0, nullptr);
+		this->thread.reset(new Thread([this](){ this->thread_func(); }));
 }
 
 void AbstractFileComparer::finished(){
 	this->request_thread_stop();
-	if (this->thread){
-		WaitForSingleObject(this->thread, INFINITE);
-		CloseHandle(this->thread);
-		this->thread = nullptr;
-	}
+	this->thread.reset();
 }
 
 void AbstractFileComparer::state_Initial(){
 	this->reset_state();
-	this->new_offset = 0;
+	this->new_offset = this->start_offset;
 	this->old_offset = 0;
-	if (!this->read_more_data()){
+	if (this->new_offset >= this->end_offset || !this->read_more_data()){
 		this->state = State::Final;
 		return;
 	}
@@ -100,7 +68,7 @@ void AbstractFileComparer::state_Matching(){
 			auto matching_increment = this->matching_increment();
 			this->new_offset += matching_increment;
 			last->length += matching_increment;
-			if (!this->read_more_data()){
+			if (this->new_offset >= this->end_offset || !this->read_more_data()){
 				this->state = State::Final;
 				return;
 			}
@@ -124,6 +92,16 @@ void AbstractFileComparer::state_NonMatching(){
 
 	auto last = &this->result->back();
 	do{
+		if (this->new_offset >= this->end_offset){
+			this->state = State::Final;
+			return;
+		}
+		auto skipped = this->non_matching_scan();
+		if (skipped){
+			this->new_offset += skipped;
+			last->length += skipped;
+			continue;
+		}
 		auto non_matching_increment = this->non_matching_increment();
 		this->new_offset += non_matching_increment;
 		last->length += non_matching_increment;
@@ -136,14 +114,18 @@ void AbstractFileComparer::state_NonMatching(){
 	this->state = State::Matching;
 }
 
-FileComparer::FileComparer(const wchar_t *new_path, std::shared_ptr<RsyncableFile> old_file):
+FileComparer::FileComparer(const wchar_t *new_path, std::shared_ptr<RsyncableFile> old_file, file_offset_t start_offset, file_offset_t end_offset, unsigned pipeline_depth):
+		AbstractFileComparer(start_offset, end_offset),
 		old_file(old_file),
-		buffer(1){
+		strong_hash(old_file->get_strong_hash_algorithm()),
+		new_block(nullptr),
+		new_block_fill(0){
 	this->reader.reset(new ByteByByteReader(new_path, old_file->get_block_size()));
 	auto file_size = this->reader->size();
 	this->new_block_size = RsyncableFile::scaler_function(file_size);
-	this->new_buffer.realloc(this->new_block_size);
-	this->new_table.reserve(blocks_per_file(file_size, this->new_buffer.capacity()));
+	this->pipeline.reset(new BlockPipeline((size_t)this->new_block_size, pipeline_depth));
+	auto range_size = std::min(file_size, end_offset) - std::min(file_size, start_offset);
+	this->new_table.reserve(blocks_per_file(range_size, this->new_block_size));
 }
 
 const byte *FileComparer::get_old_digest() const{
@@ -152,26 +134,28 @@ const byte *FileComparer::get_old_digest() const{
 
 void FileComparer::request_thread_stop(){
 	this->process_new_buffer(true);
-	this->processing_queue.push_back(simple_buffer());
+	this->pipeline->close();
 }
 
 void FileComparer::reset_state(){
-	this->reader->seek(0);
+	this->reader->seek(this->get_start_offset());
+	this->new_data_offset = this->get_start_offset();
 }
 
 bool FileComparer::read_more_data(){
 	if (!this->read_another_block(this->buffer))
 		return false;
-	this->checksum = compute_rsync_rolling_checksum(this->buffer);
+	this->checksum = compute_rsync_rolling_checksum(this->buffer.data(), this->buffer.size());
 	return true;
 }
 
 bool FileComparer::non_matching_read_more_data(){
 	auto size = this->buffer.size();
-	this->checksum = subtract_rsync_rolling_checksum(this->checksum, this->buffer.pop(), size);
+	this->checksum = subtract_rsync_rolling_checksum(this->checksum, this->buffer.front(), size);
+	this->buffer.advance(1);
 	byte_t byte;
 	if (this->read_another_byte(byte)){
-		this->buffer.push(byte);
+		this->buffer.push_back(byte);
 		auto n = this->buffer.size();
 		this->checksum = add_rsync_rolling_checksum(this->checksum, byte, n);
 	} else if (!this->buffer.size())
@@ -180,43 +164,35 @@ bool FileComparer::non_matching_read_more_data(){
 	return true;
 }
 
+size_t FileComparer::non_matching_scan(){
+	auto window_size = this->buffer.size();
+	if (!this->buffer.full())
+		return 0;
+	const byte_t *incoming;
+	size_t available;
+	if (!this->reader->peek(incoming, available))
+		return 0;
+	// The bytes leaving the window are the window's own, oldest first, so
+	// scan no further than its length.
+	auto n = std::min(available, window_size);
+	n = (size_t)std::min<file_size_t>(n, this->bytes_left_in_range());
+	auto ret = scan_rsync_rolling_checksum(this->checksum, this->buffer.data(), incoming, n, window_size, *this->old_file);
+	this->add_block(incoming, ret);
+	this->buffer.slide(incoming, ret);
+	this->reader->skip(ret);
+	return ret;
+}
+
 bool FileComparer::search(bool offset_valid, file_offset_t target_offset){
-	if (this->old_file->does_not_contain(this->checksum))
-		return false;
-	const rsync_table_item *begin, *end,
-		*begin0, *end0,
-		*begin1, *end1,
-		*begin2, *end2;
-	this->old_file->get_table(begin, end);
-	triple_search(begin0, end0, begin, end, [this](const rsync_table_item &a){
-		return unsignedcmp(a.rolling_checksum, this->checksum);
-	});
-	if (begin0 == end0)
+	auto &index = this->old_file->get_index();
+	RsyncIndex::Group group;
+	if (!index.find(this->checksum, group))
 		return false;
 
-	byte_t hash[20];
-	{
-		CryptoPP::SHA1 sha1;
-		this->buffer.process_whole([&](const byte *buffer, size_t size){ sha1.Update(buffer, size); });
-		sha1.Final(hash);
-	}
-	triple_search(begin1, end1, begin0, end0, [&hash](const rsync_table_item &a){
-		return memcmp(a.complex_hash, hash, sizeof(a.complex_hash));
-	});
-	if (begin1 == end1)
-		return false;
-	while (1){
-		if (!offset_valid){
-			this->old_offset = begin1->file_offset;
-			return true;
-		}
-		triple_search(begin2, end2, begin1, end1, [=](const rsync_table_item &a){
-			return unsignedcmp(a.file_offset, target_offset);
-		});
-		if (begin2 != end2)
-			begin1 = begin2;
-		offset_valid = false;
-	}
+	byte_t hash[strong_hash_size];
+	this->strong_hash.update(this->buffer.data(), this->buffer.size());
+	this->strong_hash.final(hash);
+	return index.find(group, hash, offset_valid, target_offset, this->old_offset);
 }
 
 size_t FileComparer::matching_increment(){
@@ -238,28 +214,32 @@ bool FileComparer::read_another_byte(byte_t &dst){
 	return ret;
 }
 
-bool FileComparer::read_another_block(circular_buffer &buffer){
+bool FileComparer::read_another_block(sliding_window &buffer){
 	auto ret = this->reader->whole_block(buffer);
 	if (ret)
-		this->add_block(buffer);
+		this->add_block(buffer.data(), buffer.size());
 	return ret;
 }
 
 void FileComparer::add_byte(byte_t byte){
-	this->new_buffer.data()[this->new_buffer.size++] = byte;
+	if (this->new_data_offset >= this->get_end_offset())
+		return;
+	this->new_data_offset++;
+	if (!this->new_block)
+		this->new_block = this->pipeline->begin_write();
+	this->new_block[this->new_block_fill++] = byte;
 	this->process_new_buffer();
 }
 
-void FileComparer::add_block(circular_buffer &buffer){
-	buffer.process_whole([this](const byte_t *buf, size_t size){ this->add_block(buf, size); });
-}
-
 void FileComparer::add_block(const byte_t *buffer, size_t size){
+	size = (size_t)std::min<file_size_t>(size, this->get_end_offset() - this->new_data_offset);
+	this->new_data_offset += size;
 	while (size){
-		size_t begin = this->new_buffer.size;
-		auto consumed = std::min(this->new_buffer.capacity() - begin, size);
-		this->new_buffer.size += consumed;
-		memcpy(this->new_buffer.data() + begin, buffer, consumed);
+		if (!this->new_block)
+			this->new_block = this->pipeline->begin_write();
+		auto consumed = std::min(this->pipeline->get_block_size() - this->new_block_fill, size);
+		memcpy(this->new_block + this->new_block_fill, buffer, consumed);
+		this->new_block_fill += consumed;
 		this->process_new_buffer();
 		buffer += consumed;
 		size -= consumed;
@@ -267,44 +247,135 @@ void FileComparer::add_block(const byte_t *buffer, size_t size){
 }
 
 void FileComparer::process_new_buffer(bool force){
-	if (!force && !this->new_buffer.full())
+	if (!this->new_block_fill || (!force && this->new_block_fill < this->pipeline->get_block_size()))
 		return;
-	{
-		AutoMutex am(this->queue_mutex);
-		auto capacity = this->new_buffer.capacity();
-		this->processing_queue.push_back(this->new_buffer);
-		this->new_buffer = simple_buffer(capacity);
-	}
-	this->event.set();
+	this->pipeline->end_write(this->new_block_fill);
+	this->new_block = nullptr;
+	this->new_block_fill = 0;
 }
 
 void FileComparer::thread_func(){
-	file_offset_t offset = 0;
-	while (true){
-		simple_buffer buffer;
-		while (true){
-			{
-				AutoMutex am(this->queue_mutex);
-				if (this->processing_queue.size()){
-					buffer = this->processing_queue.front();
-					this->processing_queue.pop_front();
-					break;
-				}
-			}
-			this->event.wait();
-		}
-		if (!buffer)
-			break;
-
+	file_offset_t offset = this->get_start_offset();
+	StrongHash hash(this->get_strong_hash_algorithm());
+	const byte_t *buffer;
+	size_t size;
+	while (this->pipeline->begin_read(buffer, size)){
 		rsync_table_item item;
-		item.rolling_checksum = compute_rsync_rolling_checksum(buffer.data(), buffer.size);
-		CryptoPP::SHA1 sha1;
-		sha1.CalculateDigest(item.complex_hash, buffer.data(), buffer.size);
-		this->new_sha1.Update(buffer.data(), buffer.size);
+		item.rolling_checksum = compute_rsync_rolling_checksum(buffer, size);
+		hash.calculate_digest(item.complex_hash, buffer, size);
+		this->new_file_digest.update(buffer, size);
 		item.file_offset = offset;
 		this->new_table.push_back(item);
-		offset += buffer.size;
+		offset += size;
+		this->pipeline->end_read();
 	}
-	this->new_sha1.Final(this->new_digest);
+	this->new_file_digest.final(this->new_digest);
 	std::sort(this->new_table.begin(), this->new_table.end());
 }
+
+ParallelFileComparer::ParallelFileComparer(const wchar_t *new_path, std::shared_ptr<RsyncableFile> old_file, unsigned thread_count, unsigned pipeline_depth):
+		new_path(new_path),
+		old_file(old_file),
+		thread_count(thread_count ? thread_count : get_processor_count()),
+		pipeline_depth(pipeline_depth),
+		new_block_size(0){
+	this->result.reset(new std::vector<rsync_command>);
+}
+
+const byte *ParallelFileComparer::get_old_digest() const{
+	return this->old_file->get_digest();
+}
+
+StrongHashAlgorithm ParallelFileComparer::get_strong_hash_algorithm() const{
+	return this->old_file->get_strong_hash_algorithm();
+}
+
+// Appends the commands of a segment starting at new file offset start, minus
+// whatever part of them dst already covers. covered is the new file offset up
+// to which dst goes, and is updated.
+static void append_clipped_commands(std::vector<rsync_command> &dst, file_offset_t &covered, const std::vector<rsync_command> &src, file_offset_t start){
+	auto position = start;
+	for (auto command : src){
+		auto length = command.get_length();
+		auto next = position + length;
+		if (next <= covered){
+			position = next;
+			continue;
+		}
+		if (position < covered){
+			auto clipped = covered - position;
+			command.file_offset += clipped;
+			command.length -= clipped;
+			length -= clipped;
+		}
+		position = next;
+		covered = next;
+		if (dst.size()){
+			auto &last = dst.back();
+			if (last.copy_from_old() == command.copy_from_old() && last.file_offset + last.get_length() == command.file_offset){
+				last.length += length;
+				continue;
+			}
+		}
+		dst.push_back(command);
+	}
+}
+
+void ParallelFileComparer::process(){
+	auto file_size = get_file_size(this->new_path.c_str());
+	this->new_block_size = RsyncableFile::scaler_function(file_size);
+
+	const auto alignment = std::max(this->new_block_size, digest_segment_size);
+	auto segment_size = (file_size + this->thread_count - 1) / this->thread_count;
+	segment_size = std::max((segment_size + alignment - 1) / alignment * alignment, alignment);
+	auto segment_count = std::max<size_t>((size_t)((file_size + segment_size - 1) / segment_size), 1);
+
+	std::vector<std::shared_ptr<FileComparer> > comparers(segment_count);
+	for (size_t i = 0; i < segment_count; i++){
+		auto start = i * segment_size;
+		auto end = i + 1 < segment_count ? start + segment_size : std::numeric_limits<file_offset_t>::max();
+		comparers[i].reset(new FileComparer(this->new_path.c_str(), this->old_file, start, end, this->pipeline_depth));
+	}
+	parallel_for(segment_count, [&](size_t i){
+		comparers[i]->process();
+	}, this->thread_count);
+
+	this->result.reset(new std::vector<rsync_command>);
+	this->new_table.clear();
+	this->new_table.reserve(blocks_per_file(file_size, this->new_block_size));
+	FileDigest digest;
+	this->pipeline_statistics = PipelineStatistics();
+	file_offset_t covered = 0;
+	for (size_t i = 0; i < segment_count; i++){
+		auto &comparer = *comparers[i];
+		auto commands = comparer.get_result();
+		append_clipped_commands(*this->result, covered, *commands, i * segment_size);
+		auto table = comparer.get_new_table();
+		this->new_table.insert(this->new_table.end(), table.begin(), table.end());
+		digest.append(comparer.get_new_file_digest());
+		this->pipeline_statistics += comparer.get_pipeline_statistics();
+	}
+	digest.final(this->new_digest);
+	std::sort(this->new_table.begin(), this->new_table.end());
+}
+
+EXPORT_THIS int compute_file_delta(const wchar_t *old_signature_path, const wchar_t *new_path, const wchar_t *new_signature_path, unsigned thread_count, rsync_command_callback_t callback){
+	try{
+		ParallelFileComparer comparer(new_path, RsyncableFile::load(old_signature_path), thread_count);
+		comparer.process();
+		if (new_signature_path)
+			RsyncableFile(comparer).save(new_signature_path);
+		auto commands = comparer.get_result();
+		for (auto &command : *commands)
+			callback(command.file_offset, command.get_length(), command.copy_from_old());
+	}catch (Win32Error &e){
+		return e.error;
+	}catch (SignatureFormatError &){
+		return ERROR_INVALID_DATA;
+	}catch (std::bad_alloc &){
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}catch (std::exception &){
+		return ERROR_INVALID_DATA;
+	}
+	return 0;
+}
@@ -1,35 +1,16 @@
 #pragma once
 
 #include "circular_buffer.h"
+#include "sliding_window.h"
 #include "Threads.h"
+#include "StrongHash.h"
+#include "FileDigest.h"
+#include "BlockPipeline.h"
 class ByteByByteReader;
 class RsyncableFile;
 struct rsync_command;
 struct rsync_table_item;
 
-class simple_buffer{
-	std::shared_ptr<byte_t> m_buffer;
-	size_t m_capacity;
-public:
-	size_t size;
-	simple_buffer(size_t capacity = 0): m_capacity(0){
-		this->realloc(capacity);
-	}
-	void realloc(size_t capacity = 0);
-	byte_t *data();
-	const byte_t *data() const;
-	operator bool(){
-		return (bool)this->m_buffer;
-	}
-	size_t capacity() const{
-		return this->m_capacity;
-	}
-	bool full() const{
-		return this->size == this->m_capacity;
-	}
-	void operator=(const circular_buffer &);
-};
-
 class AbstractFileComparer{
 protected:
 	enum class State{
@@ -41,7 +22,11 @@ protected:
 private:
 	std::shared_ptr<std::vector<rsync_command> > result;
 	file_offset_t new_offset;
-	HANDLE thread;
+	// The range of the new file to produce commands for. The last match may
+	// extend past end_offset.
+	file_offset_t start_offset,
+		end_offset;
+	std::unique_ptr<Thread> thread;
 
 	typedef void (AbstractFileComparer::*state_function)();
 	void state_Initial();
@@ -49,22 +34,32 @@ private:
 	void state_NonMatching();
 	void started();
 	void finished();
-	static DWORD WINAPI static_thread_func(void *_this){
-		((AbstractFileComparer *)_this)->thread_func();
-		return 0;
-	}
 protected:
 	file_offset_t old_offset;
-	AutoResetEvent event;
 
 	State get_state() const{
 		return this->state;
 	}
+	file_offset_t get_start_offset() const{
+		return this->start_offset;
+	}
+	file_offset_t get_end_offset() const{
+		return this->end_offset;
+	}
+	file_size_t bytes_left_in_range() const{
+		return this->end_offset - this->new_offset;
+	}
 	virtual void reset_state(){}
 	virtual bool read_more_data() = 0;
 	virtual bool non_matching_read_more_data() = 0;
 	virtual size_t matching_increment() = 0;
 	virtual size_t non_matching_increment() = 0;
+	// Optionally advances through the non-matching state in bulk, stopping
+	// at the first position that might start a match. Returns how many bytes
+	// were skipped; 0 makes the state machine fall back to one byte per step.
+	virtual size_t non_matching_scan(){
+		return 0;
+	}
 	virtual bool search(bool offset_valid = false, file_offset_t target_offset = 0) = 0;
 	virtual void thread_func() = 0;
 	virtual void request_thread_stop() = 0;
@@ -72,7 +67,7 @@ protected:
 		return false;
 	}
 public:
-	AbstractFileComparer();
+	AbstractFileComparer(file_offset_t start_offset = 0, file_offset_t end_offset = std::numeric_limits<file_offset_t>::max());
 	virtual ~AbstractFileComparer(){}
 	void process();
 	std::shared_ptr<std::vector<rsync_command> > get_result(){
@@ -85,20 +80,24 @@ public:
 class FileComparer : public AbstractFileComparer{
 	std::shared_ptr<ByteByByteReader> reader;
 	std::shared_ptr<RsyncableFile> old_file;
-	circular_buffer buffer;
+	// The window of the new file being compared against the old file's blocks.
+	sliding_window buffer;
 	rolling_checksum_t checksum;
+	StrongHash strong_hash;
 	file_size_t new_block_size;
-	CryptoPP::SHA1 new_sha1;
-	byte_t new_digest[20];
-	simple_buffer new_buffer;
+	FileDigest new_file_digest;
+	file_offset_t new_data_offset;
+	byte_t new_digest[file_digest_size];
+	// Carries the new file's blocks to the thread that builds the new table.
+	// new_block is the slot being filled, or null between blocks.
+	std::unique_ptr<BlockPipeline> pipeline;
+	byte_t *new_block;
+	size_t new_block_fill;
 	std::vector<rsync_table_item> new_table;
-	Mutex queue_mutex;
-	std::deque<simple_buffer> processing_queue;
 	
 	bool read_another_byte(byte_t &);
-	bool read_another_block(circular_buffer &);
+	bool read_another_block(sliding_window &);
 	void add_byte(byte_t);
-	void add_block(circular_buffer &);
 	void add_block(const byte_t *, size_t);
 	void process_new_buffer(bool force = false);
 protected:
@@ -107,6 +106,7 @@ protected:
 	bool non_matching_read_more_data() override;
 	size_t matching_increment() override;
 	size_t non_matching_increment() override;
+	size_t non_matching_scan() override;
 	bool search(bool offset_valid = false, file_offset_t target_offset = 0) override;
 	void thread_func() override;
 	void request_thread_stop() override;
@@ -114,7 +114,67 @@ protected:
 		return true;
 	}
 public:
-	FileComparer(const wchar_t *new_path, std::shared_ptr<RsyncableFile> old_file);
+	// Only the range [start_offset; end_offset) of the new file is compared and
+	// included in the new table, which must then start and end on multiples
+	// of the new block size. At most pipeline_depth new blocks wait for the
+	// table thread at any time.
+	FileComparer(const wchar_t *new_path, std::shared_ptr<RsyncableFile> old_file, file_offset_t start_offset = 0, file_offset_t end_offset = std::numeric_limits<file_offset_t>::max(), unsigned pipeline_depth = BlockPipeline::default_depth);
+	std::vector<rsync_table_item> get_new_table() const{
+		return this->new_table;
+	}
+	const byte *get_old_digest() const;
+	const byte *get_new_digest() const{
+		return this->new_digest;
+	}
+	const FileDigest &get_new_file_digest() const{
+		return this->new_file_digest;
+	}
+	file_size_t get_new_block_size() const{
+		return this->new_block_size;
+	}
+	// The new table is built with the old file's algorithm, so that it can in
+	// turn serve as the old file of the next comparison.
+	StrongHashAlgorithm get_strong_hash_algorithm() const{
+		return this->strong_hash.get_algorithm();
+	}
+	// How often comparing and building the new table waited on each other.
+	// If the comparer stalls a lot, the table thread is the bottleneck and a
+	// deeper pipeline only helps with bursts; if the table thread stalls,
+	// the comparer is.
+	const PipelineStatistics &get_pipeline_statistics() const{
+		return this->pipeline->get_statistics();
+	}
+};
+
+/*
+Compares a new file against an old one by splitting the new file into
+segments, each compared by its own FileComparer on its own thread. Segments
+are aligned to both the new block size and the digest segment size, so that
+the new tables and digests of all segments can simply be concatenated.
+
+A segment's last match may run past its end. Matches crossing a boundary are
+kept that way, and the commands of the following segment are clipped to
+start where the previous ones stopped.
+*/
+class ParallelFileComparer{
+	std::wstring new_path;
+	std::shared_ptr<RsyncableFile> old_file;
+	unsigned thread_count;
+	unsigned pipeline_depth;
+	std::shared_ptr<std::vector<rsync_command> > result;
+	file_size_t new_block_size;
+	std::vector<rsync_table_item> new_table;
+	byte_t new_digest[file_digest_size];
+	PipelineStatistics pipeline_statistics;
+public:
+	// thread_count == 0 means one thread per processor.
+	ParallelFileComparer(const wchar_t *new_path, std::shared_ptr<RsyncableFile> old_file, unsigned thread_count = 0, unsigned pipeline_depth = BlockPipeline::default_depth);
+	void process();
+	std::shared_ptr<std::vector<rsync_command> > get_result(){
+		auto ret = this->result;
+		this->result.reset();
+		return ret;
+	}
 	std::vector<rsync_table_item> get_new_table() const{
 		return this->new_table;
 	}
@@ -125,5 +185,10 @@ public:
 	file_size_t get_new_block_size() const{
 		return this->new_block_size;
 	}
+	StrongHashAlgorithm get_strong_hash_algorithm() const;
+	// The sum over all segments.
+	const PipelineStatistics &get_pipeline_statistics() const{
+		return this->pipeline_statistics;
+	}
 };
 
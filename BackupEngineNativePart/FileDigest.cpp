@@ -0,0 +1,36 @@
+#include "stdafx.h"
+#include "FileDigest.h"
+
+void FileDigest::update(const byte_t *buffer, size_t size){
+	while (size){
+		auto n = (size_t)std::min<file_size_t>(digest_segment_size - this->segment_fill, size);
+		this->segment.Update(buffer, n);
+		this->segment_fill += n;
+		buffer += n;
+		size -= n;
+		if (this->segment_fill == digest_segment_size)
+			this->flush();
+	}
+}
+
+void FileDigest::flush(){
+	if (!this->segment_fill)
+		return;
+	auto n = this->segment_digests.size();
+	this->segment_digests.resize(n + file_digest_size);
+	this->segment.Final(&this->segment_digests[n]);
+	this->segment_fill = 0;
+}
+
+void FileDigest::append(const FileDigest &other){
+	this->flush();
+	this->segment_digests.insert(this->segment_digests.end(), other.segment_digests.begin(), other.segment_digests.end());
+}
+
+void FileDigest::final(byte_t *digest){
+	this->flush();
+	CryptoPP::SHA1 root;
+	if (this->segment_digests.size())
+		root.Update(&this->segment_digests[0], this->segment_digests.size());
+	root.Final(digest);
+}
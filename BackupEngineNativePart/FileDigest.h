@@ -0,0 +1,27 @@
+#pragma once
+
+/*
+The digest of a whole file is the SHA-1 of the concatenated SHA-1s of its
+consecutive digest_segment_size-byte segments, the last of which may be
+shorter. Unlike a plain SHA-1, this lets separate parts of a file be hashed
+independently and combined afterwards.
+*/
+const file_size_t digest_segment_size = 64 << 20;
+const size_t file_digest_size = CryptoPP::SHA1::DIGESTSIZE;
+
+class FileDigest{
+	CryptoPP::SHA1 segment;
+	file_size_t segment_fill;
+	std::vector<byte_t> segment_digests;
+public:
+	FileDigest(): segment_fill(0){}
+	void update(const byte_t *buffer, size_t size);
+	// Closes the current segment early. Only to be called at the end of the
+	// data, or at a multiple of digest_segment_size from the start.
+	void flush();
+	// Adds the segments of a digest of the data that follows this one's.
+	void append(const FileDigest &);
+	// Leaves the segment digests in place, so that the digest can still be
+	// appended to another one afterwards.
+	void final(byte_t *digest);
+};
@@ -1,3 +1,6 @@
 #pragma once
 
 const u32 mask_32bits = 0xFFFFFFFF;
+// Unbuffered I/O needs offsets, sizes and buffer addresses that are multiples
+// of the sector size. This covers both 512-byte and 4 KiB sectors.
+const size_t unbuffered_io_alignment = 4096;
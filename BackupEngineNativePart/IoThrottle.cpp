@@ -0,0 +1,193 @@
+#include "stdafx.h"
+#include "IoThrottle.h"
+#include "MiscFunctions.h"
+#include "ExportedFunctions.h"
+#include <chrono>
+#include <map>
+
+namespace{
+
+const double adaptation_period = 0.5;
+// Tokens saved up while the device is idle are capped at this many seconds'
+// worth, so that idling doesn't allow a burst afterwards.
+const double burst_seconds = 0.1;
+// Lowering the rate by this much at a time halves it in under three periods.
+const double slow_down_factor = 0.75;
+const double speed_up_fraction = 1.0 / 16;
+
+double now(){
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return double(counter.QuadPart) / frequency.QuadPart;
+}
+
+Mutex registry_mutex;
+std::map<std::wstring, std::shared_ptr<IoThrottle> > registry;
+// Spares get_io_throttle() the volume lookup while nothing is throttled.
+std::atomic<bool> any_budget(false);
+
+}
+
+void IoThrottle::TokenBucket::set_budget(double budget){
+	this->budget = std::max(budget, 0.0);
+	this->rate = this->budget;
+	this->tokens = std::min(this->tokens, this->rate * burst_seconds);
+}
+
+void IoThrottle::TokenBucket::refill(double elapsed){
+	if (this->rate)
+		this->tokens = std::min(this->tokens + elapsed * this->rate, this->rate * burst_seconds);
+}
+
+double IoThrottle::TokenBucket::take(double amount){
+	this->requested += amount;
+	if (!this->rate)
+		return 0;
+	this->tokens -= amount;
+	return this->tokens < 0 ? -this->tokens / this->rate : 0;
+}
+
+void IoThrottle::TokenBucket::slow_down(double elapsed){
+	auto seen = this->requested / elapsed;
+	auto base = this->rate;
+	if (!base || (seen && seen < base))
+		base = seen;
+	if (!base)
+		return;
+	auto minimum = this->budget ? std::min(this->minimum_rate, this->budget) : this->minimum_rate;
+	this->rate = std::max(base * slow_down_factor, minimum);
+}
+
+void IoThrottle::TokenBucket::speed_up(double elapsed){
+	if (!this->rate)
+		return;
+	if (this->budget){
+		this->rate = std::min(this->rate + this->budget * speed_up_fraction, this->budget);
+		return;
+	}
+	this->rate += this->rate * speed_up_fraction;
+	// Without a budget, the cap goes away once it stops mattering.
+	if (this->rate > 2 * this->requested / elapsed)
+		this->rate = 0;
+}
+
+IoThrottle::IoThrottle(const IoBudget &budget):
+		bytes(1 << 20),
+		operations(10),
+		latency_target(0),
+		last_refill(now()),
+		period_start(last_refill),
+		latency_sum(0),
+		latency_count(0),
+		wait_seconds(0){
+	this->set_budget(budget);
+}
+
+void IoThrottle::set_budget(const IoBudget &budget){
+	AutoMutex am(this->mutex);
+	this->bytes.set_budget(budget.bytes_per_second);
+	this->operations.set_budget(budget.operations_per_second);
+	this->latency_target = std::max(budget.latency_target, 0.0);
+}
+
+double IoThrottle::acquire(size_t size){
+	double wait,
+		t;
+	{
+		AutoMutex am(this->mutex);
+		t = now();
+		this->bytes.refill(t - this->last_refill);
+		this->operations.refill(t - this->last_refill);
+		this->last_refill = t;
+		wait = std::max(this->bytes.take((double)size), this->operations.take(1));
+		this->wait_seconds += wait;
+	}
+	if (wait <= 0)
+		return t;
+	std::this_thread::sleep_for(std::chrono::microseconds((long long)(wait * 1e6)));
+	return now();
+}
+
+void IoThrottle::report(double start){
+	auto t = now();
+	AutoMutex am(this->mutex);
+	this->latency_sum += t - start;
+	this->latency_count++;
+	if (t - this->period_start >= adaptation_period)
+		this->adapt(t);
+}
+
+void IoThrottle::adapt(double t){
+	auto elapsed = t - this->period_start;
+	if (this->latency_target){
+		if (this->latency_sum / this->latency_count > this->latency_target){
+			this->bytes.slow_down(elapsed);
+			this->operations.slow_down(elapsed);
+		}else{
+			this->bytes.speed_up(elapsed);
+			this->operations.speed_up(elapsed);
+		}
+	}
+	this->period_start = t;
+	this->latency_sum = 0;
+	this->latency_count = 0;
+	this->bytes.requested = 0;
+	this->operations.requested = 0;
+}
+
+IoBudget IoThrottle::get_current_rates() const{
+	AutoMutex am(this->mutex);
+	IoBudget ret;
+	ret.bytes_per_second = this->bytes.rate;
+	ret.operations_per_second = this->operations.rate;
+	ret.latency_target = this->latency_target;
+	return ret;
+}
+
+double IoThrottle::get_wait_seconds() const{
+	AutoMutex am(this->mutex);
+	return this->wait_seconds;
+}
+
+void set_io_budget(const wchar_t *path, const IoBudget &budget){
+	auto volume = get_volume_path(path);
+	AutoMutex am(registry_mutex);
+	auto it = registry.find(volume);
+	if (it != registry.end()){
+		it->second->set_budget(budget);
+		if (budget.unlimited())
+			registry.erase(it);
+	}else if (!budget.unlimited())
+		registry[volume] = std::make_shared<IoThrottle>(budget);
+	any_budget.store(!registry.empty());
+}
+
+std::shared_ptr<IoThrottle> get_io_throttle(const wchar_t *path){
+	if (!any_budget.load())
+		return std::shared_ptr<IoThrottle>();
+	auto volume = get_volume_path(path);
+	AutoMutex am(registry_mutex);
+	auto it = registry.find(volume);
+	if (it == registry.end())
+		return std::shared_ptr<IoThrottle>();
+	return it->second;
+}
+
+ThrottledRequest::ThrottledRequest(IoThrottle *throttle, size_t size): throttle(throttle), start(0){
+	if (throttle)
+		this->start = throttle->acquire(size);
+}
+
+ThrottledRequest::~ThrottledRequest(){
+	if (this->throttle)
+		this->throttle->report(this->start);
+}
+
+EXPORT_THIS void set_volume_io_budget(const wchar_t *path, double bytes_per_second, double operations_per_second, double latency_target_ms){
+	IoBudget budget;
+	budget.bytes_per_second = bytes_per_second;
+	budget.operations_per_second = operations_per_second;
+	budget.latency_target = latency_target_ms / 1000;
+	set_io_budget(path, budget);
+}
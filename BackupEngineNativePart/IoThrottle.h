@@ -0,0 +1,100 @@
+#pragma once
+#include "Threads.h"
+
+struct IoBudget{
+	// 0 for no limit.
+	double bytes_per_second;
+	double operations_per_second;
+	// While requests take longer than this on average, in seconds, the rates
+	// are lowered below the budget, and raised back once they don't. A rate
+	// without a limit is first capped at the throughput seen so far. 0 never
+	// adapts.
+	double latency_target;
+
+	IoBudget():
+		bytes_per_second(0),
+		operations_per_second(0),
+		latency_target(0){}
+	bool unlimited() const{
+		return !this->bytes_per_second && !this->operations_per_second && !this->latency_target;
+	}
+};
+
+/*
+Paces the I/O requests to one device through two token buckets, one for
+bytes and one for requests. A request takes its tokens up front, possibly
+going into debt, and waits as long as the buckets need to pay that debt off,
+so concurrent requests queue up in the order they arrived and a single large
+one doesn't have to fit the bucket.
+
+Callers report how long each request took, and the rates follow the latency
+target: every half second they are lowered by a quarter if the average
+latency exceeded it, and otherwise raised by a sixteenth of the budget.
+*/
+class IoThrottle{
+	struct TokenBucket{
+		// The configured rate and the one currently enforced, in units per
+		// second; 0 for no limit.
+		double budget;
+		double rate;
+		double tokens;
+		// Units requested since the adaptation period started.
+		double requested;
+		// Adapting never goes below this, or the budget if it is lower.
+		double minimum_rate;
+
+		TokenBucket(double minimum_rate = 0): budget(0), rate(0), tokens(0), requested(0), minimum_rate(minimum_rate){}
+		void set_budget(double);
+		void refill(double elapsed);
+		// Returns how long the caller has to wait for amount.
+		double take(double amount);
+		void slow_down(double elapsed);
+		void speed_up(double elapsed);
+	};
+
+	mutable Mutex mutex;
+	TokenBucket bytes,
+		operations;
+	double latency_target;
+	double last_refill;
+	double period_start;
+	double latency_sum;
+	std::uint64_t latency_count;
+	double wait_seconds;
+
+	IoThrottle(const IoThrottle &){}
+	void operator=(const IoThrottle &){}
+	void adapt(double t);
+public:
+	IoThrottle(const IoBudget &);
+	void set_budget(const IoBudget &);
+	// Waits until a request of size bytes fits the budget. Returns when the
+	// wait ended, for report().
+	double acquire(size_t size);
+	// Reports that the request whose acquire() returned start is done.
+	void report(double start);
+	// The rates currently enforced, with the budget's latency target.
+	IoBudget get_current_rates() const;
+	// Total time spent waiting in acquire().
+	double get_wait_seconds() const;
+};
+
+// Budgets are per volume: files on the same volume share one throttle. An
+// unlimited budget removes the volume's throttle; files already open keep
+// theirs, which stops limiting them.
+void set_io_budget(const wchar_t *path, const IoBudget &);
+// The throttle for the volume of path, or null if it has no budget.
+std::shared_ptr<IoThrottle> get_io_throttle(const wchar_t *path);
+
+// Waits for the throttle, if there is one, on construction, and reports the
+// time from then to destruction as the latency of the request.
+class ThrottledRequest{
+	IoThrottle *throttle;
+	double start;
+
+	ThrottledRequest(const ThrottledRequest &){}
+	void operator=(const ThrottledRequest &){}
+public:
+	ThrottledRequest(IoThrottle *throttle, size_t size);
+	~ThrottledRequest();
+};
@@ -0,0 +1,181 @@
+#include "stdafx.h"
+#include "MappedFile.h"
+#include "MiscFunctions.h"
+#include "MiscTypes.h"
+
+MappedFile::MappedFile(const wchar_t *_path): file(INVALID_HANDLE_VALUE), mapping(nullptr), view(nullptr), view_size(0){
+	auto path = path_from_string(_path);
+	this->file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (!valid_handle(this->file))
+		throw Win32Error();
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(this->file, &size)){
+		auto error = GetLastError();
+		this->close();
+		throw Win32Error(error);
+	}
+	if (!size.QuadPart)
+		return;
+	if ((u64)size.QuadPart > std::numeric_limits<size_t>::max()){
+		this->close();
+		throw Win32Error(ERROR_NOT_ENOUGH_MEMORY);
+	}
+	this->mapping = CreateFileMappingW(this->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!this->mapping){
+		auto error = GetLastError();
+		this->close();
+		throw Win32Error(error);
+	}
+	this->view = (const byte_t *)MapViewOfFile(this->mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!this->view){
+		auto error = GetLastError();
+		this->close();
+		throw Win32Error(error);
+	}
+	this->view_size = size.QuadPart;
+}
+
+MappedFile::~MappedFile(){
+	this->close();
+}
+
+void MappedFile::close(){
+	if (this->view)
+		UnmapViewOfFile(this->view);
+	if (this->mapping)
+		CloseHandle(this->mapping);
+	if (valid_handle(this->file))
+		CloseHandle(this->file);
+	this->view = nullptr;
+	this->mapping = nullptr;
+	this->file = INVALID_HANDLE_VALUE;
+	this->view_size = 0;
+}
+
+namespace{
+
+struct MappedWindow : public SharedBuffer{
+	const byte_t *view;
+};
+
+void unmap_window(SharedBuffer *buffer){
+	auto window = static_cast<MappedWindow *>(buffer);
+	UnmapViewOfFile(window->view);
+	delete window;
+}
+
+// PrefetchVirtualMemory() is only available since Windows 8.
+struct MemoryRangeEntry{
+	void *address;
+	SIZE_T size;
+};
+typedef BOOL (WINAPI *PrefetchVirtualMemory_f)(HANDLE, ULONG_PTR, MemoryRangeEntry *, ULONG);
+
+void prefetch_window(const byte_t *view, size_t size){
+	static auto prefetch = (PrefetchVirtualMemory_f)GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "PrefetchVirtualMemory");
+	if (!prefetch)
+		return;
+	MemoryRangeEntry range = { (void *)view, size };
+	// Only a hint. Whatever isn't prefetched is faulted in on access.
+	prefetch(GetCurrentProcess(), 1, &range, 0);
+}
+
+}
+
+MappedFileReader::MappedFileReader(const wchar_t *_path, const ReadAheadParameters &parameters):
+		file(INVALID_HANDLE_VALUE),
+		mapping(nullptr),
+		file_size(0),
+		window_offset(0),
+		offset(0){
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	this->granularity = si.dwAllocationGranularity;
+	this->request_size = std::max<size_t>(parameters.request_size, 1);
+	// Windows start on a multiple of the granularity, so this much is needed
+	// for a piece to fit in one wherever it begins.
+	auto window_size = std::max(parameters.window_size, this->request_size + this->granularity);
+	this->window_size = (window_size + this->granularity - 1) / this->granularity * this->granularity;
+
+	auto path = path_from_string(_path);
+	this->file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (!valid_handle(this->file))
+		throw Win32Error();
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(this->file, &size)){
+		auto error = GetLastError();
+		this->close();
+		throw Win32Error(error);
+	}
+	this->file_size = size.QuadPart;
+	// Empty files can't be mapped, and don't need to be.
+	if (!this->file_size)
+		return;
+	this->mapping = CreateFileMappingW(this->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!this->mapping){
+		auto error = GetLastError();
+		this->close();
+		throw Win32Error(error);
+	}
+	// Map the first window right away, so that a file that can't be mapped
+	// is found out while the caller can still read it some other way.
+	try{
+		this->map_window();
+	}catch (...){
+		this->close();
+		throw;
+	}
+}
+
+MappedFileReader::~MappedFileReader(){
+	this->close();
+}
+
+void MappedFileReader::close(){
+	// Views already handed out keep their windows mapped.
+	this->window.reset();
+	if (this->mapping)
+		CloseHandle(this->mapping);
+	if (valid_handle(this->file))
+		CloseHandle(this->file);
+	this->mapping = nullptr;
+	this->file = INVALID_HANDLE_VALUE;
+}
+
+void MappedFileReader::map_window(){
+	this->window.reset();
+	auto base = this->offset / this->granularity * this->granularity;
+	auto size = (size_t)std::min<file_size_t>(this->window_size, this->file_size - base);
+	auto view = (const byte_t *)MapViewOfFile(this->mapping, FILE_MAP_READ, (DWORD)(base >> 32), (DWORD)(base & mask_32bits), size);
+	if (!view)
+		throw Win32Error();
+	MappedWindow *window;
+	try{
+		window = new MappedWindow;
+	}catch (...){
+		UnmapViewOfFile(view);
+		throw;
+	}
+	window->references.store(1, std::memory_order_relaxed);
+	window->release = unmap_window;
+	window->view = view;
+	prefetch_window(view, size);
+	this->window = BufferView(window, view, size);
+	this->window_offset = base;
+}
+
+void MappedFileReader::seek(file_offset_t offset){
+	this->offset = offset;
+}
+
+BufferView MappedFileReader::next(){
+	if (this->offset >= this->file_size)
+		return BufferView();
+	auto piece_size = (size_t)std::min<file_size_t>(this->request_size, this->file_size - this->offset);
+	auto window_end = this->window_offset + this->window.size();
+	if (this->offset < this->window_offset || this->offset + piece_size > window_end)
+		this->map_window();
+	auto ret = this->window.slice((size_t)(this->offset - this->window_offset), piece_size);
+	this->offset += piece_size;
+	return ret;
+}
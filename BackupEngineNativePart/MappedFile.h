@@ -0,0 +1,61 @@
+#pragma once
+#include "ReadAhead.h"
+
+// A read-only view of a whole file. An empty file yields a null view.
+class MappedFile{
+	HANDLE file;
+	HANDLE mapping;
+	const byte_t *view;
+	file_size_t view_size;
+
+	MappedFile(const MappedFile &){}
+	void operator=(const MappedFile &){}
+	void close();
+public:
+	MappedFile(const wchar_t *path);
+	~MappedFile();
+	const byte_t *data() const{
+		return this->view;
+	}
+	file_size_t size() const{
+		return this->view_size;
+	}
+};
+
+/*
+Reads a file through read-only mapped windows of window_size bytes, handing
+out views of the mapping itself, so nothing is read or copied up front. Every
+piece lies within a single window; consecutive windows overlap where needed.
+A window stays mapped until the last view into it is released.
+
+The file must not shrink while it is being read, as touching a mapped page
+past its end faults. Nothing past the size the file had when it was opened
+is read. Likewise, an I/O error on the underlying device is raised as
+EXCEPTION_IN_PAGE_ERROR by whichever thread touches the page, not as a
+Win32Error, so only use this where losing the process is acceptable.
+*/
+class MappedFileReader : public SequentialReader{
+	HANDLE file;
+	HANDLE mapping;
+	file_size_t file_size;
+	size_t request_size;
+	size_t window_size;
+	size_t granularity;
+	// The whole of the current window, which begins at window_offset.
+	BufferView window;
+	file_offset_t window_offset;
+	file_offset_t offset;
+
+	MappedFileReader(const MappedFileReader &){}
+	void operator=(const MappedFileReader &){}
+	void close();
+	void map_window();
+public:
+	MappedFileReader(const wchar_t *path, const ReadAheadParameters &);
+	~MappedFileReader();
+	void seek(file_offset_t offset) override;
+	BufferView next() override;
+	file_size_t size() override{
+		return this->file_size;
+	}
+};
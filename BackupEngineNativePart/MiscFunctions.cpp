@@ -20,6 +20,21 @@ file_size_t get_file_size(const wchar_t *_path){
 	return ret;
 }
 
+std::wstring get_volume_path(const wchar_t *_path){
+	auto path = path_from_string(_path);
+	// The volume path is a prefix of the full path, plus a backslash. Relative
+	// paths are made absolute first, which can make them longer.
+	std::vector<wchar_t> root(std::max<size_t>(path.size(), MAX_PATH) + 2);
+	if (!GetVolumePathNameW(path.c_str(), &root[0], (DWORD)root.size()))
+		return std::wstring();
+	return &root[0];
+}
+
+bool is_network_path(const wchar_t *path){
+	auto root = get_volume_path(path);
+	return root.size() && GetDriveTypeW(root.c_str()) == DRIVE_REMOTE;
+}
+
 char to_hex(unsigned x){
 	return (x < 10 ? '0' : 'a' - 10) + x;
 }
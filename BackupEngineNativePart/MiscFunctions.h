@@ -14,8 +14,21 @@ inline bool valid_handle(HANDLE handle){
 	return handle && handle != INVALID_HANDLE_VALUE;
 }
 
+inline void prefetch_for_read(const void *p){
+#ifdef _MSC_VER
+	PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, p);
+#else
+	__builtin_prefetch(p);
+#endif
+}
+
 std::wstring path_from_string(const wchar_t *path);
 file_size_t get_file_size(const wchar_t *_path);
+// The root of the volume the path is on ("C:\" for "C:\foo"), or an empty
+// string if it can't be determined. The path doesn't have to exist.
+std::wstring get_volume_path(const wchar_t *path);
+// True if the path is on a remote volume, either a UNC path or a mapped drive.
+bool is_network_path(const wchar_t *path);
 std::string format_size(double size);
 inline std::string format_size(u64 size){
 	return format_size((double)size);
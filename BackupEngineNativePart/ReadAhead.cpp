@@ -0,0 +1,469 @@
+#include "stdafx.h"
+#include "ReadAhead.h"
+#include "MiscFunctions.h"
+#include "MiscTypes.h"
+#include "MappedFile.h"
+#include "IoThrottle.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <climits>
+#endif
+
+ReadAheadParameters::ReadAheadParameters(size_t request_size, unsigned queue_depth):
+		request_size(request_size),
+		queue_depth(queue_depth),
+		window_size(64 << 20),
+#ifdef _WIN32
+		backend(ReadAheadBackend::Overlapped),
+#else
+		backend(ReadAheadBackend::ThreadPool),
+#endif
+		unbuffered(false){}
+
+#ifdef _WIN32
+class OverlappedFileReader : public AsyncFileReader{
+	struct Slot{
+		OVERLAPPED overlapped;
+		HANDLE event;
+		// Set if ReadFile() failed outright rather than going pending.
+		DWORD start_error;
+		// As returned by IoThrottle::acquire().
+		double start_time;
+	};
+	HANDLE file;
+	std::vector<Slot> slots;
+	std::shared_ptr<IoThrottle> throttle;
+public:
+	OverlappedFileReader(const wchar_t *_path, unsigned queue_depth, bool unbuffered): slots(queue_depth), throttle(get_io_throttle(_path)){
+		for (auto &slot : this->slots)
+			slot.event = nullptr;
+		auto path = path_from_string(_path);
+		DWORD flags = FILE_FLAG_OVERLAPPED | (unbuffered ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_SEQUENTIAL_SCAN);
+		this->file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, flags, nullptr);
+		if (!valid_handle(this->file))
+			throw Win32Error();
+		for (auto &slot : this->slots){
+			// Each request needs an event of its own, or completions of
+			// different requests on the same handle can't be told apart.
+			slot.event = CreateEvent(nullptr, true, false, nullptr);
+			if (!slot.event){
+				auto error = GetLastError();
+				this->close();
+				throw Win32Error(error);
+			}
+		}
+	}
+	~OverlappedFileReader(){
+		this->close();
+	}
+	void close(){
+		for (auto &slot : this->slots)
+			if (slot.event)
+				CloseHandle(slot.event);
+		this->slots.clear();
+		if (valid_handle(this->file))
+			CloseHandle(this->file);
+		this->file = INVALID_HANDLE_VALUE;
+	}
+	void start(unsigned i, file_offset_t offset, byte_t *buffer, size_t size) override{
+		auto &slot = this->slots[i];
+		zero_struct(slot.overlapped);
+		slot.overlapped.Offset = offset & mask_32bits;
+		slot.overlapped.OffsetHigh = offset >> 32;
+		slot.overlapped.hEvent = slot.event;
+		slot.start_error = ERROR_SUCCESS;
+		if (this->throttle)
+			slot.start_time = this->throttle->acquire(size);
+		ResetEvent(slot.event);
+		if (!ReadFile(this->file, buffer, (DWORD)size, nullptr, &slot.overlapped)){
+			auto error = GetLastError();
+			if (error != ERROR_IO_PENDING)
+				slot.start_error = error;
+		}
+	}
+	size_t finish(unsigned i) override{
+		auto &slot = this->slots[i];
+		auto error = slot.start_error;
+		DWORD bytes_read = 0;
+		// A request that completed before it was waited for did so at some
+		// unknown time, so only the others tell the latency.
+		bool timed = this->throttle && error == ERROR_SUCCESS && !HasOverlappedIoCompleted(&slot.overlapped);
+		if (error == ERROR_SUCCESS && !GetOverlappedResult(this->file, &slot.overlapped, &bytes_read, true))
+			error = GetLastError();
+		if (timed)
+			this->throttle->report(slot.start_time);
+		switch (error){
+			case ERROR_SUCCESS:
+				return bytes_read;
+			case ERROR_HANDLE_EOF:
+			case ERROR_OPERATION_ABORTED:
+				return 0;
+		}
+		throw Win32Error(error);
+	}
+	void cancel() override{
+		CancelIo(this->file);
+	}
+	file_size_t size() override{
+		LARGE_INTEGER li;
+		return GetFileSizeEx(this->file, &li) ? li.QuadPart : 0;
+	}
+};
+#endif
+
+// A file opened for synchronous positional reads. Windows serializes
+// synchronous requests on a handle opened without FILE_FLAG_OVERLAPPED, so
+// each thread of ThreadPoolFileReader opens one of its own.
+class PositionalFile{
+#ifdef _WIN32
+	HANDLE file;
+#else
+	int file;
+	// Whatever O_DIRECT lets through, or everything where it isn't
+	// supported, is dropped from the cache once read.
+	bool drop_cache;
+#endif
+
+	PositionalFile(const PositionalFile &){}
+	void operator=(const PositionalFile &){}
+public:
+	PositionalFile(const wchar_t *_path, bool unbuffered){
+#ifdef _WIN32
+		auto path = path_from_string(_path);
+		DWORD flags = unbuffered ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_SEQUENTIAL_SCAN;
+		this->file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, flags, nullptr);
+		if (!valid_handle(this->file))
+			throw Win32Error();
+#else
+		std::string path(wcslen(_path) * MB_LEN_MAX + 1, 0);
+		path.resize(wcstombs(&path[0], _path, path.size()));
+		this->drop_cache = unbuffered;
+		this->file = -1;
+		if (unbuffered){
+			this->file = open(path.c_str(), O_RDONLY | O_DIRECT);
+			// Some file systems (tmpfs, for one) refuse O_DIRECT.
+			if (this->file < 0 && errno != EINVAL)
+				throw Win32Error((DWORD)errno);
+		}
+		if (this->file < 0){
+			this->file = open(path.c_str(), O_RDONLY);
+			if (this->file < 0)
+				throw Win32Error((DWORD)errno);
+		}
+		posix_fadvise(this->file, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	}
+	~PositionalFile(){
+#ifdef _WIN32
+		CloseHandle(this->file);
+#else
+		::close(this->file);
+#endif
+	}
+	// A single read, which comes back short only at the end of the file.
+	// Sets error and returns 0 if it fails.
+	size_t read(file_offset_t offset, byte_t *buffer, size_t size, DWORD &error){
+		error = ERROR_SUCCESS;
+#ifdef _WIN32
+		OVERLAPPED overlapped;
+		zero_struct(overlapped);
+		overlapped.Offset = offset & mask_32bits;
+		overlapped.OffsetHigh = offset >> 32;
+		DWORD bytes_read;
+		if (!ReadFile(this->file, buffer, (DWORD)size, &bytes_read, &overlapped)){
+			auto e = GetLastError();
+			if (e != ERROR_HANDLE_EOF)
+				error = e;
+			return 0;
+		}
+		return bytes_read;
+#else
+		while (true){
+			auto bytes_read = pread(this->file, buffer, size, (off_t)offset);
+			if (bytes_read >= 0){
+				if (this->drop_cache && bytes_read)
+					posix_fadvise(this->file, (off_t)offset, (off_t)bytes_read, POSIX_FADV_DONTNEED);
+				return (size_t)bytes_read;
+			}
+			if (errno != EINTR){
+				error = (DWORD)errno;
+				return 0;
+			}
+		}
+#endif
+	}
+	file_size_t size(){
+#ifdef _WIN32
+		LARGE_INTEGER li;
+		return GetFileSizeEx(this->file, &li) ? li.QuadPart : 0;
+#else
+		struct stat st;
+		return !fstat(this->file, &st) ? st.st_size : 0;
+#endif
+	}
+};
+
+class ThreadPoolFileReader : public AsyncFileReader{
+	enum class State{
+		Idle,
+		Queued,
+		Running,
+		Done,
+	};
+	struct Slot{
+		State state;
+		file_offset_t offset;
+		byte_t *buffer;
+		size_t size;
+		size_t result;
+		DWORD error;
+	};
+	// One per thread.
+	std::vector<std::unique_ptr<PositionalFile> > files;
+	std::vector<Slot> slots;
+	std::deque<unsigned> queue;
+	std::mutex mutex;
+	std::condition_variable work_available,
+		work_done;
+	bool stopping;
+	std::vector<std::thread> threads;
+	std::shared_ptr<IoThrottle> throttle;
+
+	// Reads until size bytes have been read or the end of the file is reached.
+	size_t read_at(PositionalFile &file, file_offset_t offset, byte_t *buffer, size_t size, DWORD &error){
+		size_t ret = 0;
+		error = ERROR_SUCCESS;
+		while (ret < size){
+			auto remaining = size - ret;
+			ThrottledRequest request(this->throttle.get(), remaining);
+			auto bytes_read = file.read(offset + ret, buffer + ret, remaining, error);
+			ret += bytes_read;
+			// A short read means the end of the file. An unbuffered read
+			// from there would also start on an unaligned offset and fail.
+			if (error != ERROR_SUCCESS || bytes_read < remaining)
+				break;
+		}
+		return ret;
+	}
+
+	void thread_func(PositionalFile &file){
+		std::unique_lock<std::mutex> lock(this->mutex);
+		while (true){
+			this->work_available.wait(lock, [this](){ return this->stopping || this->queue.size(); });
+			if (this->stopping)
+				return;
+			auto i = this->queue.front();
+			this->queue.pop_front();
+			auto &slot = this->slots[i];
+			slot.state = State::Running;
+			auto offset = slot.offset;
+			auto buffer = slot.buffer;
+			auto size = slot.size;
+			lock.unlock();
+			DWORD error;
+			auto result = this->read_at(file, offset, buffer, size, error);
+			lock.lock();
+			slot.result = result;
+			slot.error = error;
+			slot.state = State::Done;
+			this->work_done.notify_all();
+		}
+	}
+public:
+	ThreadPoolFileReader(const wchar_t *_path, unsigned queue_depth, bool unbuffered): stopping(false), throttle(get_io_throttle(_path)){
+		Slot empty = { State::Idle, 0, nullptr, 0, 0, ERROR_SUCCESS };
+		this->slots.assign(queue_depth, empty);
+		// Every request is a single blocking read, so there is no point in
+		// more threads than requests.
+		for (unsigned i = 0; i < queue_depth; i++)
+			this->files.push_back(std::unique_ptr<PositionalFile>(new PositionalFile(_path, unbuffered)));
+		try{
+			for (auto &file : this->files){
+				auto p = file.get();
+				this->threads.push_back(std::thread([this, p](){ this->thread_func(*p); }));
+			}
+		}catch (...){
+			this->stop();
+			throw;
+		}
+	}
+	~ThreadPoolFileReader(){
+		this->stop();
+	}
+	void stop(){
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->stopping = true;
+		}
+		this->work_available.notify_all();
+		for (auto &thread : this->threads)
+			thread.join();
+		this->threads.clear();
+	}
+	void start(unsigned i, file_offset_t offset, byte_t *buffer, size_t size) override{
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			auto &slot = this->slots[i];
+			slot.state = State::Queued;
+			slot.offset = offset;
+			slot.buffer = buffer;
+			slot.size = size;
+			this->queue.push_back(i);
+		}
+		this->work_available.notify_one();
+	}
+	size_t finish(unsigned i) override{
+		std::unique_lock<std::mutex> lock(this->mutex);
+		auto &slot = this->slots[i];
+		this->work_done.wait(lock, [&slot](){ return slot.state == State::Done || slot.state == State::Idle; });
+		slot.state = State::Idle;
+		if (slot.error != ERROR_SUCCESS)
+			throw Win32Error(slot.error);
+		return slot.result;
+	}
+	void cancel() override{
+		// Requests already running are left to finish; the ones still queued
+		// complete right away, having read nothing.
+		std::lock_guard<std::mutex> lock(this->mutex);
+		for (auto i : this->queue){
+			auto &slot = this->slots[i];
+			slot.state = State::Done;
+			slot.result = 0;
+			slot.error = ERROR_SUCCESS;
+		}
+		this->queue.clear();
+	}
+	file_size_t size() override{
+		return this->files[0]->size();
+	}
+};
+
+std::unique_ptr<AsyncFileReader> open_async_file_reader(const wchar_t *path, const ReadAheadParameters &parameters){
+#ifdef _WIN32
+	// Also what Mapping falls back to.
+	if (parameters.backend != ReadAheadBackend::ThreadPool)
+		return std::unique_ptr<AsyncFileReader>(new OverlappedFileReader(path, parameters.queue_depth, parameters.unbuffered));
+#endif
+	return std::unique_ptr<AsyncFileReader>(new ThreadPoolFileReader(path, parameters.queue_depth, parameters.unbuffered));
+}
+
+std::unique_ptr<SequentialReader> open_sequential_reader(const wchar_t *path, const ReadAheadParameters &parameters){
+	if (parameters.backend == ReadAheadBackend::Mapping && !parameters.unbuffered && !is_network_path(path) && !get_io_throttle(path)){
+		try{
+			return std::unique_ptr<SequentialReader>(new MappedFileReader(path, parameters));
+		}catch (Win32Error &){
+			// If the file can't be opened at all, ReadAhead will say so.
+		}
+	}
+	return std::unique_ptr<SequentialReader>(new ReadAhead(path, parameters));
+}
+
+static_assert(BufferPool::alignment % unbuffered_io_alignment == 0, "Pooled buffers must be usable for unbuffered reads.");
+
+ReadAheadParameters ReadAhead::normalize(ReadAheadParameters parameters){
+	auto &size = parameters.request_size;
+	size = std::max<size_t>(size, 1);
+	if (parameters.unbuffered)
+		size = (size + unbuffered_io_alignment - 1) / unbuffered_io_alignment * unbuffered_io_alignment;
+	parameters.queue_depth = std::max<unsigned>(parameters.queue_depth, 1);
+	return parameters;
+}
+
+ReadAhead::ReadAhead(const wchar_t *path, const ReadAheadParameters &parameters):
+		parameters(normalize(parameters)),
+		pool(this->parameters.request_size),
+		oldest(0),
+		pending(0),
+		next_offset(0),
+		skip(0),
+		eof(false){
+	this->reader = open_async_file_reader(path, this->parameters);
+	this->buffers.resize(this->parameters.queue_depth);
+	this->expected_size = this->reader->size();
+	this->fill_queue();
+}
+
+ReadAhead::~ReadAhead(){
+	this->drain();
+}
+
+void ReadAhead::submit(){
+	auto slot = (this->oldest + this->pending) % this->parameters.queue_depth;
+	auto &buffer = this->buffers[slot];
+	buffer = this->pool.acquire();
+	this->reader->start(slot, this->next_offset, buffer.data(), this->parameters.request_size);
+	this->next_offset += this->parameters.request_size;
+	this->pending++;
+}
+
+void ReadAhead::fill_queue(){
+	while (!this->eof && this->pending < this->parameters.queue_depth && this->next_offset < this->expected_size)
+		this->submit();
+}
+
+void ReadAhead::drain(){
+	if (!this->pending)
+		return;
+	this->reader->cancel();
+	for (; this->pending; this->pending--){
+		try{
+			this->reader->finish(this->oldest);
+		}catch (Win32Error &){
+		}
+		this->buffers[this->oldest].reset();
+		this->oldest = (this->oldest + 1) % this->parameters.queue_depth;
+	}
+}
+
+void ReadAhead::seek(file_offset_t offset){
+	this->drain();
+	this->next_offset = offset;
+	this->skip = 0;
+	if (this->parameters.unbuffered){
+		this->skip = offset % unbuffered_io_alignment;
+		this->next_offset -= this->skip;
+	}
+	this->eof = false;
+	this->expected_size = this->reader->size();
+	this->fill_queue();
+}
+
+BufferView ReadAhead::next(){
+	if (!this->pending){
+		if (this->eof)
+			return BufferView();
+		// Everything up to the expected size has been read. See if the
+		// file has grown since.
+		this->submit();
+	}
+	auto slot = this->oldest;
+	auto buffer = std::move(this->buffers[slot]);
+	this->oldest = (this->oldest + 1) % this->parameters.queue_depth;
+	this->pending--;
+	size_t bytes_read;
+	try{
+		bytes_read = this->reader->finish(slot);
+	}catch (Win32Error &){
+		this->eof = true;
+		this->drain();
+		throw;
+	}
+	if (bytes_read < this->parameters.request_size){
+		this->eof = true;
+		this->drain();
+	}else
+		this->fill_queue();
+	auto skip = this->skip;
+	this->skip = 0;
+	if (bytes_read <= skip)
+		return BufferView();
+	auto ret = buffer.publish(bytes_read);
+	ret.remove_prefix(skip);
+	return ret;
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include "BufferPool.h"
+
+enum class ReadAheadBackend{
+	// Overlapped ReadFile() calls, all in flight at once. Windows only.
+	Overlapped,
+	// Positional synchronous reads (ReadFile() with an offset, or pread())
+	// on a small pool of threads. Builds and runs on any platform.
+	ThreadPool,
+	// No reads at all: windows of the file are mapped into memory and handed
+	// out as they are. Local files only; network files, files that can't be
+	// mapped, and files on a volume with an I/O budget (page faults can't be
+	// paced) are read with Overlapped instead. Never the default: a read
+	// error while touching a mapped page raises EXCEPTION_IN_PAGE_ERROR,
+	// which takes the whole process down instead of failing the one file.
+	Mapping,
+};
+
+struct ReadAheadParameters{
+	size_t request_size;
+	unsigned queue_depth;
+	// Only used by the Mapping backend.
+	size_t window_size;
+	ReadAheadBackend backend;
+	// Bypass the system cache (FILE_FLAG_NO_BUFFERING, or O_DIRECT on
+	// Linux), so that reading a whole volume doesn't evict everything else
+	// from memory. request_size is rounded up to a multiple of
+	// unbuffered_io_alignment. Mapping always goes through the cache, so it
+	// is replaced by the default of the other two backends.
+	bool unbuffered;
+	ReadAheadParameters(size_t request_size = 1 << 20, unsigned queue_depth = 4);
+};
+
+// A file read front to back in pieces of request_size bytes, the last one
+// possibly shorter.
+class SequentialReader{
+public:
+	virtual ~SequentialReader(){}
+	virtual void seek(file_offset_t offset) = 0;
+	// Returns the next piece of the file, or an empty view at the end of it.
+	virtual BufferView next() = 0;
+	virtual file_size_t size() = 0;
+};
+
+// Opens the reader the parameters ask for.
+std::unique_ptr<SequentialReader> open_sequential_reader(const wchar_t *path, const ReadAheadParameters &);
+
+// Reads into caller-provided buffers. Up to queue_depth requests can be in
+// flight, each identified by a slot number in [0; queue_depth). Requests are
+// paced by the budget of the file's volume, if it has one; see
+// set_io_budget().
+class AsyncFileReader{
+public:
+	virtual ~AsyncFileReader(){}
+	virtual void start(unsigned slot, file_offset_t offset, byte_t *buffer, size_t size) = 0;
+	// Waits for the request in slot to complete and returns the number of
+	// bytes read, which is less than requested only at the end of the file.
+	virtual size_t finish(unsigned slot) = 0;
+	// Asks every pending request to complete as soon as possible. finish()
+	// must still be called on each of them before their buffers are freed.
+	virtual void cancel() = 0;
+	virtual file_size_t size() = 0;
+};
+
+std::unique_ptr<AsyncFileReader> open_async_file_reader(const wchar_t *path, const ReadAheadParameters &);
+
+/*
+Reads a file sequentially, keeping up to queue_depth requests of
+request_size bytes in flight ahead of the consumer, so that the device
+always has work queued. Requests are not issued past the size the file had
+when reading started (or at the last seek()); if the last one comes back
+full, one more is issued to find the actual end.
+*/
+class ReadAhead : public SequentialReader{
+	ReadAheadParameters parameters;
+	BufferPool pool;
+	std::unique_ptr<AsyncFileReader> reader;
+	// One per slot.
+	std::vector<WritableBuffer> buffers;
+	unsigned oldest;
+	unsigned pending;
+	file_offset_t next_offset;
+	file_size_t expected_size;
+	// Unbuffered reads start on an aligned offset; this is how much of the
+	// first piece after a seek() comes before the offset asked for.
+	size_t skip;
+	bool eof;
+
+	ReadAhead(const ReadAhead &){}
+	void operator=(const ReadAhead &){}
+	static ReadAheadParameters normalize(ReadAheadParameters);
+	void submit();
+	void fill_queue();
+	void drain();
+public:
+	ReadAhead(const wchar_t *path, const ReadAheadParameters & = ReadAheadParameters());
+	~ReadAhead();
+	void seek(file_offset_t offset) override;
+	// Pieces are pooled: holding on to a few costs nothing, but every one
+	// still held when the next is filled means one more buffer allocated.
+	BufferView next() override;
+	file_size_t size() override{
+		return this->reader->size();
+	}
+	const ReadAheadParameters &get_parameters() const{
+		return this->parameters;
+	}
+	const BufferPool &get_pool() const{
+		return this->pool;
+	}
+};
@@ -2,16 +2,219 @@
 #include "RollingChecksum.h"
 #include "circular_buffer.h"
 
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define ROLLING_CHECKSUM_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSE2
+#define TARGET_AVX2
+#else
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+static void scalar_kernel(u32 &sum, u32 &weighted_sum, const byte_t *buffer, size_t size){
+	u32 s = 0,
+		w = 0;
+	for (size_t i = 0; i < size; i++){
+		u32 k = buffer[i];
+		s += k;
+		w += k * (u32)i;
+	}
+	sum = s;
+	weighted_sum = w;
+}
+
+#ifdef ROLLING_CHECKSUM_X86
+
+TARGET_SSE2 static u32 horizontal_sum(__m128i x){
+	x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+	x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (u32)_mm_cvtsi128_si32(x);
+}
+
+/*
+Both vector kernels split the buffer into blocks of N bytes. For block j with
+byte sum B[j] and intra-block weighted sum W[j], the weighted sum of the whole
+run is sum(N * j * B[j] + W[j]). Instead of multiplying by j in the loop,
+the kernels accumulate the inclusive prefix sums Q[j] = B[0] + ... + B[j],
+since sum(j * B[j]) = n * sum(B[j]) - sum(Q[j]) for n blocks. All arithmetic
+wraps modulo 2^32, which is all the checksum needs.
+*/
+
+TARGET_SSE2 static void sse2_kernel(u32 &sum, u32 &weighted_sum, const byte_t *buffer, size_t size){
+	const size_t block = 16;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i weights_low = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m128i weights_high = _mm_setr_epi16(8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i sums = zero,
+		prefixes = zero,
+		weighted = zero;
+	size_t blocks = size / block;
+	for (size_t j = 0; j < blocks; j++){
+		__m128i x = _mm_loadu_si128((const __m128i *)(buffer + j * block));
+		sums = _mm_add_epi32(sums, _mm_sad_epu8(x, zero));
+		prefixes = _mm_add_epi32(prefixes, sums);
+		weighted = _mm_add_epi32(weighted, _mm_madd_epi16(_mm_unpacklo_epi8(x, zero), weights_low));
+		weighted = _mm_add_epi32(weighted, _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), weights_high));
+	}
+	u32 s = horizontal_sum(sums);
+	u32 w = (u32)block * ((u32)blocks * s - horizontal_sum(prefixes)) + horizontal_sum(weighted);
+	for (size_t i = blocks * block; i < size; i++){
+		u32 k = buffer[i];
+		s += k;
+		w += k * (u32)i;
+	}
+	sum = s;
+	weighted_sum = w;
+}
+
+TARGET_AVX2 static u32 horizontal_sum(__m256i x){
+	__m128i y = _mm_add_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+	y = _mm_add_epi32(y, _mm_shuffle_epi32(y, _MM_SHUFFLE(1, 0, 3, 2)));
+	y = _mm_add_epi32(y, _mm_shuffle_epi32(y, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (u32)_mm_cvtsi128_si32(y);
+}
+
+TARGET_AVX2 static void avx2_kernel(u32 &sum, u32 &weighted_sum, const byte_t *buffer, size_t size){
+	const size_t block = 32;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ones = _mm256_set1_epi16(1);
+	// Largest pair sum is 255 * (30 + 31), which still fits in the signed
+	// 16-bit lanes _mm256_maddubs_epi16() produces.
+	const __m256i weights = _mm256_setr_epi8(
+		0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+		16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31
+	);
+	__m256i sums = zero,
+		prefixes = zero,
+		weighted = zero;
+	size_t blocks = size / block;
+	for (size_t j = 0; j < blocks; j++){
+		__m256i x = _mm256_loadu_si256((const __m256i *)(buffer + j * block));
+		sums = _mm256_add_epi32(sums, _mm256_sad_epu8(x, zero));
+		prefixes = _mm256_add_epi32(prefixes, sums);
+		weighted = _mm256_add_epi32(weighted, _mm256_madd_epi16(_mm256_maddubs_epi16(x, weights), ones));
+	}
+	u32 s = horizontal_sum(sums);
+	u32 w = (u32)block * ((u32)blocks * s - horizontal_sum(prefixes)) + horizontal_sum(weighted);
+	for (size_t i = blocks * block; i < size; i++){
+		u32 k = buffer[i];
+		s += k;
+		w += k * (u32)i;
+	}
+	sum = s;
+	weighted_sum = w;
+}
+
+static void cpuid(int (&info)[4], int function){
+#ifdef _MSC_VER
+	__cpuidex(info, function, 0);
+#else
+	__asm__ __volatile__("cpuid" : "=a"(info[0]), "=b"(info[1]), "=c"(info[2]), "=d"(info[3]) : "a"(function), "c"(0));
+#endif
+}
+
+static u64 xgetbv0(){
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	u32 eax, edx;
+	__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return eax | ((u64)edx << 32);
+#endif
+}
+
+static bool cpu_has_sse2(){
+	int info[4];
+	cpuid(info, 1);
+	return !!(info[3] & (1 << 26));
+}
+
+static bool cpu_has_avx2(){
+	int info[4];
+	cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	cpuid(info, 1);
+	const int osxsave_and_avx = (1 << 27) | (1 << 28);
+	if ((info[2] & osxsave_and_avx) != osxsave_and_avx)
+		return false;
+	// The OS must preserve the XMM and YMM registers across context switches.
+	if ((xgetbv0() & 6) != 6)
+		return false;
+	cpuid(info, 7);
+	return !!(info[1] & (1 << 5));
+}
+
+#endif
+
+std::vector<RollingChecksumKernel> get_rolling_checksum_kernels(){
+	std::vector<RollingChecksumKernel> ret;
+	RollingChecksumKernel scalar = { "scalar", scalar_kernel };
+	ret.push_back(scalar);
+#ifdef ROLLING_CHECKSUM_X86
+	if (cpu_has_sse2()){
+		RollingChecksumKernel kernel = { "SSE2", sse2_kernel };
+		ret.push_back(kernel);
+	}
+	if (cpu_has_avx2()){
+		RollingChecksumKernel kernel = { "AVX2", avx2_kernel };
+		ret.push_back(kernel);
+	}
+#endif
+	return ret;
+}
+
+static RollingChecksumKernel selected_kernel = get_rolling_checksum_kernels().back();
+
+RollingChecksumKernel get_rolling_checksum_kernel(){
+	return selected_kernel;
+}
+
+void set_rolling_checksum_kernel(const RollingChecksumKernel &kernel){
+	selected_kernel = kernel;
+}
+
+rolling_checksum_t compute_rsync_rolling_checksum(const byte_t *buffer, size_t size){
+	return compute_rsync_rolling_checksum(buffer, size, 0, size);
+}
+
+rolling_checksum_t compute_rsync_rolling_checksum(const byte_t *buffer, size_t piece_size, file_offset_t offset, file_offset_t logical_size, rolling_checksum_t previous){
+	u32 sum, weighted_sum;
+	selected_kernel.function(sum, weighted_sum, buffer, piece_size);
+	// Byte i has weight logical_size - offset + 1 - i.
+	rolling_checksum_t a = previous & 0xFFFF,
+		b = (previous >> 16) & 0xFFFF;
+	a += sum;
+	b += (rolling_checksum_t)(logical_size - offset + 1) * sum - weighted_sum;
+	a &= 0xFFFF;
+	b &= 0xFFFF;
+	return a | (b << 16);
+}
+
 rolling_checksum_t compute_rsync_rolling_checksum(const circular_buffer &buffer){
 	if (buffer.single_piece())
 		return compute_rsync_rolling_checksum(buffer.data(), buffer.size());
-	return compute_rsync_rolling_checksum(buffer, buffer.size());
+	rolling_checksum_t ret = 0;
+	size_t offset = 0;
+	buffer.process_whole([&](const byte_t *piece, size_t size){
+		ret = compute_rsync_rolling_checksum(piece, size, offset, buffer.size(), ret);
+		offset += size;
+	});
+	return ret;
 }
 
 rolling_checksum_t compute_rsync_rolling_checksum(const circular_buffer &buffer, size_t offset, size_t logical_size, rolling_checksum_t previous){
 	if (buffer.single_piece())
 		return compute_rsync_rolling_checksum(buffer.data(), buffer.size(), offset, logical_size, previous);
-	return compute_rsync_rolling_checksum(buffer, buffer.size(), offset, logical_size, previous);
+	buffer.process_whole([&](const byte_t *piece, size_t size){
+		previous = compute_rsync_rolling_checksum(piece, size, offset, logical_size, previous);
+		offset += size;
+	});
+	return previous;
 }
 
 rolling_checksum_t subtract_rsync_rolling_checksum(rolling_checksum_t previous, byte_t byte_to_subtract, size_t size){
@@ -36,4 +239,3 @@ rolling_checksum_t add_rsync_rolling_checksum(rolling_checksum_t previous, byte_
 	b &= 0xFFFF;
 	return a | (b << 16);
 }
-
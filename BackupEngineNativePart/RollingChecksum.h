@@ -30,6 +30,73 @@ rolling_checksum_t compute_rsync_rolling_checksum(const T &buffer, size_t piece_
 	return a | (b << 16);
 }
 
+// A kernel computes, modulo 2^32, sum = buffer[0] + ... + buffer[size - 1]
+// and weighted_sum = 0 * buffer[0] + 1 * buffer[1] + ... + (size - 1) * buffer[size - 1].
+// Both halves of the checksum can be derived from these two values, so every
+// kernel produces results identical to the templates above.
+typedef void (*rolling_checksum_kernel_t)(u32 &sum, u32 &weighted_sum, const byte_t *buffer, size_t size);
+
+struct RollingChecksumKernel{
+	const char *name;
+	rolling_checksum_kernel_t function;
+};
+
+// Returns the kernels the current CPU can run, from slowest to fastest.
+std::vector<RollingChecksumKernel> get_rolling_checksum_kernels();
+RollingChecksumKernel get_rolling_checksum_kernel();
+void set_rolling_checksum_kernel(const RollingChecksumKernel &);
+
+rolling_checksum_t compute_rsync_rolling_checksum(const byte_t *buffer, size_t size);
+rolling_checksum_t compute_rsync_rolling_checksum(const byte_t *buffer, size_t piece_size, file_offset_t offset, file_offset_t logical_size, rolling_checksum_t previous = 0);
+
+inline rolling_checksum_t compute_rsync_rolling_checksum(byte_t *buffer, size_t size){
+	return compute_rsync_rolling_checksum((const byte_t *)buffer, size);
+}
+
+inline rolling_checksum_t compute_rsync_rolling_checksum(byte_t *buffer, size_t piece_size, file_offset_t offset, file_offset_t logical_size, rolling_checksum_t previous = 0){
+	return compute_rsync_rolling_checksum((const byte_t *)buffer, piece_size, offset, logical_size, previous);
+}
+
+/*
+Slides a window of window_size bytes forward one byte at a time, up to n
+times. At step i, outgoing[i] leaves the window and incoming[i] enters it;
+checksum is updated exactly as subtract_rsync_rolling_checksum() followed by
+add_rsync_rolling_checksum() would. The scan stops right after the first step
+whose checksum passes filter.might_contain(). Returns the number of steps
+taken, which is n if no step passed.
+
+Checksums are computed a batch ahead so that filter.prefetch() can start
+loading whatever might_contain() will look at before it is needed.
+*/
+template <typename FilterT>
+size_t scan_rsync_rolling_checksum(rolling_checksum_t &checksum, const byte_t *outgoing, const byte_t *incoming, size_t n, size_t window_size, const FilterT &filter){
+	const size_t batch_size = 16;
+	const rolling_checksum_t outgoing_weight = (rolling_checksum_t)(window_size + 1);
+	rolling_checksum_t a = checksum & 0xFFFF,
+		b = (checksum >> 16) & 0xFFFF;
+	rolling_checksum_t batch[batch_size];
+	for (size_t i = 0; i < n; i += batch_size){
+		size_t m = std::min(batch_size, n - i);
+		for (size_t j = 0; j < m; j++){
+			rolling_checksum_t out = outgoing[i + j],
+				in = incoming[i + j];
+			a += in - out;
+			b += a + in - out * outgoing_weight;
+			batch[j] = (a & 0xFFFF) | ((b & 0xFFFF) << 16);
+			filter.prefetch(batch[j]);
+		}
+		for (size_t j = 0; j < m; j++){
+			if (filter.might_contain(batch[j])){
+				checksum = batch[j];
+				return i + j + 1;
+			}
+		}
+	}
+	if (n)
+		checksum = (a & 0xFFFF) | ((b & 0xFFFF) << 16);
+	return n;
+}
+
 rolling_checksum_t compute_rsync_rolling_checksum(const circular_buffer &buffer);
 rolling_checksum_t compute_rsync_rolling_checksum(const circular_buffer &buffer, size_t offset, size_t logical_size, rolling_checksum_t previous = 0);
 rolling_checksum_t subtract_rsync_rolling_checksum(rolling_checksum_t previous, byte_t byte_to_subtract, size_t size);
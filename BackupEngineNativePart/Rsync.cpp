@@ -1,7 +1,6 @@
 #include "stdafx.h"
 #include "Rsync.h"
 #include "StreamBlockReader.h"
-#include "circular_buffer.h"
 #include "MiscTypes.h"
 #include "MiscFunctions.h"
 
@@ -24,31 +23,29 @@ bool rsync::NormalFile::seek(file_offset_t offset){
 	}catch (Win32Error &){
 		return false;
 	}
-	this->temp.size = 0;
+	this->current.reset();
 	return true;
 }
 
 bool rsync::NormalFile::read(void *dst, size_t size, size_t &bytes_read){
 	bytes_read = 0;
 	while (size){
-		if (this->temp.size){
-			auto consumed = std::min(this->temp.size, size);
-			memcpy(dst, this->temp.data() + this->temp.capacity() - this->temp.size, consumed);
+		if (this->current.size()){
+			auto consumed = std::min(this->current.size(), size);
+			memcpy(dst, this->current.data(), consumed);
 			dst = (char *)dst + consumed;
 			size -= consumed;
-			this->temp.size -= consumed;
+			this->current.remove_prefix(consumed);
 			bytes_read += consumed;
 			continue;
 		}
 
-		circular_buffer buffer(1);
 		try{
-			if (!this->reader->next_block(buffer))
+			if (!this->reader->next_block(this->current))
 				break;
 		}catch (Win32Error &){
 			return false;
 		}
-		this->temp = buffer;
 	}
 	return true;
 }
@@ -26,7 +26,8 @@ public:
 class NormalFile : public Stream{
 protected:
 	std::unique_ptr<BlockByBlockReader> reader;
-	simple_buffer temp;
+	// What is left of the last block read.
+	BufferView current;
 	u64 unique_id;
 public:
 	NormalFile(const wchar_t *path, u64 unique_id);
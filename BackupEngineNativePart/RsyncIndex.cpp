@@ -0,0 +1,153 @@
+#include "stdafx.h"
+#include "RsyncIndex.h"
+
+const rolling_checksum_t RsyncIndex::empty_key;
+
+static u64 align_image_offset(u64 offset){
+	return (offset + (RsyncIndex::image_alignment - 1)) / RsyncIndex::image_alignment * RsyncIndex::image_alignment;
+}
+
+// Fills in the array offsets and the image size from the other members.
+static void compute_layout(RsyncIndex::Layout &layout){
+	u64 slots = (u64)1 << (32 - layout.shift);
+	u64 filter_words = ((u64)1 << (32 - layout.filter_shift)) / 64;
+	layout.filter_offset = align_image_offset(sizeof(RsyncIndex::Layout));
+	layout.keys_offset = align_image_offset(layout.filter_offset + filter_words * sizeof(u64));
+	layout.groups_offset = align_image_offset(layout.keys_offset + slots * sizeof(rolling_checksum_t));
+	layout.blocks_offset = align_image_offset(layout.groups_offset + slots * sizeof(RsyncIndex::Group));
+	layout.hashes_offset = align_image_offset(layout.blocks_offset + layout.entry_count * sizeof(u32));
+	layout.image_size = align_image_offset(layout.hashes_offset + layout.entry_count * RsyncIndex::hash_size);
+}
+
+void RsyncIndex::set_pointers(const byte_t *image){
+	this->mask = ((u32)1 << (32 - this->layout.shift)) - 1;
+	this->filter = (const u64 *)(image + this->layout.filter_offset);
+	this->keys = (const rolling_checksum_t *)(image + this->layout.keys_offset);
+	this->groups = (const Group *)(image + this->layout.groups_offset);
+	this->blocks = (const u32 *)(image + this->layout.blocks_offset);
+	this->hashes = image + this->layout.hashes_offset;
+}
+
+void RsyncIndex::build(const std::vector<rsync_table_item> &table, file_size_t block_size){
+	size_t distinct = 0;
+	for (size_t i = 0; i < table.size(); i++)
+		if (!i || table[i].rolling_checksum != table[i - 1].rolling_checksum)
+			distinct++;
+
+	u32 bits = 4;
+	while (((size_t)1 << bits) < distinct * 2)
+		bits++;
+	zero_struct(this->layout);
+	this->layout.shift = 32 - bits;
+	// 16 filter bits per slot, i.e. between 32 and 64 per distinct checksum.
+	this->layout.filter_shift = 32 - (bits + 4);
+	this->layout.block_size = block_size;
+	this->layout.entry_count = table.size();
+	compute_layout(this->layout);
+
+	this->storage.assign((size_t)(this->layout.image_size / sizeof(u64)), 0);
+	auto image = (byte_t *)&this->storage[0];
+	memcpy(image, &this->layout, sizeof(this->layout));
+	this->set_pointers(image);
+	auto filter = (u64 *)(image + this->layout.filter_offset);
+	auto keys = (rolling_checksum_t *)(image + this->layout.keys_offset);
+	auto groups = (Group *)(image + this->layout.groups_offset);
+	auto blocks = (u32 *)(image + this->layout.blocks_offset);
+	auto hashes = image + this->layout.hashes_offset;
+	std::fill(keys, keys + this->mask + 1, empty_key);
+
+	auto insert = [&](rolling_checksum_t key, const Group &group){
+		auto bit = this->filter_bit(key);
+		filter[bit / 64] |= (u64)1 << (bit % 64);
+		if (key == empty_key){
+			this->layout.empty_key_group = group;
+			return;
+		}
+		auto i = this->slot(key);
+		while (keys[i] != empty_key)
+			i = (i + 1) & this->mask;
+		keys[i] = key;
+		groups[i] = group;
+	};
+	for (size_t i = 0; i < table.size();){
+		Group group;
+		group.begin = (u32)i;
+		auto key = table[i].rolling_checksum;
+		for (; i < table.size() && table[i].rolling_checksum == key; i++){
+			memcpy(hashes + i * hash_size, table[i].complex_hash, hash_size);
+			blocks[i] = (u32)(table[i].file_offset / block_size);
+		}
+		group.size = (u32)i - group.begin;
+		insert(key, group);
+	}
+	memcpy(image, &this->layout, sizeof(this->layout));
+}
+
+void RsyncIndex::attach(const byte_t *image, size_t size){
+	Layout layout;
+	if (size < sizeof(layout))
+		throw RsyncIndexFormatError();
+	memcpy(&layout, image, sizeof(layout));
+	// Everything else is derived from these, and then must match.
+	auto expected = layout;
+	if (layout.shift < 4 || layout.shift > 28 || layout.filter_shift != layout.shift - 4 || !layout.block_size || layout.entry_count > std::numeric_limits<u32>::max())
+		throw RsyncIndexFormatError();
+	compute_layout(expected);
+	if (memcmp(&expected, &layout, sizeof(layout)) || layout.image_size > size)
+		throw RsyncIndexFormatError();
+	auto &empty = layout.empty_key_group;
+	if (empty.begin > layout.entry_count || empty.size > layout.entry_count - empty.begin)
+		throw RsyncIndexFormatError();
+	auto blocks = (const u32 *)(image + layout.blocks_offset);
+	for (u64 i = 0; i < layout.entry_count; i++)
+		if (blocks[i] >= layout.entry_count)
+			throw RsyncIndexFormatError();
+	this->storage.clear();
+	this->storage.shrink_to_fit();
+	this->layout = layout;
+	this->set_pointers(image);
+}
+
+bool RsyncIndex::find(const Group &group, const byte_t *hash, bool offset_valid, file_offset_t target_offset, file_offset_t &dst) const{
+	auto compare = [&](u32 i){
+		return memcmp(this->hashes + (size_t)i * hash_size, hash, hash_size);
+	};
+
+	// Groups read from an attached image are not checked up front.
+	if (group.begin > this->layout.entry_count || group.size > this->layout.entry_count - group.begin)
+		return false;
+
+	// Lower and upper bounds of the entries with this hash.
+	u32 low = group.begin,
+		high = group.begin + group.size;
+	while (low < high){
+		auto pivot = low + (high - low) / 2;
+		if (compare(pivot) < 0)
+			low = pivot + 1;
+		else
+			high = pivot;
+	}
+	if (low == group.begin + group.size || compare(low))
+		return false;
+	u32 begin = low;
+	high = group.begin + group.size;
+	while (low < high){
+		auto pivot = low + (high - low) / 2;
+		if (compare(pivot) <= 0)
+			low = pivot + 1;
+		else
+			high = pivot;
+	}
+	u32 end = low;
+
+	const auto block_size = this->layout.block_size;
+	dst = this->blocks[begin] * block_size;
+	if (offset_valid && target_offset % block_size == 0){
+		auto first = this->blocks + begin,
+			last = this->blocks + end;
+		auto i = std::lower_bound(first, last, (u32)(target_offset / block_size));
+		if (i != last && *i * block_size == target_offset)
+			dst = target_offset;
+	}
+	return true;
+}
@@ -0,0 +1,137 @@
+#pragma once
+#include "MiscTypes.h"
+#include "MiscFunctions.h"
+
+/*
+Maps rolling checksums to the blocks of a file that have them.
+
+The index is an open-addressing hash table with linear probing over the
+distinct checksums, kept at most half full. Each occupied slot refers to a
+contiguous group of entries sharing its checksum, sorted by strong hash and
+then by block number. Keys, strong hashes and block numbers are stored in
+separate flat arrays; since every block but the last is block_size bytes
+long, a block's offset is its number times block_size.
+
+Nearly every query is for a checksum that isn't there, so a bitmap with at
+least 32 bits per distinct checksum sits in front of the table. It answers most
+queries with a single, predictable bit test, and only the few that pass it
+go on to probe the keys.
+
+Since 0xFFFFFFFF marks an empty slot, blocks with that checksum are kept in
+a group of their own outside the table.
+
+All of it lives in a single image: a Layout followed by the arrays, each
+starting on a 64-byte boundary. The image can be written out as is, and
+attach() can later use a copy of it in place, e.g. from a mapped file.
+*/
+class RsyncIndex{
+public:
+	struct Group{
+		u32 begin,
+			size;
+	};
+	struct Layout{
+		u32 shift;
+		u32 filter_shift;
+		Group empty_key_group;
+		u64 block_size;
+		u64 entry_count;
+		u64 filter_offset;
+		u64 keys_offset;
+		u64 groups_offset;
+		u64 blocks_offset;
+		u64 hashes_offset;
+		u64 image_size;
+	};
+	static const rolling_checksum_t empty_key = 0xFFFFFFFF;
+	static const size_t hash_size = sizeof(rsync_table_item().complex_hash);
+	static const size_t image_alignment = 64;
+private:
+	std::vector<u64> storage;
+	Layout layout;
+	u32 mask;
+	const u64 *filter;
+	const rolling_checksum_t *keys;
+	const Group *groups;
+	const u32 *blocks;
+	const byte_t *hashes;
+
+	RsyncIndex(const RsyncIndex &){}
+	void operator=(const RsyncIndex &){}
+	u32 slot(rolling_checksum_t x) const{
+		return (u32)(x * 0x9E3779B1U) >> this->layout.shift;
+	}
+	u32 filter_bit(rolling_checksum_t x) const{
+		return (u32)(x * 0x85EBCA6BU) >> this->layout.filter_shift;
+	}
+	bool filter_test(rolling_checksum_t x) const{
+		auto bit = this->filter_bit(x);
+		return !!((this->filter[bit / 64] >> (bit % 64)) & 1);
+	}
+	void set_pointers(const byte_t *image);
+public:
+	RsyncIndex(){
+		this->build(std::vector<rsync_table_item>(), 1);
+	}
+	// table must be sorted by rsync_table_item::operator<(), and every offset
+	// in it must be a multiple of block_size.
+	void build(const std::vector<rsync_table_item> &table, file_size_t block_size);
+	// Uses an image written by a previous build() without copying it. The
+	// memory must start on an 8-byte boundary and outlive the index, or the
+	// next build() or attach(). Throws RsyncIndexFormatError if the image is
+	// not consistent with its size, or refers to blocks past the end of the
+	// file, which has one block per entry.
+	void attach(const byte_t *image, size_t size);
+	const byte_t *get_image() const{
+		return (const byte_t *)this->filter - this->layout.filter_offset;
+	}
+	size_t get_image_size() const{
+		return (size_t)this->layout.image_size;
+	}
+	size_t size() const{
+		return (size_t)this->layout.entry_count;
+	}
+	file_size_t get_block_size() const{
+		return this->layout.block_size;
+	}
+	bool find(rolling_checksum_t x, Group &dst) const{
+		if (!this->filter_test(x))
+			return false;
+		if (x == empty_key){
+			dst = this->layout.empty_key_group;
+			return !!dst.size;
+		}
+		// An attached image may have no empty slot to stop at.
+		auto i = this->slot(x);
+		for (u64 probes = 0; probes <= this->mask; probes++, i = (i + 1) & this->mask){
+			auto key = this->keys[i];
+			if (key == x){
+				dst = this->groups[i];
+				return true;
+			}
+			if (key == empty_key)
+				return false;
+		}
+		return false;
+	}
+	/*
+	Looks in group for a block with the given strong hash. If there is more than
+	one, the one at target_offset is preferred when offset_valid is set, and
+	otherwise the one with the lowest offset.
+	*/
+	bool find(const Group &group, const byte_t *hash, bool offset_valid, file_offset_t target_offset, file_offset_t &dst) const;
+	bool might_contain(rolling_checksum_t x) const{
+		Group group;
+		return this->find(x, group);
+	}
+	void prefetch(rolling_checksum_t x) const{
+		prefetch_for_read(&this->filter[this->filter_bit(x) / 64]);
+	}
+};
+
+class RsyncIndexFormatError : public std::exception{
+public:
+	const char *what() const override{
+		return "The rsync index is damaged.";
+	}
+};
@@ -4,61 +4,151 @@
 #include "MiscFunctions.h"
 #include "MiscTypes.h"
 #include "RollingChecksum.h"
-#include "circular_buffer.h"
 #include "FileComparer.h"
+#include "SignatureBuilder.h"
+#include "FileDigest.h"
+#include "Threads.h"
+#include "MappedFile.h"
+#include "streams.h"
 
-RsyncableFile::RsyncableFile(const std::wstring &path){
+static const char signature_file_magic[8] = { 'B', 'E', 'S', 'I', 'G', 'N', 'A', 'T' };
+static const u32 signature_file_version = 1;
+
+struct SignatureRange{
+	file_offset_t begin,
+		end;
+	std::vector<rsync_table_item> table;
+	FileDigest digest;
+};
+
+static void compute_signature_range(SignatureRange &range, const std::wstring &path, file_size_t block_size, StrongHashAlgorithm algorithm){
+	BlockByBlockReader stream(path.c_str(), block_size);
+	stream.seek(range.begin);
+
+	range.table.reserve(blocks_per_file(range.end - range.begin, block_size));
+	StrongHash local_hash(algorithm);
+	BufferView buffer;
+	file_offset_t offset = range.begin;
+	while (offset < range.end && stream.next_block(buffer)){
+		range.digest.update(buffer.data(), buffer.size());
+
+		rsync_table_item item;
+		item.rolling_checksum = compute_rsync_rolling_checksum(buffer.data(), buffer.size());
+		local_hash.calculate_digest(item.complex_hash, buffer.data(), buffer.size());
+		item.file_offset = offset;
+		range.table.push_back(item);
+		offset += buffer.size();
+	}
+	range.digest.flush();
+}
+
+RsyncableFile::RsyncableFile(const std::wstring &path, StrongHashAlgorithm algorithm){
 	const auto file_size = get_file_size(path.c_str());
 	const auto block_size = scaler_function(file_size);
 	this->block_size = block_size;
-	
-	BlockByBlockReader stream(path.c_str(), block_size);
+	this->strong_hash_algorithm = algorithm;
 
 	std::cout << "Selected block size: " << block_size << std::endl;
 
-	this->rsync_table.reserve(blocks_per_file(file_size, block_size));
-	CryptoPP::SHA1 global_sha1;
-	circular_buffer buffer(1);
-	file_offset_t offset = 0;
-	while (stream.next_block(buffer)){
-		CryptoPP::SHA1 local_sha1;
-		global_sha1.Update(buffer.data(), buffer.size());
-		local_sha1.Update(buffer.data(), buffer.size());
+	// Ranges start on both block and digest segment boundaries. Both sizes
+	// are powers of two, so the larger is a multiple of the smaller. There
+	// are a few ranges per thread, so that threads finishing early can pick
+	// up more work.
+	const auto alignment = std::max(block_size, digest_segment_size);
+	const auto threads = get_processor_count();
+	auto range_size = (file_size + threads * 4 - 1) / (threads * 4);
+	range_size = std::max((range_size + alignment - 1) / alignment * alignment, alignment);
+	std::vector<SignatureRange> ranges((size_t)((file_size + range_size - 1) / range_size));
+	for (size_t i = 0; i < ranges.size(); i++){
+		ranges[i].begin = i * range_size;
+		ranges[i].end = std::min(ranges[i].begin + range_size, file_size);
+	}
 
-		rsync_table_item item;
-		item.rolling_checksum = compute_rsync_rolling_checksum(buffer);
-		local_sha1.Final(item.complex_hash);
-		item.file_offset = offset;
-		this->rsync_table.push_back(item);
-		offset += buffer.size();
+	parallel_for(ranges.size(), [&](size_t i){
+		compute_signature_range(ranges[i], path, block_size, algorithm);
+	}, threads);
+
+	std::vector<rsync_table_item> table;
+	table.reserve(blocks_per_file(file_size, block_size));
+	FileDigest digest;
+	for (auto &range : ranges){
+		table.insert(table.end(), range.table.begin(), range.table.end());
+		range.table.clear();
+		range.table.shrink_to_fit();
+		digest.append(range.digest);
 	}
-	global_sha1.Final(this->sha1);
-	std::sort(this->rsync_table.begin(), this->rsync_table.end());
-	this->init_bitmap();
+	digest.final(this->digest);
+	std::sort(table.begin(), table.end());
+	this->index.build(table, this->block_size);
 }
 
 RsyncableFile::RsyncableFile(const FileComparer &comparer){
-	this->rsync_table = comparer.get_new_table();
-	this->init_bitmap();
-	memcpy(this->sha1, comparer.get_new_digest(), sizeof(this->sha1));
+	memcpy(this->digest, comparer.get_new_digest(), sizeof(this->digest));
+	this->block_size = comparer.get_new_block_size();
+	this->strong_hash_algorithm = comparer.get_strong_hash_algorithm();
+	this->index.build(comparer.get_new_table(), this->block_size);
+}
+
+RsyncableFile::RsyncableFile(const ParallelFileComparer &comparer){
+	memcpy(this->digest, comparer.get_new_digest(), sizeof(this->digest));
 	this->block_size = comparer.get_new_block_size();
+	this->strong_hash_algorithm = comparer.get_strong_hash_algorithm();
+	this->index.build(comparer.get_new_table(), this->block_size);
 }
 
-void RsyncableFile::init_bitmap(){
-	this->bitmap.resize(1 << 24, false);
-	for (auto &i : this->rsync_table)
-		this->bitmap[i.rolling_checksum & 0xFFFFFF] = true;
+RsyncableFile::RsyncableFile(const SignatureBuilder &builder){
+	memcpy(this->digest, builder.get_digest(), sizeof(this->digest));
+	this->block_size = builder.get_block_size();
+	this->strong_hash_algorithm = builder.get_strong_hash_algorithm();
+	this->index.build(builder.get_table(), this->block_size);
 }
 
-void RsyncableFile::save(const char *path){
-	if (!this->rsync_table.size())
-		return;
-	std::ofstream file(path, std::ios::binary);
-	if (!file)
-		return;
-	file.write((const char *)&this->rsync_table[0], sizeof(rsync_table_item) * this->rsync_table.size());
+std::shared_ptr<RsyncableFile> RsyncableFile::load(const wchar_t *path){
+	std::shared_ptr<RsyncableFile> ret(new RsyncableFile);
+	ret->mapping.reset(new MappedFile(path));
+	auto data = ret->mapping->data();
+	auto size = ret->mapping->size();
+
+	SignatureFileHeader header;
+	if (size < sizeof(header))
+		throw SignatureFormatError();
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.magic, signature_file_magic, sizeof(header.magic)) || header.version != signature_file_version)
+		throw SignatureFormatError();
+	if (header.header_size < sizeof(header) || header.header_size % RsyncIndex::image_alignment || header.header_size > size)
+		throw SignatureFormatError();
+	if (header.rolling_checksum_algorithm || !is_known_strong_hash_algorithm(header.strong_hash_algorithm) || header.digest_segment_size != digest_segment_size)
+		throw SignatureFormatError();
+
+	try{
+		ret->index.attach(data + header.header_size, (size_t)(size - header.header_size));
+	}catch (RsyncIndexFormatError &){
+		throw SignatureFormatError();
+	}
+	if (ret->index.get_block_size() != header.block_size || ret->index.size() != header.item_count)
+		throw SignatureFormatError();
+	ret->block_size = header.block_size;
+	ret->strong_hash_algorithm = (StrongHashAlgorithm)header.strong_hash_algorithm;
+	memcpy(ret->digest, header.digest, sizeof(ret->digest));
+	return ret;
 }
 
-bool RsyncableFile::does_not_contain(rolling_checksum_t x){
-	return !this->bitmap[x & 0xFFFFFF];
+void RsyncableFile::save(const wchar_t *path) const{
+	SignatureFileHeader header;
+	zero_struct(header);
+	memcpy(header.magic, signature_file_magic, sizeof(header.magic));
+	header.version = signature_file_version;
+	header.header_size = (u32)((sizeof(header) + RsyncIndex::image_alignment - 1) / RsyncIndex::image_alignment * RsyncIndex::image_alignment);
+	header.strong_hash_algorithm = (u32)this->strong_hash_algorithm;
+	header.block_size = this->block_size;
+	header.item_count = this->index.size();
+	header.digest_segment_size = digest_segment_size;
+	memcpy(header.digest, this->digest, sizeof(header.digest));
+
+	std::vector<byte_t> padded_header(header.header_size, 0);
+	memcpy(&padded_header[0], &header, sizeof(header));
+	FileOutputStream file(path);
+	file.write(&padded_header[0], padded_header.size());
+	file.write(this->index.get_image(), this->index.get_image_size());
+	file.flush();
 }
@@ -1,19 +1,57 @@
 #pragma once
 #include "MiscTypes.h"
+#include "MiscFunctions.h"
+#include "StrongHash.h"
+#include "RsyncIndex.h"
 
 class FileComparer;
+class ParallelFileComparer;
+class SignatureBuilder;
+class MappedFile;
 
+/*
+The signature of a file: its digest, and the rolling checksum and strong hash
+of each of its blocks, indexed for lookup.
+
+save() writes a signature file, which is a SignatureFileHeader followed by the
+image of the RsyncIndex. load() maps such a file and uses the index right
+where it is, so a signature can be reused without reading the data it
+describes, or even the whole signature.
+*/
 class RsyncableFile{
-	byte_t sha1[20];
-	std::vector<rsync_table_item> rsync_table;
-	std::vector<bool> bitmap;
+	byte_t digest[20];
+	RsyncIndex index;
 	file_size_t block_size;
+	StrongHashAlgorithm strong_hash_algorithm;
+	std::shared_ptr<MappedFile> mapping;
 
-	void init_bitmap();
+	RsyncableFile(){}
 public:
-	RsyncableFile(const std::wstring &path);
+	struct SignatureFileHeader{
+		char magic[8];
+		u32 version;
+		// Offset of the index image from the start of the file.
+		u32 header_size;
+		// Always 0, for the rsync checksum in RollingChecksum.h.
+		u32 rolling_checksum_algorithm;
+		u32 strong_hash_algorithm;
+		u64 block_size;
+		u64 item_count;
+		// See FileDigest.h.
+		u64 digest_segment_size;
+		byte_t digest[20];
+		u32 reserved;
+	};
+
+	RsyncableFile(const std::wstring &path, StrongHashAlgorithm = default_strong_hash_algorithm);
 	RsyncableFile(const FileComparer &);
-	void save(const char *path);
+	RsyncableFile(const ParallelFileComparer &);
+	// The builder must have been finished.
+	RsyncableFile(const SignatureBuilder &);
+	// Throws SignatureFormatError if the file is not a signature this version
+	// can use.
+	static std::shared_ptr<RsyncableFile> load(const wchar_t *path);
+	void save(const wchar_t *path) const;
 	static file_size_t scaler_function(file_size_t x){
 		const size_t limit = 64 << 20;
 		u64 ret = 512;
@@ -24,21 +62,30 @@ public:
 	file_size_t get_block_size() const{
 		return this->block_size;
 	}
-	void get_table(const rsync_table_item *&begin, const rsync_table_item *&end) const{
-		if (!this->rsync_table.size()){
-			begin = nullptr;
-			end = nullptr;
-			return;
-		}
-		begin = &this->rsync_table[0];
-		end = begin + this->rsync_table.size();
+	StrongHashAlgorithm get_strong_hash_algorithm() const{
+		return this->strong_hash_algorithm;
+	}
+	const RsyncIndex &get_index() const{
+		return this->index;
 	}
 	const byte *get_digest() const{
-		return this->sha1;
+		return this->digest;
+	}
+	bool might_contain(rolling_checksum_t x) const{
+		return this->index.might_contain(x);
+	}
+	void prefetch(rolling_checksum_t x) const{
+		this->index.prefetch(x);
 	}
-	bool does_not_contain(rolling_checksum_t);
 };
 
 inline size_t blocks_per_file(file_size_t file_size, size_t block_size){
 	return (file_size + (block_size - 1)) / block_size;
 }
+
+class SignatureFormatError : public std::exception{
+public:
+	const char *what() const override{
+		return "The signature file is damaged or was written by an incompatible version.";
+	}
+};
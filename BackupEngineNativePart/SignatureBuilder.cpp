@@ -0,0 +1,91 @@
+#include "stdafx.h"
+#include "SignatureBuilder.h"
+#include "RsyncableFile.h"
+#include "RollingChecksum.h"
+#include "ExportedFunctions.h"
+
+SignatureBuilder::SignatureBuilder(file_size_t expected_file_size, StrongHashAlgorithm algorithm):
+		block_size(RsyncableFile::scaler_function(expected_file_size)),
+		strong_hash(algorithm),
+		offset(0),
+		finished(false){
+	zero_array(this->digest);
+	this->partial_block.reserve((size_t)this->block_size);
+	this->table.reserve(blocks_per_file(expected_file_size, (size_t)this->block_size));
+}
+
+void SignatureBuilder::add_block(const byte_t *buffer, size_t size){
+	rsync_table_item item;
+	item.rolling_checksum = compute_rsync_rolling_checksum(buffer, size);
+	this->strong_hash.calculate_digest(item.complex_hash, buffer, size);
+	item.file_offset = this->offset;
+	this->table.push_back(item);
+	this->offset += size;
+}
+
+void SignatureBuilder::update(const byte_t *buffer, size_t size){
+	if (this->finished)
+		return;
+	this->file_digest.update(buffer, size);
+	const auto block_size = (size_t)this->block_size;
+	if (this->partial_block.size()){
+		auto n = std::min(size, block_size - this->partial_block.size());
+		this->partial_block.insert(this->partial_block.end(), buffer, buffer + n);
+		buffer += n;
+		size -= n;
+		if (this->partial_block.size() < block_size)
+			return;
+		this->add_block(&this->partial_block[0], block_size);
+		this->partial_block.clear();
+	}
+	// Whole blocks are taken straight from the caller's buffer.
+	for (; size >= block_size; buffer += block_size, size -= block_size)
+		this->add_block(buffer, block_size);
+	this->partial_block.insert(this->partial_block.end(), buffer, buffer + size);
+}
+
+void SignatureBuilder::finish(){
+	if (this->finished)
+		return;
+	this->finished = true;
+	if (this->partial_block.size())
+		this->add_block(&this->partial_block[0], this->partial_block.size());
+	this->partial_block.clear();
+	this->partial_block.shrink_to_fit();
+	this->file_digest.flush();
+	this->file_digest.final(this->digest);
+	std::sort(this->table.begin(), this->table.end());
+}
+
+EXPORT_THIS int signature_builder_create(void **object, std::uint64_t expected_file_size, unsigned strong_hash_algorithm){
+	*object = nullptr;
+	if (!is_known_strong_hash_algorithm(strong_hash_algorithm))
+		return ERROR_INVALID_PARAMETER;
+	try{
+		*object = new SignatureBuilder(expected_file_size, (StrongHashAlgorithm)strong_hash_algorithm);
+	}catch (std::bad_alloc &){
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+	return 0;
+}
+
+EXPORT_THIS void signature_builder_update(void *object, const std::uint8_t *buffer, int offset, int length){
+	((SignatureBuilder *)object)->update(buffer + offset, length);
+}
+
+EXPORT_THIS int signature_builder_save(void *object, const wchar_t *path){
+	auto builder = (SignatureBuilder *)object;
+	try{
+		builder->finish();
+		RsyncableFile(*builder).save(path);
+	}catch (Win32Error &e){
+		return e.error;
+	}catch (std::bad_alloc &){
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+	return 0;
+}
+
+EXPORT_THIS void signature_builder_release(void *object){
+	delete (SignatureBuilder *)object;
+}
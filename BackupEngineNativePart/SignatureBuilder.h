@@ -0,0 +1,42 @@
+#pragma once
+#include "MiscTypes.h"
+#include "StrongHash.h"
+#include "FileDigest.h"
+
+/*
+Computes the same signature as RsyncableFile(path), but from data pushed to
+it in pieces of any size, so that it can sit on a stream that is being read
+for some other purpose, e.g. archiving. The block size is chosen from the
+expected size of the file; if the stream turns out to be of a different
+length, the signature is still valid for the data actually seen.
+*/
+class SignatureBuilder{
+	file_size_t block_size;
+	StrongHash strong_hash;
+	std::vector<byte_t> partial_block;
+	file_offset_t offset;
+	std::vector<rsync_table_item> table;
+	FileDigest file_digest;
+	byte_t digest[20];
+	bool finished;
+
+	void add_block(const byte_t *buffer, size_t size);
+public:
+	SignatureBuilder(file_size_t expected_file_size, StrongHashAlgorithm = default_strong_hash_algorithm);
+	void update(const byte_t *buffer, size_t size);
+	// Processes the last, possibly short, block. No more data can be added
+	// afterwards.
+	void finish();
+	const std::vector<rsync_table_item> &get_table() const{
+		return this->table;
+	}
+	const byte_t *get_digest() const{
+		return this->digest;
+	}
+	file_size_t get_block_size() const{
+		return this->block_size;
+	}
+	StrongHashAlgorithm get_strong_hash_algorithm() const{
+		return this->strong_hash.get_algorithm();
+	}
+};
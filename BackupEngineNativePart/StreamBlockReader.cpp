@@ -3,155 +3,163 @@
 #include "MiscFunctions.h"
 #include "MiscTypes.h"
 #include "circular_buffer.h"
+#include "sliding_window.h"
 
-StreamBlockReader::StreamBlockReader(const wchar_t *_path, size_t block_size):
-		eof(false),
-		reading(false),
+StreamBlockReader::StreamBlockReader(const wchar_t *path, const ReadAheadParameters &parameters):
+		reader(open_sequential_reader(path, parameters)),
 		offset(0),
-		disk_block_size(block_size){
-	zero_struct(this->overlapped);
-	auto path = path_from_string(_path);
-	this->file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
-	if (!valid_handle(this->file))
-		throw Win32Error();
-	this->alloc();
-	this->read_more();
-}
-
-void StreamBlockReader::alloc(){
-	this->next_buffer.reset(new circular_buffer(this->disk_block_size));
-}
+		eof(false){}
 
-StreamBlockReader::~StreamBlockReader(){
-	if (valid_handle(this->file))
-		CloseHandle(this->file);
-}
+StreamBlockReader::~StreamBlockReader(){}
 
 void StreamBlockReader::seek(file_offset_t offset){
-	this->cancel();
 	this->clear_buffers();
 	this->eof = false;
-	LARGE_INTEGER li;
-	li.QuadPart = offset;
-	if (!SetFilePointerEx(this->file, li, nullptr, FILE_BEGIN))
-		throw Win32Error();
+	this->reader->seek(offset);
 	this->offset = offset;
-	this->read_more();
 }
 
 file_size_t StreamBlockReader::size(){
-	LARGE_INTEGER li;
-	return GetFileSizeEx(this->file, &li) ? li.QuadPart : 0;
+	return this->reader->size();
 }
 
-void StreamBlockReader::read_more(){
-	if (this->eof)
-		return;
-	if (this->reading)
-		this->cancel();
-	this->next_buffer->reset();
-	this->overlapped.Offset = this->offset & mask_32bits;
-	this->overlapped.OffsetHigh = this->offset >> 32;
-	ReadFile(this->file, this->next_buffer->data(), (DWORD)this->disk_block_size, nullptr, &overlapped);
-	this->reading = true;
+BufferView StreamBlockReader::finish_read(){
+	auto ret = this->reader->next();
+	if (!ret.size()){
+		this->eof = true;
+		return ret;
+	}
+	this->offset += ret.size();
+	return ret;
 }
 
-void StreamBlockReader::cancel(){
-	CancelIo(this->file);
-	this->reading = false;
+size_t BlockByBlockReader::actual_block_size(size_t block_size){
+	return !block_size ? StreamBlockReader::default_disk_block_size : block_size;
 }
 
-std::shared_ptr<circular_buffer> StreamBlockReader::finish_read(){
-	DWORD bytes_read;
-	auto res = GetOverlappedResult(this->file, &this->overlapped, &bytes_read, true);
-	this->reading = false;
-	if (!res){
-		auto error = GetLastError();
-		if (error == ERROR_HANDLE_EOF){
-			this->eof = true;
-			return std::shared_ptr<circular_buffer>();
+ReadAheadParameters BlockByBlockReader::align_request_size(ReadAheadParameters parameters, size_t block_size){
+	block_size = actual_block_size(block_size);
+	// Unbuffered requests are rounded up to the sector size as well, so
+	// round to a multiple of both, or pieces would stop lining up with blocks.
+	auto unit = block_size;
+	if (parameters.unbuffered){
+		size_t a = block_size,
+			b = unbuffered_io_alignment;
+		while (b){
+			auto t = a % b;
+			a = b;
+			b = t;
 		}
-		throw Win32Error(error);
+		unit = block_size / a * unbuffered_io_alignment;
 	}
-	this->offset += bytes_read;
-	auto ret = this->next_buffer;
-	ret->trim(bytes_read);
-	this->alloc();
-	this->read_more();
-	return ret;
+	auto &size = parameters.request_size;
+	size = (std::max<size_t>(size, 1) + unit - 1) / unit * unit;
+	return parameters;
 }
 
-BlockByBlockReader::BlockByBlockReader(const wchar_t *path, size_t block_size):
-		StreamBlockReader(path){
-	this->block_size = !block_size ? StreamBlockReader::disk_block_size : block_size;
-}
+BlockByBlockReader::BlockByBlockReader(const wchar_t *path, size_t block_size, const ReadAheadParameters &parameters):
+		StreamBlockReader(path, align_request_size(parameters, block_size)),
+		block_size(actual_block_size(block_size)),
+		block_pool(actual_block_size(block_size)){}
 
 void BlockByBlockReader::clear_buffers(){
 	this->current_buffer.reset();
 }
 
-bool BlockByBlockReader::next_block(circular_buffer &dst){
+bool BlockByBlockReader::next_block(BufferView &dst){
+	dst.reset();
 	if (this->eof)
 		return false;
-	dst.realloc(this->block_size);
-	dst.reset_size();
-	bool read = false;
-	while (dst.size() < this->block_size){
-		if (this->current_buffer && this->current_buffer->size()){
-			this->current_buffer->pop_buffer(dst);
-			read = false;
-		}else{
-			if (!read){
-				this->current_buffer = this->finish_read();
-				read = true;
-			}else{
-				this->eof = true;
+	if (!this->current_buffer.size()){
+		this->current_buffer = this->finish_read();
+		if (!this->current_buffer.size())
+			return false;
+	}
+	if (this->current_buffer.size() >= this->block_size){
+		dst = this->current_buffer.slice(0, this->block_size);
+		this->current_buffer.remove_prefix(this->block_size);
+		return true;
+	}
+
+	// The block continues in the next request, if there is one.
+	auto block = this->block_pool.acquire();
+	size_t size = 0;
+	while (size < this->block_size){
+		if (!this->current_buffer.size()){
+			this->current_buffer = this->finish_read();
+			if (!this->current_buffer.size())
 				break;
-			}
 		}
+		auto n = std::min(this->current_buffer.size(), this->block_size - size);
+		memcpy(block.data() + size, this->current_buffer.data(), n);
+		this->current_buffer.remove_prefix(n);
+		size += n;
 	}
-	return !!dst.size();
+	dst = block.publish(size);
+	return true;
+}
+
+bool BlockByBlockReader::next_block(circular_buffer &dst){
+	BufferView block;
+	auto ret = this->next_block(block);
+	dst.realloc(this->block_size);
+	dst.reset_size();
+	dst.push_buffer((byte_t *)block.data(), block.size());
+	return ret;
 }
 
 void ByteByByteReader::clear_buffers(){
 	BlockByBlockReader::clear_buffers();
-	this->current_buffer2.reset(new circular_buffer(1));
-	this->current_buffer2->reset_size();
+	this->current_buffer2.reset();
 }
 
-ByteByByteReader::ByteByByteReader(const wchar_t *path, size_t block_size): BlockByBlockReader(path, block_size){
-	this->current_buffer2.reset(new circular_buffer(1));
-	this->next_block(*this->current_buffer2);
+ByteByByteReader::ByteByByteReader(const wchar_t *path, size_t block_size, const ReadAheadParameters &parameters): BlockByBlockReader(path, block_size, parameters){
+	this->next_block(this->current_buffer2);
 }
 
 bool ByteByByteReader::next_byte(byte_t &dst){
-	if (!this->current_buffer2->size())
+	if (!this->current_buffer2.size())
 		return false;
-	dst = this->current_buffer2->pop();
-	if (!this->current_buffer2->size())
+	dst = *this->current_buffer2.data();
+	this->current_buffer2.remove_prefix(1);
+	if (!this->current_buffer2.size())
 		this->read_more2();
 	return true;
 }
 
+bool ByteByByteReader::peek(const byte_t *&data, size_t &size) const{
+	size = this->current_buffer2.size();
+	data = this->current_buffer2.data();
+	return !!size;
+}
+
+void ByteByByteReader::skip(size_t n){
+	this->current_buffer2.remove_prefix(n);
+	if (!this->current_buffer2.size())
+		this->read_more2();
+}
+
 bool ByteByByteReader::read_more2(){
-	this->next_block(*this->current_buffer2);
-	return !!this->current_buffer2->size();
+	return this->next_block(this->current_buffer2);
 }
 
-bool ByteByByteReader::whole_block(circular_buffer &dst){
-	if (!this->current_buffer2->size())
+bool ByteByByteReader::whole_block(sliding_window &dst){
+	if (!this->current_buffer2.size())
 		this->read_more2();
-	if (!this->current_buffer2->size())
+	if (!this->current_buffer2.size())
 		return false;
-	dst.realloc(this->block_size);
-	dst.reset_size();
-	this->current_buffer2->pop_buffer(dst);
-	if (dst.size() != dst.capacity()){
+	dst.reset(this->block_size);
+	auto take = [this, &dst](){
+		auto n = dst.append(this->current_buffer2.data(), this->current_buffer2.size());
+		this->current_buffer2.remove_prefix(n);
+	};
+	take();
+	if (!dst.full()){
 		if (!this->read_more2())
 			return true;
-		this->current_buffer2->pop_buffer(dst);
+		take();
 	}
-	if (!this->current_buffer2->size())
+	if (!this->current_buffer2.size())
 		this->read_more2();
 	return true;
 }
@@ -1,28 +1,23 @@
 #pragma once
+#include "ReadAhead.h"
 
 class circular_buffer;
+class sliding_window;
 
 class StreamBlockReader{
-	HANDLE file;
-	OVERLAPPED overlapped;
-	std::shared_ptr<circular_buffer> next_buffer;
-	bool reading;
+	std::unique_ptr<SequentialReader> reader;
 
 	StreamBlockReader(const StreamBlockReader &){}
 	void operator=(const StreamBlockReader &){}
-	void cancel();
-	void alloc();
 protected:
 	file_offset_t offset;
 	static const size_t default_disk_block_size = 1 << 13;
-	size_t disk_block_size;
 	bool eof;
 
-	void read_more();
 	virtual void clear_buffers() = 0;
-	std::shared_ptr<circular_buffer> finish_read();
+	BufferView finish_read();
 public:
-	StreamBlockReader(const wchar_t *path, size_t block_size = default_disk_block_size);
+	StreamBlockReader(const wchar_t *path, const ReadAheadParameters & = ReadAheadParameters());
 	virtual ~StreamBlockReader();
 	void seek(file_offset_t offset);
 	bool at_eof() const{
@@ -31,27 +26,45 @@ public:
 	file_size_t size(); 
 };
 
+/*
+Splits a file into blocks of block_size bytes (the last one possibly shorter).
+Blocks are handed out as views of the pieces the underlying reader returns
+(read-ahead buffers or mapped windows) whenever they fit inside one, which is
+always the case when the request size is a multiple of the block size; the
+constructor rounds it up to one for that reason. Only blocks that straddle
+two pieces are copied, into a pooled buffer.
+*/
 class BlockByBlockReader : public StreamBlockReader{
 protected:
-	std::shared_ptr<circular_buffer> current_buffer;
+	BufferView current_buffer;
 	size_t block_size;
+	BufferPool block_pool;
 
+	static size_t actual_block_size(size_t);
+	static ReadAheadParameters align_request_size(ReadAheadParameters, size_t block_size);
 	virtual void clear_buffers();
 public:
-	BlockByBlockReader(const wchar_t *path, size_t block_size = 0);
+	BlockByBlockReader(const wchar_t *path, size_t block_size = 0, const ReadAheadParameters & = ReadAheadParameters());
 	virtual ~BlockByBlockReader(){}
+	bool next_block(BufferView &);
+	// Same as above, for callers that need the block in a buffer of their own.
 	bool next_block(circular_buffer &);
 };
 
 class ByteByByteReader : private BlockByBlockReader{
-	std::shared_ptr<circular_buffer> current_buffer2;
+	BufferView current_buffer2;
 
 	void clear_buffers();
 	bool read_more2();
 public:
-	ByteByByteReader(const wchar_t *path, size_t block_size = 0);
+	ByteByByteReader(const wchar_t *path, size_t block_size = 0, const ReadAheadParameters & = ReadAheadParameters());
 	bool next_byte(byte_t &);
-	bool whole_block(circular_buffer &);
+	// Replaces the contents of the window with the next block.
+	bool whole_block(sliding_window &);
+	// Exposes the bytes that subsequent calls to next_byte() would return, as
+	// a contiguous run that stays valid until the next call to skip().
+	bool peek(const byte_t *&data, size_t &size) const;
+	void skip(size_t n);
 	void seek(file_offset_t offset){
 		BlockByBlockReader::seek(offset);
 	}
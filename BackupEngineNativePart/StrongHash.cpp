@@ -0,0 +1,157 @@
+#include "stdafx.h"
+#include "StrongHash.h"
+
+StrongHash::StrongHash(StrongHashAlgorithm algorithm): algorithm(algorithm){
+	this->restart();
+}
+
+void StrongHash::restart(){
+	switch (this->algorithm){
+		case StrongHashAlgorithm::Sha1:
+			this->sha1.Restart();
+			break;
+		case StrongHashAlgorithm::Murmur3_128:
+			this->murmur3_restart();
+			break;
+	}
+}
+
+void StrongHash::update(const byte_t *buffer, size_t size){
+	switch (this->algorithm){
+		case StrongHashAlgorithm::Sha1:
+			this->sha1.Update(buffer, size);
+			break;
+		case StrongHashAlgorithm::Murmur3_128:
+			this->murmur3_update(buffer, size);
+			break;
+	}
+}
+
+void StrongHash::final(byte_t *digest){
+	switch (this->algorithm){
+		case StrongHashAlgorithm::Sha1:
+			static_assert(CryptoPP::SHA1::DIGESTSIZE == strong_hash_size, "SHA-1 must fill the whole digest.");
+			this->sha1.Final(digest);
+			break;
+		case StrongHashAlgorithm::Murmur3_128:
+			this->murmur3_final(digest);
+			memset(digest + 16, 0, strong_hash_size - 16);
+			break;
+	}
+}
+
+static const u64 murmur3_c1 = 0x87c37b91114253d5ULL;
+static const u64 murmur3_c2 = 0x4cf5ad432745937fULL;
+
+static inline u64 rotl64(u64 x, int r){
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline u64 read_u64_le(const byte_t *p){
+	u64 ret = 0;
+	for (int i = 8; i--;)
+		ret = (ret << 8) | p[i];
+	return ret;
+}
+
+static inline void write_u64_le(byte_t *p, u64 x){
+	for (int i = 0; i < 8; i++, x >>= 8)
+		p[i] = (byte_t)x;
+}
+
+static inline u64 fmix64(u64 k){
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+static inline void murmur3_block(u64 &h1, u64 &h2, const byte_t *block){
+	u64 k1 = read_u64_le(block),
+		k2 = read_u64_le(block + 8);
+
+	k1 *= murmur3_c1;
+	k1 = rotl64(k1, 31);
+	k1 *= murmur3_c2;
+	h1 ^= k1;
+
+	h1 = rotl64(h1, 27);
+	h1 += h2;
+	h1 = h1 * 5 + 0x52dce729;
+
+	k2 *= murmur3_c2;
+	k2 = rotl64(k2, 33);
+	k2 *= murmur3_c1;
+	h2 ^= k2;
+
+	h2 = rotl64(h2, 31);
+	h2 += h1;
+	h2 = h2 * 5 + 0x38495ab5;
+}
+
+void StrongHash::murmur3_restart(){
+	this->h1 = 0;
+	this->h2 = 0;
+	this->length = 0;
+}
+
+void StrongHash::murmur3_update(const byte_t *buffer, size_t size){
+	auto pending = (size_t)(this->length % 16);
+	this->length += size;
+	if (pending){
+		auto n = std::min(16 - pending, size);
+		memcpy(this->tail + pending, buffer, n);
+		buffer += n;
+		size -= n;
+		if (pending + n < 16)
+			return;
+		murmur3_block(this->h1, this->h2, this->tail);
+	}
+	u64 h1 = this->h1,
+		h2 = this->h2;
+	for (; size >= 16; buffer += 16, size -= 16)
+		murmur3_block(h1, h2, buffer);
+	this->h1 = h1;
+	this->h2 = h2;
+	memcpy(this->tail, buffer, size);
+}
+
+void StrongHash::murmur3_final(byte_t *digest){
+	auto h1 = this->h1,
+		h2 = this->h2;
+	auto pending = (size_t)(this->length % 16);
+	if (pending){
+		byte_t padded[16] = { 0 };
+		memcpy(padded, this->tail, pending);
+		u64 k1 = read_u64_le(padded),
+			k2 = read_u64_le(padded + 8);
+		if (pending > 8){
+			k2 *= murmur3_c2;
+			k2 = rotl64(k2, 33);
+			k2 *= murmur3_c1;
+			h2 ^= k2;
+		}
+		k1 *= murmur3_c1;
+		k1 = rotl64(k1, 31);
+		k1 *= murmur3_c2;
+		h1 ^= k1;
+	}
+
+	h1 ^= this->length;
+	h2 ^= this->length;
+
+	h1 += h2;
+	h2 += h1;
+
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+
+	h1 += h2;
+	h2 += h1;
+
+	write_u64_le(digest, h1);
+	write_u64_le(digest + 8, h2);
+	this->murmur3_restart();
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+// Identifies the hash used for the strong half of a block signature. The
+// values are stored alongside saved tables, so existing values must never be
+// renumbered.
+enum class StrongHashAlgorithm : u32{
+	Sha1 = 0,
+	// MurmurHash3_x64_128 with seed 0. Not cryptographic, which is fine for
+	// telling apart blocks whose rolling checksums already collide.
+	Murmur3_128 = 1,
+};
+
+const StrongHashAlgorithm default_strong_hash_algorithm = StrongHashAlgorithm::Murmur3_128;
+
+inline bool is_known_strong_hash_algorithm(u32 x){
+	return x <= (u32)StrongHashAlgorithm::Murmur3_128;
+}
+
+// Size of rsync_table_item::complex_hash. Shorter digests are zero-padded.
+const size_t strong_hash_size = 20;
+
+class StrongHash{
+	StrongHashAlgorithm algorithm;
+	CryptoPP::SHA1 sha1;
+	u64 h1, h2;
+	u64 length;
+	byte_t tail[16];
+
+	void murmur3_restart();
+	void murmur3_update(const byte_t *, size_t);
+	void murmur3_final(byte_t *);
+public:
+	StrongHash(StrongHashAlgorithm algorithm = default_strong_hash_algorithm);
+	StrongHashAlgorithm get_algorithm() const{
+		return this->algorithm;
+	}
+	void restart();
+	void update(const byte_t *buffer, size_t size);
+	// Writes strong_hash_size bytes and restarts the hash.
+	void final(byte_t *digest);
+	void calculate_digest(byte_t *digest, const byte_t *buffer, size_t size){
+		this->update(buffer, size);
+		this->final(digest);
+	}
+};
@@ -1,36 +1,257 @@
 #include "stdafx.h"
 #include "Threads.h"
-#include "MiscFunctions.h"
+#include <mutex>
+#include <condition_variable>
+#if !defined(_WIN32) && defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
-AutoResetEvent::AutoResetEvent(){
-	this->event = CreateEvent(nullptr, false, false, nullptr);
+namespace{
+
+// What park() and unpark_*() need from the system: sleep while an int holds
+// a given value, and wake whoever sleeps on it.
+class AddressWaiter{
+public:
+	virtual ~AddressWaiter(){}
+	virtual void wait(std::atomic<int> &address, int expected) const = 0;
+	virtual void wake_one(std::atomic<int> &address) const = 0;
+	virtual void wake_all(std::atomic<int> &address) const = 0;
+};
+
+// Portable parking: waiters sleep on a condition variable picked by address.
+// Several addresses share a bucket, so waking has to wake the whole bucket.
+struct ParkingBucket{
+	std::mutex mutex;
+	std::condition_variable condition;
+};
+
+ParkingBucket parking_lot[64];
+
+ParkingBucket &get_bucket(const void *address){
+	return parking_lot[((uintptr_t)address / sizeof(int)) % (sizeof(parking_lot) / sizeof(*parking_lot))];
 }
 
-AutoResetEvent::~AutoResetEvent(){
-	CloseHandle(this->event);
+void portable_park(std::atomic<int> &address, int expected){
+	auto &bucket = get_bucket(&address);
+	std::unique_lock<std::mutex> lock(bucket.mutex);
+	if (address.load() == expected)
+		bucket.condition.wait(lock);
 }
 
-void AutoResetEvent::set(){
-	SetEvent(this->event);
+void portable_unpark(std::atomic<int> &address){
+	auto &bucket = get_bucket(&address);
+	// Whoever is between checking the address and waiting holds the lock,
+	// so taking it here means they are waiting by the time we notify.
+	{
+		std::lock_guard<std::mutex> lock(bucket.mutex);
+	}
+	bucket.condition.notify_all();
 }
 
-void AutoResetEvent::wait(){
-	WaitForSingleObject(this->event, INFINITE);
+class PortableWaiter : public AddressWaiter{
+public:
+	void wait(std::atomic<int> &address, int expected) const override{
+		portable_park(address, expected);
+	}
+	void wake_one(std::atomic<int> &address) const override{
+		portable_unpark(address);
+	}
+	void wake_all(std::atomic<int> &address) const override{
+		portable_unpark(address);
+	}
+};
+
+#if defined(_WIN32)
+// WaitOnAddress() only exists on Windows 8 and later; older versions use
+// PortableWaiter.
+class WaitOnAddressWaiter : public AddressWaiter{
+	typedef BOOL (WINAPI *wait_t)(volatile VOID *, PVOID, SIZE_T, DWORD);
+	typedef VOID (WINAPI *wake_t)(PVOID);
+	wait_t wait_function;
+	wake_t wake_one_function;
+	wake_t wake_all_function;
+public:
+	WaitOnAddressWaiter(): wait_function(nullptr), wake_one_function(nullptr), wake_all_function(nullptr){
+		auto module = GetModuleHandleW(L"kernelbase.dll");
+		if (!module)
+			return;
+		auto wait = (wait_t)GetProcAddress(module, "WaitOnAddress");
+		auto wake_one = (wake_t)GetProcAddress(module, "WakeByAddressSingle");
+		auto wake_all = (wake_t)GetProcAddress(module, "WakeByAddressAll");
+		if (!wait || !wake_one || !wake_all)
+			return;
+		this->wait_function = wait;
+		this->wake_one_function = wake_one;
+		this->wake_all_function = wake_all;
+	}
+	bool available() const{
+		return !!this->wait_function;
+	}
+	void wait(std::atomic<int> &address, int expected) const override{
+		this->wait_function(&address, &expected, sizeof(expected), INFINITE);
+	}
+	void wake_one(std::atomic<int> &address) const override{
+		this->wake_one_function(&address);
+	}
+	void wake_all(std::atomic<int> &address) const override{
+		this->wake_all_function(&address);
+	}
+};
+#elif defined(__linux__)
+class FutexWaiter : public AddressWaiter{
+public:
+	void wait(std::atomic<int> &address, int expected) const override{
+		syscall(SYS_futex, &address, FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+	}
+	void wake_one(std::atomic<int> &address) const override{
+		syscall(SYS_futex, &address, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+	}
+	void wake_all(std::atomic<int> &address) const override{
+		syscall(SYS_futex, &address, FUTEX_WAKE_PRIVATE, std::numeric_limits<int>::max(), nullptr, nullptr, 0);
+	}
+};
+#endif
+
+// Picked once, on first use, so that it is ready for any static object that
+// locks a Mutex while being constructed.
+const AddressWaiter &get_address_waiter(){
+#if defined(_WIN32)
+	static const WaitOnAddressWaiter wait_on_address;
+	static const PortableWaiter portable;
+	static const AddressWaiter &ret = wait_on_address.available() ? (const AddressWaiter &)wait_on_address : portable;
+#elif defined(__linux__)
+	static const FutexWaiter ret;
+#else
+	static const PortableWaiter ret;
+#endif
+	return ret;
+}
+
+const unsigned spin_count = get_processor_count() > 1 ? 100 : 0;
+
+}
+
+static_assert(sizeof(std::atomic<int>) == sizeof(int), "std::atomic<int> must be usable as a plain int by the kernel.");
+
+void park(std::atomic<int> &address, int expected){
+	get_address_waiter().wait(address, expected);
+}
+
+void unpark_one(std::atomic<int> &address){
+	get_address_waiter().wake_one(address);
 }
 
-Mutex::Mutex(){
-	zero_struct(this->mutex);
-	InitializeCriticalSection(&this->mutex);
+void unpark_all(std::atomic<int> &address){
+	get_address_waiter().wake_all(address);
 }
 
-Mutex::~Mutex(){
-	DeleteCriticalSection(&this->mutex);
+unsigned get_spin_count(){
+	return spin_count;
+}
+
+// The waiter announces itself before its last look at the state, and set()
+// looks for waiters after changing it, so one of the two always sees the
+// other.
+void AutoResetEvent::set(){
+	this->state.store(1);
+	if (this->waiters.load())
+		unpark_one(this->state);
+}
+
+void AutoResetEvent::wait(){
+	if (spin_until([this](){ return this->try_reset(); }))
+		return;
+	this->waiters.fetch_add(1);
+	while (!this->state.exchange(0))
+		park(this->state, 0);
+	this->waiters.fetch_sub(1);
 }
 
 void Mutex::lock(){
-	EnterCriticalSection(&this->mutex);
+	int expected = 0;
+	if (this->state.compare_exchange_strong(expected, 1, std::memory_order_acquire))
+		return;
+	if (spin_until([this](){
+		int unlocked = 0;
+		return this->state.load(std::memory_order_relaxed) == 0 && this->state.compare_exchange_strong(unlocked, 1, std::memory_order_acquire);
+	}))
+		return;
+	// Whoever gets the lock this way cannot know whether anybody else is
+	// parked, so it leaves the state at 2 and unlock() wakes somebody.
+	while (this->state.exchange(2, std::memory_order_acquire))
+		park(this->state, 2);
 }
 
 void Mutex::unlock(){
-	LeaveCriticalSection(&this->mutex);
+	if (this->state.exchange(0, std::memory_order_release) == 2)
+		unpark_one(this->state);
+}
+
+unsigned get_processor_count(){
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return std::max<unsigned>(si.dwNumberOfProcessors, 1);
+#else
+	return std::max<unsigned>(std::thread::hardware_concurrency(), 1);
+#endif
+}
+
+namespace{
+
+struct ParallelForState{
+	const std::function<void(size_t)> *f;
+	size_t task_count;
+	size_t next_task;
+	Mutex mutex;
+	std::exception_ptr exception;
+
+	bool next(size_t &dst){
+		AutoMutex am(this->mutex);
+		if (this->exception || this->next_task >= this->task_count)
+			return false;
+		dst = this->next_task++;
+		return true;
+	}
+	void run(){
+		size_t task;
+		while (this->next(task)){
+			try{
+				(*this->f)(task);
+			}catch (...){
+				AutoMutex am(this->mutex);
+				if (!this->exception)
+					this->exception = std::current_exception();
+			}
+		}
+	}
+};
+
+}
+
+void parallel_for(size_t task_count, const std::function<void(size_t)> &f, unsigned thread_count){
+	ParallelForState state;
+	state.f = &f;
+	state.task_count = task_count;
+	state.next_task = 0;
+	if (!thread_count)
+		thread_count = get_processor_count();
+	thread_count = (unsigned)std::min<size_t>(thread_count, task_count);
+
+	{
+		std::vector<std::unique_ptr<Thread> > threads;
+		for (unsigned i = 1; i < thread_count; i++){
+			try{
+				threads.push_back(std::unique_ptr<Thread>(new Thread([&state](){ state.run(); })));
+			}catch (std::system_error &){
+				// Running with fewer threads is still correct.
+				break;
+			}
+		}
+		state.run();
+	}
+	if (state.exception)
+		std::rethrow_exception(state.exception);
 }
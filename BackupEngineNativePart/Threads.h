@@ -1,25 +1,96 @@
 #pragma once
+#include <atomic>
+#include <thread>
+#include <functional>
+
+/*
+Synchronization that stays in user mode when it can: a waiter polls for a
+short while, and only then parks in the kernel (futex on Linux,
+WaitOnAddress() on Windows 8 and later, a condition variable elsewhere).
+Waking only enters the kernel when somebody is actually parked.
+*/
+
+// Blocks while address holds expected. May return spuriously, so callers
+// always check their condition again.
+void park(std::atomic<int> &address, int expected);
+void unpark_one(std::atomic<int> &address);
+void unpark_all(std::atomic<int> &address);
+
+// How many times a waiter polls before parking; 0 with a single processor,
+// where polling only delays whoever it is waiting for.
+unsigned get_spin_count();
+
+inline void cpu_relax(){
+#ifdef _WIN32
+	YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+// Polls condition() up to get_spin_count() times. Returns whether it became
+// true.
+template <typename F>
+bool spin_until(const F &condition){
+	for (unsigned i = get_spin_count(); i--;){
+		if (condition())
+			return true;
+		cpu_relax();
+	}
+	return condition();
+}
 
 class AutoResetEvent{
-	HANDLE event;
+	std::atomic<int> state;
+	std::atomic<int> waiters;
 	AutoResetEvent(const AutoResetEvent &){}
+
+	bool try_reset(){
+		return this->state.load(std::memory_order_relaxed) && this->state.exchange(0);
+	}
 public:
-	AutoResetEvent();
-	~AutoResetEvent();
+	AutoResetEvent(): state(0), waiters(0){}
 	void set();
 	void wait();
 };
 
+// Not recursive.
 class Mutex{
-	CRITICAL_SECTION mutex;
+	// 0: unlocked, 1: locked, 2: locked and somebody may be parked.
+	std::atomic<int> state;
 	Mutex(const Mutex &){}
 public:
-	Mutex();
-	~Mutex();
+	Mutex(): state(0){}
 	void lock();
 	void unlock();
 };
 
+// Runs a function on a new thread, which is joined on destruction.
+class Thread{
+	std::thread thread;
+	Thread(const Thread &){}
+	void operator=(const Thread &){}
+public:
+	explicit Thread(const std::function<void()> &f): thread(f){}
+	~Thread(){
+		this->join();
+	}
+	void join(){
+		if (this->thread.joinable())
+			this->thread.join();
+	}
+};
+
+unsigned get_processor_count();
+
+// Calls f(i) for every i in [0; task_count), handing the tasks out in order to
+// up to thread_count threads, one per processor by default. The calling
+// thread runs tasks too. If a call throws, no further tasks are started, and
+// the first exception is rethrown once every thread has stopped.
+void parallel_for(size_t task_count, const std::function<void(size_t)> &f, unsigned thread_count = 0);
+
 class AutoMutex{
 	Mutex *mutex;
 	AutoMutex(const AutoMutex &){}
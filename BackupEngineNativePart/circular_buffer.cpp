@@ -1,20 +1,77 @@
 #include "stdafx.h"
 #include "circular_buffer.h"
 
-circular_buffer::circular_buffer(size_t initial_size): buffer(nullptr), m_capacity(0){
+// Maps size bytes of pagefile-backed memory twice, back to back. size must be
+// a multiple of the allocation granularity. Returns null on failure.
+static byte_t *map_mirrored(size_t size, HANDLE &section){
+	section = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)((u64)size >> 32), (DWORD)(size & mask_32bits), nullptr);
+	if (!section)
+		return nullptr;
+	// Find a free range twice the size, then release it and map both views
+	// into it. Another thread may take the range in between, so retry a few
+	// times.
+	for (int attempt = 0; attempt < 16; attempt++){
+		auto range = (byte_t *)VirtualAlloc(nullptr, size * 2, MEM_RESERVE, PAGE_NOACCESS);
+		if (!range)
+			break;
+		VirtualFree(range, 0, MEM_RELEASE);
+		auto first = (byte_t *)MapViewOfFileEx(section, FILE_MAP_ALL_ACCESS, 0, 0, size, range);
+		if (!first)
+			continue;
+		if (MapViewOfFileEx(section, FILE_MAP_ALL_ACCESS, 0, 0, size, range + size))
+			return first;
+		UnmapViewOfFile(first);
+	}
+	CloseHandle(section);
+	section = nullptr;
+	return nullptr;
+}
+
+static size_t mirrored_capacity(size_t n){
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	size_t ret = std::max<size_t>(si.dwAllocationGranularity, 1);
+	while (ret < n)
+		ret *= 2;
+	return ret;
+}
+
+circular_buffer::circular_buffer(size_t initial_size, bool mirrored): buffer(nullptr), m_capacity(0), section(nullptr), mirror(mirrored){
 	this->realloc(initial_size);
 }
 
 circular_buffer::~circular_buffer(){
-	delete[] this->buffer;
+	this->release();
 }
 
-void circular_buffer::realloc(size_t n){
-	if (this->m_capacity != n){
+void circular_buffer::release(){
+	if (this->section){
+		UnmapViewOfFile(this->buffer);
+		UnmapViewOfFile(this->buffer + this->m_capacity);
+		CloseHandle(this->section);
+		this->section = nullptr;
+	}else
 		delete[] this->buffer;
-		this->buffer = new byte_t[n];
+	this->buffer = nullptr;
+	this->m_capacity = 0;
+}
+
+void circular_buffer::realloc(size_t n){
+	auto capacity = this->mirror ? mirrored_capacity(n) : n;
+	if (this->m_capacity != capacity || !this->buffer){
+		this->release();
+		if (this->mirror){
+			this->buffer = map_mirrored(capacity, this->section);
+			// Don't try again on every realloc().
+			if (!this->buffer){
+				this->mirror = false;
+				capacity = n;
+			}
+		}
+		if (!this->buffer)
+			this->buffer = new byte_t[capacity];
 	}
-	this->m_capacity = n;
+	this->m_capacity = capacity;
 	this->reset();
 }
 
@@ -22,8 +79,7 @@ byte_t circular_buffer::pop(){
 	if (!this->m_size)
 		return 0;
 	auto ret = this->buffer[this->start];
-	this->start++;
-	this->start %= this->m_capacity;
+	this->start = this->wrap(this->start + 1);
 	this->m_size--;
 	return ret;
 }
@@ -31,10 +87,34 @@ byte_t circular_buffer::pop(){
 byte_t circular_buffer::push(byte_t ret){
 	if (this->m_size == this->m_capacity)
 		return 0;
-	this->buffer[(this->start + this->m_size++) % this->m_capacity] = ret;
+	this->buffer[this->wrap(this->start + this->m_size++)] = ret;
 	return ret;
 }
 
+void circular_buffer::discard(size_t n){
+	n = std::min(n, this->m_size);
+	if (!n)
+		return;
+	this->start = this->wrap(this->start + n);
+	this->m_size -= n;
+}
+
+// Drops the oldest size bytes and appends buf in their place. The buffer must
+// be full, so the bytes being dropped are exactly the ones being overwritten.
+void circular_buffer::slide(const byte_t *buf, size_t size){
+	size = std::min(size, this->m_capacity);
+	if (!size)
+		return;
+	if (this->section || this->start + size <= this->m_capacity)
+		memcpy(this->buffer + this->start, buf, size);
+	else{
+		auto first = this->m_capacity - this->start;
+		memcpy(this->buffer + this->start, buf, first);
+		memcpy(this->buffer, buf + first, size - first);
+	}
+	this->start = this->wrap(this->start + size);
+}
+
 void circular_buffer::reset(){
 	this->m_size = this->m_capacity;
 	this->start = 0;
@@ -1,14 +1,30 @@
 #pragma once
 
+/*
+If constructed as mirrored, the buffer is backed by a section mapped twice
+in a row, so that the byte after the last one is the first one again. Then
+any run of up to capacity() bytes starting inside the buffer is contiguous
+in memory, every operation is a single piece, and positions wrap with a
+mask. The capacity is rounded up to a power of two no smaller than the
+allocation granularity for that. If the mapping can't be made, the buffer
+falls back to ordinary memory of exactly the size asked for.
+*/
 class circular_buffer{
 	byte_t *buffer;
 	size_t m_capacity;
 	size_t m_size;
 	size_t start;
+	// Non-null while the buffer is mirrored.
+	HANDLE section;
+	bool mirror;
 	circular_buffer(const circular_buffer &){}
 	void operator=(const circular_buffer &){}
+	void release();
+	size_t wrap(size_t position) const{
+		return this->section ? position & (this->m_capacity - 1) : position % this->m_capacity;
+	}
 public:
-	circular_buffer(size_t initial_size);
+	circular_buffer(size_t initial_size, bool mirrored = false);
 	~circular_buffer();
 	byte_t pop();
 	byte_t push(byte_t ret);
@@ -24,7 +40,7 @@ public:
 	}
 	template <typename T>
 	void process_whole(T &f){
-		if (this->start + this->m_size <= this->m_capacity)
+		if (this->single_piece())
 			f(this->buffer + this->start, this->m_size);
 		else{
 			f(this->buffer + this->start, this->m_capacity - this->start);
@@ -36,14 +52,17 @@ public:
 	}
 	void reset();
 	void realloc(size_t n);
+	bool mirrored() const{
+		return !!this->section;
+	}
 	void push_buffer(byte *buf, size_t size){
 		size = std::min(size, this->m_capacity - this->m_size);
-		auto start = (this->start + this->m_size) % this->m_capacity;
-		if (start + size <= this->m_capacity)
+		auto start = this->wrap(this->start + this->m_size);
+		if (this->section || start + size <= this->m_capacity)
 			memcpy(this->buffer + start, buf, size);
 		else{
 			memcpy(this->buffer + start, buf, this->m_capacity - start);
-			memcpy(this->buffer, buf, (start + size) % this->m_capacity);
+			memcpy(this->buffer, buf + (this->m_capacity - start), (start + size) % this->m_capacity);
 		}
 		this->m_size += size;
 	}
@@ -51,7 +70,7 @@ public:
 		auto initial_size = dst.m_size;
 		this->process_whole([&](byte *buf, size_t size){ dst.push_buffer(buf, size); });
 		auto n = dst.m_size - initial_size;
-		this->start += n;
+		this->start = this->wrap(this->start + n);
 		this->m_size -= n;
 	}
 	void trim(size_t n){
@@ -66,9 +85,16 @@ public:
 		return (*(circular_buffer *)this)[i];
 	}
 	byte_t &operator[](size_t i){
-		return this->buffer[(i % this->m_size + this->start) % this->m_capacity];
+		auto position = i % this->m_size + this->start;
+		return this->buffer[this->section ? position : position % this->m_capacity];
 	}
 	bool single_piece() const{
-		return this->start + this->m_size <= this->m_capacity;
+		return this->section || this->start + this->m_size <= this->m_capacity;
+	}
+	// Size of the contiguous run that begins at data().
+	size_t first_piece_size() const{
+		return this->section ? this->m_size : std::min(this->m_size, this->m_capacity - this->start);
 	}
+	void discard(size_t n);
+	void slide(const byte_t *buf, size_t size);
 };
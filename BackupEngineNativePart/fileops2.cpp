@@ -346,3 +346,32 @@ EXPORT_THIS int create_hardlink(const wchar_t *_link_location, const wchar_t *_e
 		return 0;
 	return GetLastError();
 }
+
+// Enables SE_MANAGE_VOLUME_NAME for the process. Only administrators hold it,
+// and they still have to enable it.
+EXPORT_THIS bool obtain_special_file_privileges(){
+	HANDLE token;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &token))
+		return false;
+	AutoHandle h = token;
+	TOKEN_PRIVILEGES tp;
+	tp.PrivilegeCount = 1;
+	tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	if (!LookupPrivilegeValueW(nullptr, SE_MANAGE_VOLUME_NAME, &tp.Privileges[0].Luid))
+		return false;
+	if (!AdjustTokenPrivileges(token, false, &tp, sizeof(tp), nullptr, nullptr))
+		return false;
+	// AdjustTokenPrivileges() succeeds even when the token lacks the privilege.
+	return GetLastError() != ERROR_NOT_ALL_ASSIGNED;
+}
+
+// Sets the end of the file to new_size, so that the space is allocated in one
+// piece. The valid data length is left alone: SetFileValidData() would skip
+// zeroing by exposing whatever was on the disk before, which may belong to
+// another file. Writing sequentially from the valid data length costs no
+// zeroing anyway. The file pointer is left at new_size.
+EXPORT_THIS bool fast_file_expansion(HANDLE handle, std::uint64_t new_size){
+	LARGE_INTEGER li;
+	li.QuadPart = new_size;
+	return SetFilePointerEx(handle, li, nullptr, FILE_BEGIN) && SetEndOfFile(handle);
+}
@@ -4,6 +4,8 @@
 #include "lzma.h"
 #include "ExportedFunctions.h"
 #include "MiscFunctions.h"
+#include "MiscTypes.h"
+#include <cmath>
 
 bool LzmaOutputStream::pass_data_to_stream(lzma_ret ret){
 	if (!this->lstream.avail_out || ret == LZMA_STREAM_END) {
@@ -38,14 +40,236 @@ bool LzmaOutputStream::pass_data_to_stream(lzma_ret ret){
 	return true;
 }
 
+namespace{
+
+// What liblzma expects an encoder with these settings to use. A single
+// thread goes through the plain stream encoder, which doesn't buffer blocks.
+u64 encoder_memory_usage(const lzma_mt &mt){
+	if (mt.threads == 1)
+		return lzma_raw_encoder_memusage(mt.filters);
+	return lzma_stream_encoder_mt_memusage(&mt);
+}
+
+void check_encoder(lzma_ret ret){
+	switch (ret){
+	case LZMA_OK:
+		return;
+	case LZMA_MEM_ERROR:
+		throw LzmaOperationException("Memory allocation failed.");
+	case LZMA_DATA_ERROR:
+		throw LzmaOperationException("File size limits exceeded.");
+	default:
+		throw LzmaOperationException("Unknown error.");
+	}
+}
+
+// Smaller files keep whatever the stream is doing, since ending the stream
+// for them would cost more than it gains.
+const u64 min_sampled_file_size = 128 << 10;
+// Enough for every header choose_filter_chain() looks at, and for
+// is_incompressible() to tell.
+const size_t sample_size = 64 << 10;
+// Files change in the middle, such as disk images with compressed or
+// encrypted partitions.
+const u64 sample_interval = 16 << 20;
+const size_t stored_block_size = 1 << 20;
+// Below this many bits per byte, data is taken to be compressible without
+// trying.
+const double max_compressible_entropy = 7.5;
+const double min_compression_gain = 0.02;
+
+u32 read_u16(const uint8_t *p, bool big_endian = false){
+	return big_endian ? (u32)p[0] << 8 | p[1] : (u32)p[1] << 8 | p[0];
+}
+
+u32 read_u32(const uint8_t *p){
+	return (u32)p[3] << 24 | (u32)p[2] << 16 | (u32)p[1] << 8 | p[0];
+}
+
+}
+
+const char *FilterChain::name() const{
+	switch (this->filter){
+	case LZMA_FILTER_X86:
+		return "x86";
+	case LZMA_FILTER_ARM:
+		return "ARM";
+	case LZMA_FILTER_ARMTHUMB:
+		return "ARM-Thumb";
+	case LZMA_FILTER_DELTA:
+		return "delta";
+	default:
+		return "none";
+	}
+}
+
+FilterChain choose_filter_chain(const void *buffer, size_t size){
+	auto p = (const uint8_t *)buffer;
+	// PE: the DOS stub points to the NT headers, which start with the
+	// machine type.
+	if (size >= 0x40 && !memcmp(p, "MZ", 2)){
+		u64 offset = read_u32(p + 0x3C);
+		if (offset + 6 <= size && !memcmp(p + offset, "PE\0\0", 4)){
+			switch (read_u16(p + offset + 4)){
+			case 0x014C: // i386
+			case 0x8664: // AMD64
+				return FilterChain(LZMA_FILTER_X86);
+			case 0x01C0: // ARM
+				return FilterChain(LZMA_FILTER_ARM);
+			case 0x01C2: // Thumb
+			case 0x01C4: // ARMv7 Thumb-2
+				return FilterChain(LZMA_FILTER_ARMTHUMB);
+			}
+		}
+		return FilterChain();
+	}
+	if (size >= 20 && !memcmp(p, "\x7F" "ELF", 4)){
+		switch (read_u16(p + 18, p[5] == 2)){
+		case 3: // i386
+		case 62: // x86-64
+			return FilterChain(LZMA_FILTER_X86);
+		case 40: // ARM
+			return FilterChain(LZMA_FILTER_ARM);
+		}
+		return FilterChain();
+	}
+	// WAV: uncompressed PCM, where each sample is most like the one a frame
+	// earlier. The format chunk comes first in practice.
+	if (size >= 36 && !memcmp(p, "RIFF", 4) && !memcmp(p + 8, "WAVEfmt ", 8)){
+		auto format = read_u16(p + 20);
+		auto block_align = read_u16(p + 32);
+		if ((format == 1 || format == 0xFFFE) && block_align > 1 && block_align <= LZMA_DELTA_DIST_MAX)
+			return FilterChain(LZMA_FILTER_DELTA, block_align);
+		return FilterChain();
+	}
+	// BMP: uncompressed 24- and 32-bit pixels. Palettized rows are better
+	// left to LZMA2. The fields read are in the BITMAPFILEHEADER (14 bytes)
+	// and the BITMAPINFOHEADER (40 bytes) that follows it.
+	if (size >= 14 + 40 && !memcmp(p, "BM", 2) && read_u32(p + 14) >= 40){
+		auto bits = read_u16(p + 28);
+		auto compression = read_u32(p + 30);
+		if ((compression == 0 || compression == 3) && (bits == 24 || bits == 32))
+			return FilterChain(LZMA_FILTER_DELTA, bits / 8);
+		return FilterChain();
+	}
+	return FilterChain();
+}
+
+bool is_incompressible(const void *buffer, size_t size){
+	// Too little to tell.
+	if (size < 4096)
+		return false;
+	auto p = (const uint8_t *)buffer;
+	size_t histogram[256] = {};
+	for (size_t i = 0; i < size; i++)
+		histogram[p[i]]++;
+	double entropy = 0;
+	for (auto n : histogram){
+		if (!n)
+			continue;
+		double probability = (double)n / size;
+		entropy -= probability * log(probability);
+	}
+	entropy /= log(2.0);
+	if (entropy < max_compressible_entropy)
+		return false;
+
+	lzma_options_lzma options;
+	if (lzma_lzma_preset(&options, 0))
+		return false;
+	lzma_filter filters[] = {
+		{ LZMA_FILTER_LZMA2, &options },
+		{ LZMA_VLI_UNKNOWN, nullptr },
+	};
+	auto limit = (size_t)(size * (1 - min_compression_gain));
+	std::unique_ptr<uint8_t[]> output(new uint8_t[limit]);
+	size_t position = 0;
+	// Doesn't fit within the limit.
+	return lzma_raw_buffer_encode(filters, nullptr, p, size, output.get(), &position, limit) == LZMA_BUF_ERROR;
+}
+
+LzmaOutputStream::LzmaOutputStream(std::shared_ptr<OutStream> wrapped_stream, LzmaEncoderOptions &options, size_t buffer_size){
+	this->stream = wrapped_stream;
+	this->initialize(options, buffer_size);
+}
+
 LzmaOutputStream::LzmaOutputStream(std::shared_ptr<OutStream> wrapped_stream, bool &multithreaded, int compression_level, size_t buffer_size, bool extreme_mode){
 	this->stream = wrapped_stream;
+	LzmaEncoderOptions options;
+	options.preset = compression_level;
+	options.extreme = extreme_mode;
+	options.threads = multithreaded ? 0 : 1;
+	this->initialize(options, buffer_size);
+	multithreaded = options.threads > 1;
+}
+
+void LzmaOutputStream::initialize(LzmaEncoderOptions &options, size_t buffer_size){
 	this->lstream = LZMA_STREAM_INIT;
 
-	auto f = !multithreaded ? &LzmaOutputStream::initialize_single_threaded : &LzmaOutputStream::initialize_multithreaded;
-	multithreaded = (this->*f)(compression_level, buffer_size, extreme_mode);
-	
-	this->action = LZMA_RUN;
+	uint32_t preset = options.preset;
+	if (options.extreme)
+		preset |= LZMA_PRESET_EXTREME;
+	auto &lzma_options = this->lzma_options;
+	if (lzma_lzma_preset(&lzma_options, preset))
+		throw LzmaInitializationException("Specified compression level is not supported.");
+	if (options.dictionary_size)
+		lzma_options.dict_size = (uint32_t)std::min<u64>(std::max<u64>(options.dictionary_size, LZMA_DICT_SIZE_MIN), std::numeric_limits<uint32_t>::max());
+	// BCJ and delta need next to nothing on top of this.
+	lzma_filter filters[] = {
+		{ LZMA_FILTER_LZMA2, &lzma_options },
+		{ LZMA_VLI_UNKNOWN, nullptr },
+	};
+
+	lzma_mt mt;
+	zero_struct(mt);
+	mt.flags = 0;
+	mt.block_size = options.block_size;
+	mt.timeout = 0;
+	mt.filters = filters;
+	mt.check = LZMA_CHECK_NONE;
+	mt.threads = options.threads ? options.threads : lzma_cputhreads();
+	mt.threads = std::max(mt.threads, 1U);
+
+	auto usage = encoder_memory_usage(mt);
+	if (usage == UINT64_MAX)
+		throw LzmaInitializationException("Specified filter chain or compression level is not supported.");
+	if (options.memory_limit){
+		// Fewer threads compress just as well, only slower, so they go
+		// first. Every thread also buffers a few blocks, which are sized
+		// after the dictionary unless given, so shrinking it helps too.
+		while (usage > options.memory_limit && mt.threads > 1){
+			mt.threads--;
+			usage = encoder_memory_usage(mt);
+		}
+		if (!options.dictionary_size){
+			while (usage > options.memory_limit && lzma_options.dict_size > LZMA_DICT_SIZE_MIN){
+				lzma_options.dict_size = std::max(lzma_options.dict_size / 2, LZMA_DICT_SIZE_MIN);
+				usage = encoder_memory_usage(mt);
+			}
+		}
+		if (usage > options.memory_limit)
+			throw LzmaInitializationException("The memory limit is too low for the requested compression settings.");
+	}
+
+	this->threads = mt.threads;
+	this->block_size = mt.block_size;
+	this->storing = false;
+	this->stored_index = nullptr;
+	this->sampling = false;
+	this->sampling_file_start = false;
+	this->file_position = 0;
+	this->next_sample = std::numeric_limits<u64>::max();
+	this->start_encoder();
+
+	options.threads = mt.threads;
+	options.dictionary_size = lzma_options.dict_size;
+	// liblzma's default, when left to it.
+	if (mt.threads == 1)
+		options.block_size = 0;
+	else if (!options.block_size)
+		options.block_size = std::max<u64>(3 * (u64)lzma_options.dict_size, 1 << 20);
+	options.memory_usage = usage;
+
 	this->output_buffer.resize(buffer_size);
 	this->lstream.next_out = &this->output_buffer[0];
 	this->lstream.avail_out = this->output_buffer.size();
@@ -53,53 +277,38 @@ LzmaOutputStream::LzmaOutputStream(std::shared_ptr<OutStream> wrapped_stream, bo
 	this->bytes_written = 0;
 }
 
-bool LzmaOutputStream::initialize_single_threaded(int compression_level, size_t buffer_size, bool extreme_mode){
-	uint32_t preset = compression_level;
-	if (extreme_mode)
-		preset |= LZMA_PRESET_EXTREME;
-	lzma_ret ret = lzma_easy_encoder(&this->lstream, preset, LZMA_CHECK_NONE);
-	if (ret != LZMA_OK){
-		const char *msg;
-		switch (ret) {
-			case LZMA_MEM_ERROR:
-				msg = "Memory allocation failed.";
-				break;
-			case LZMA_OPTIONS_ERROR:
-				msg = "Specified compression level is not supported.";
-				break;
-			case LZMA_UNSUPPORTED_CHECK:
-				msg = "Specified integrity check is not supported.";
-				break;
-			default:
-				msg = "Unknown error.";
-				break;
-		}
-		throw LzmaInitializationException(msg);
+void LzmaOutputStream::start_encoder(){
+	lzma_filter filters[3];
+	size_t n = 0;
+	if (this->filter_chain.filter == LZMA_FILTER_DELTA){
+		zero_struct(this->delta_options);
+		this->delta_options.type = LZMA_DELTA_TYPE_BYTE;
+		this->delta_options.dist = this->filter_chain.delta_distance;
+		filters[n].id = LZMA_FILTER_DELTA;
+		filters[n++].options = &this->delta_options;
+	}else if (this->filter_chain.filter != LZMA_VLI_UNKNOWN){
+		filters[n].id = this->filter_chain.filter;
+		filters[n++].options = nullptr;
 	}
-	return false;
-}
+	filters[n].id = LZMA_FILTER_LZMA2;
+	filters[n++].options = &this->lzma_options;
+	filters[n].id = LZMA_VLI_UNKNOWN;
+	filters[n].options = nullptr;
 
-bool LzmaOutputStream::initialize_multithreaded(int compression_level, size_t buffer_size, bool extreme_mode){
 	lzma_mt mt;
 	zero_struct(mt);
 	mt.flags = 0;
-	mt.block_size = 0;
+	mt.block_size = this->block_size;
 	mt.timeout = 0;
-	mt.preset = compression_level;
-	if (extreme_mode)
-		mt.preset |= LZMA_PRESET_EXTREME;
-	mt.filters = 0;
+	mt.filters = filters;
 	mt.check = LZMA_CHECK_NONE;
-	mt.threads = lzma_cputhreads();
-	if (!mt.threads){
-		this->initialize_single_threaded(compression_level, buffer_size, extreme_mode);
-		return false;
-	}
-	
-	mt.threads = std::max(mt.threads, 4U);
-
-	lzma_ret ret = lzma_stream_encoder_mt(&this->lstream, &mt);
+	mt.threads = this->threads;
 
+	lzma_ret ret;
+	if (mt.threads == 1)
+		ret = lzma_stream_encoder(&this->lstream, filters, mt.check);
+	else
+		ret = lzma_stream_encoder_mt(&this->lstream, &mt);
 	if (ret != LZMA_OK){
 		const char *msg;
 		switch (ret) {
@@ -118,21 +327,189 @@ bool LzmaOutputStream::initialize_multithreaded(int compression_level, size_t bu
 		}
 		throw LzmaInitializationException(msg);
 	}
-	return true;
+	this->action = LZMA_RUN;
+	this->encoder_bytes_read = 0;
+}
+
+// The filters go in the block headers, which the multithreaded encoder
+// can't change mid-stream, so a new chain takes a new .xz stream, and so does
+// storing. Readers decode concatenated streams as one.
+void LzmaOutputStream::set_mode(bool store, const FilterChain &chain){
+	if (store == this->storing && (store || chain == this->filter_chain)){
+		// The chain is kept for when storing stops.
+		this->filter_chain = chain;
+		return;
+	}
+	// A stored stream has its header written already.
+	if (this->encoder_bytes_read || this->storing)
+		this->finish_stream();
+	this->storing = store;
+	this->filter_chain = chain;
+	if (store)
+		this->start_storing();
+	else
+		this->start_encoder();
+}
+
+void LzmaOutputStream::finish_stream(){
+	if (this->storing){
+		if (this->stored_input.size())
+			this->write_stored_block();
+		auto index_size = (size_t)lzma_index_size(this->stored_index);
+		this->stored_output.resize(index_size + LZMA_STREAM_HEADER_SIZE);
+		size_t position = 0;
+		check_encoder(lzma_index_buffer_encode(this->stored_index, &this->stored_output[0], &position, index_size));
+		lzma_stream_flags flags;
+		zero_struct(flags);
+		flags.version = 0;
+		flags.check = LZMA_CHECK_NONE;
+		flags.backward_size = index_size;
+		check_encoder(lzma_stream_footer_encode(&flags, &this->stored_output[position]));
+		this->write_stored_output(&this->stored_output[0], this->stored_output.size());
+		this->action = LZMA_FINISH;
+		return;
+	}
+	this->action = LZMA_FINISH;
+	while (this->pass_data_to_stream(lzma_code(&this->lstream, this->action)));
+}
+
+void LzmaOutputStream::start_storing(){
+	if (this->stored_index)
+		lzma_index_end(this->stored_index, nullptr);
+	this->stored_index = lzma_index_init(nullptr);
+	if (!this->stored_index)
+		throw LzmaInitializationException("Memory allocation failed.");
+	this->stored_input.clear();
+	this->stored_input.reserve(stored_block_size);
+	this->action = LZMA_RUN;
+	this->encoder_bytes_read = 0;
+
+	lzma_stream_flags flags;
+	zero_struct(flags);
+	flags.version = 0;
+	flags.check = LZMA_CHECK_NONE;
+	uint8_t header[LZMA_STREAM_HEADER_SIZE];
+	check_encoder(lzma_stream_header_encode(&flags, header));
+	this->write_stored_output(header, sizeof(header));
+}
+
+void LzmaOutputStream::store(const void *buffer, size_t size){
+	auto p = (const uint8_t *)buffer;
+	this->bytes_read += size;
+	this->encoder_bytes_read += size;
+	while (size){
+		auto n = std::min(size, stored_block_size - this->stored_input.size());
+		this->stored_input.insert(this->stored_input.end(), p, p + n);
+		p += n;
+		size -= n;
+		if (this->stored_input.size() == stored_block_size)
+			this->write_stored_block();
+	}
+}
+
+// Blocks are stored whole, with their sizes in the header, so that readers
+// can hand them to their threads like the multithreaded encoder's.
+void LzmaOutputStream::write_stored_block(){
+	lzma_filter filters[] = {
+		{ LZMA_FILTER_LZMA2, &this->lzma_options },
+		{ LZMA_VLI_UNKNOWN, nullptr },
+	};
+	lzma_block block;
+	zero_struct(block);
+	block.version = 0;
+	block.check = LZMA_CHECK_NONE;
+	block.filters = filters;
+	this->stored_output.resize(lzma_block_buffer_bound(this->stored_input.size()));
+	size_t position = 0;
+	check_encoder(lzma_block_uncomp_encode(&block, &this->stored_input[0], this->stored_input.size(), &this->stored_output[0], &position, this->stored_output.size()));
+	check_encoder(lzma_index_append(this->stored_index, nullptr, lzma_block_unpadded_size(&block), block.uncompressed_size));
+	this->write_stored_output(&this->stored_output[0], position);
+	this->stored_input.clear();
+}
+
+void LzmaOutputStream::write_stored_output(const void *buffer, size_t size){
+	this->stream->write(buffer, size);
+	this->bytes_written += size;
+}
+
+void LzmaOutputStream::end_sample(){
+	this->sampling = false;
+	auto chain = this->filter_chain;
+	if (this->sampling_file_start){
+		chain = choose_filter_chain(this->sample.data(), this->sample.size());
+		this->sampling_file_start = false;
+	}
+	this->set_mode(is_incompressible(this->sample.data(), this->sample.size()), chain);
+	if (this->sample.size())
+		this->encode(&this->sample[0], this->sample.size());
+	this->sample.clear();
+}
+
+void LzmaOutputStream::begin_file(std::uint64_t size){
+	if (this->action != LZMA_RUN)
+		return;
+	if (this->sampling)
+		this->end_sample();
+	this->file_position = 0;
+	this->next_sample = std::numeric_limits<u64>::max();
+	if (size < min_sampled_file_size){
+		auto chain = this->filter_chain;
+		if (chain.filter == LZMA_FILTER_DELTA)
+			chain = FilterChain();
+		this->set_mode(false, chain);
+		return;
+	}
+	this->sampling = true;
+	this->sampling_file_start = true;
+	this->next_sample = sample_interval;
+	this->sample.reserve(sample_size);
 }
 
 LzmaOutputStream::~LzmaOutputStream(){
 	this->flush();
 	lzma_end(&this->lstream);
+	if (this->stored_index)
+		lzma_index_end(this->stored_index, nullptr);
 }
 
 void LzmaOutputStream::write(const void *buffer, size_t size){
+	auto p = (const uint8_t *)buffer;
+	while (size){
+		if (this->sampling){
+			auto n = std::min(size, sample_size - this->sample.size());
+			this->sample.insert(this->sample.end(), p, p + n);
+			p += n;
+			size -= n;
+			this->file_position += n;
+			if (this->sample.size() == sample_size)
+				this->end_sample();
+			continue;
+		}
+		if (this->file_position >= this->next_sample){
+			this->sampling = true;
+			this->next_sample = this->file_position + sample_interval;
+			continue;
+		}
+		auto n = (size_t)std::min<u64>(size, this->next_sample - this->file_position);
+		this->encode(p, n);
+		p += n;
+		size -= n;
+		this->file_position += n;
+	}
+}
+
+void LzmaOutputStream::encode(const void *buffer, size_t size){
+	if (this->storing){
+		this->store(buffer, size);
+		return;
+	}
 	lzma_ret ret;
 	do{
 		if (this->lstream.avail_in == 0){
 			if (!size)
 				break;
 			this->bytes_read += size;
+			this->encoder_bytes_read += size;
 			this->lstream.next_in = (const uint8_t *)buffer;
 			this->lstream.avail_in = size;
 			size = 0;
@@ -144,88 +521,358 @@ void LzmaOutputStream::write(const void *buffer, size_t size){
 void LzmaOutputStream::flush(){
 	if (this->action != LZMA_RUN)
 		return;
-	this->action = LZMA_FINISH;
-	while (this->pass_data_to_stream(lzma_code(&this->lstream, this->action)));
+	if (this->sampling)
+		this->end_sample();
+	this->finish_stream();
 	this->stream->flush();
 }
 
-LzmaInputStream::LzmaInputStream(std::shared_ptr<InStream> wrapped_stream, size_t buffer_size) : at_eof(false){
-	this->stream = wrapped_stream;
-	this->lstream = LZMA_STREAM_INIT;
-	lzma_ret ret = lzma_stream_decoder(&this->lstream, UINT64_MAX, LZMA_IGNORE_CHECK);
-	if (ret != LZMA_OK){
-		const char *msg;
-		switch (ret) {
-		case LZMA_MEM_ERROR:
-			msg = "Memory allocation failed.\n";
-			break;
-		case LZMA_OPTIONS_ERROR:
-			msg = "Unsupported decompressor flags.\n";
-			break;
-		default:
-			msg = "Unknown error.\n";
-			break;
+namespace{
+
+const u64 default_memory_limit_per_thread = 64 << 20;
+
+const char *decoder_error_message(lzma_ret ret){
+	switch (ret) {
+	case LZMA_MEM_ERROR:
+		return "Memory allocation failed.";
+	case LZMA_FORMAT_ERROR:
+		return "The input is not in the .xz format.";
+	case LZMA_OPTIONS_ERROR:
+		return "Unsupported compression options.";
+	case LZMA_DATA_ERROR:
+		return "Compressed file is corrupt.";
+	case LZMA_BUF_ERROR:
+		return "Compressed file is truncated or otherwise corrupt.";
+	default:
+		return "Unknown error.";
+	}
+}
+
+void check_decoder(lzma_ret ret){
+	if (ret != LZMA_OK)
+		throw LzmaOperationException(decoder_error_message(ret));
+}
+
+}
+
+struct LzmaInputStream::Block{
+	enum class State{
+		Queued,
+		Running,
+		Done,
+	};
+	lzma_block options;
+	lzma_filter filters[LZMA_FILTERS_MAX + 1];
+	// Set if the block is decoded by read(), otherwise the sizes below are
+	// known.
+	bool streamed;
+	// Everything after the header: compressed data, padding and check.
+	std::vector<uint8_t> input;
+	size_t input_size;
+	std::unique_ptr<uint8_t[]> output;
+	size_t output_size,
+		output_position;
+	// What the block counts against the memory limit.
+	u64 memory_usage;
+	State state;
+	lzma_ret result;
+
+	Block(): streamed(true), input_size(0), output_size(0), output_position(0), memory_usage(0), state(State::Queued), result(LZMA_OK){
+		zero_struct(this->options);
+		for (auto &filter : this->filters){
+			filter.id = LZMA_VLI_UNKNOWN;
+			filter.options = nullptr;
 		}
-		throw LzmaInitializationException(msg);
 	}
-	this->action = LZMA_RUN;
+	~Block(){
+		this->free_filters();
+	}
+	void free_filters(){
+		// Allocated by lzma_block_header_decode() with the default allocator.
+		for (auto &filter : this->filters){
+			free(filter.options);
+			filter.options = nullptr;
+		}
+	}
+	void decode(){
+		try{
+			this->output.reset(new uint8_t[this->output_size]);
+		}catch (std::bad_alloc &){
+			this->result = LZMA_MEM_ERROR;
+			return;
+		}
+		size_t in_position = 0,
+			out_position = 0;
+		this->result = lzma_block_buffer_decode(&this->options, nullptr, &this->input[0], &in_position, this->input.size(), this->output.get(), &out_position, this->output_size);
+		if (this->result == LZMA_OK && (in_position != this->input.size() || out_position != this->output_size))
+			this->result = LZMA_DATA_ERROR;
+		std::vector<uint8_t>().swap(this->input);
+		this->free_filters();
+	}
+};
+
+LzmaInputStream::LzmaInputStream(std::shared_ptr<InStream> wrapped_stream, size_t buffer_size, unsigned threads, std::uint64_t memory_limit):
+		stream(wrapped_stream),
+		input_begin(0),
+		input_end(0),
+		index_hash(nullptr),
+		header_read(false),
+		index_reached(false),
+		at_eof(false),
+		memory_in_use(0),
+		stopping(false){
 	this->input_buffer.resize(buffer_size);
-	this->bytes_read = 0;
-	this->bytes_written = 0;
-	this->queued_buffer = &this->input_buffer[0];
-	this->queued_bytes = 0;
+	zero_struct(this->stream_flags);
+	this->lstream = LZMA_STREAM_INIT;
+	if (!threads)
+		threads = get_processor_count();
+	if (!memory_limit)
+		memory_limit = threads * default_memory_limit_per_thread;
+	this->memory_limit = std::min<u64>(memory_limit, std::numeric_limits<size_t>::max());
+	// Enough to keep every thread busy while the oldest block is read.
+	this->max_blocks = 2 * threads;
+	this->index_hash = lzma_index_hash_init(nullptr, nullptr);
+	if (!this->index_hash)
+		throw LzmaInitializationException("Memory allocation failed.");
+	// The calling thread decodes too.
+	try{
+		for (unsigned i = 1; i < threads; i++)
+			this->threads.push_back(std::unique_ptr<Thread>(new Thread([this](){ this->worker_thread(); })));
+	}catch (std::system_error &){
+		// Running with fewer threads is still correct.
+	}
 }
 
 LzmaInputStream::~LzmaInputStream(){
+	this->stop();
 	lzma_end(&this->lstream);
+	lzma_index_hash_end(this->index_hash, nullptr);
 }
 
-size_t LzmaInputStream::read(void *buffer, size_t size){
-	if (this->eof())
-		return 0;
-	size_t ret = 0;
-	this->lstream.next_out = (uint8_t *)buffer;
+void LzmaInputStream::stop(){
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+	this->work_available.notify_all();
+	this->threads.clear();
+}
+
+void LzmaInputStream::worker_thread(){
+	std::unique_lock<std::mutex> lock(this->mutex);
+	while (true){
+		this->work_available.wait(lock, [this](){ return this->stopping || this->queue.size(); });
+		if (this->stopping)
+			return;
+		auto block = this->queue.front();
+		this->queue.pop_front();
+		block->state = Block::State::Running;
+		lock.unlock();
+		block->decode();
+		lock.lock();
+		block->state = Block::State::Done;
+		this->work_done.notify_all();
+	}
+}
+
+// Refills the input buffer once all of it has been consumed. Returns false at
+// the end of the input.
+bool LzmaInputStream::fill_input(){
+	if (this->input_begin < this->input_end)
+		return true;
+	this->input_begin = this->input_end = 0;
+	if (this->stream->eof())
+		return false;
+	this->input_end = this->stream->read(&this->input_buffer[0], this->input_buffer.size());
+	return this->input_end > 0;
+}
+
+void LzmaInputStream::read_input(void *_buffer, size_t size){
+	auto buffer = (uint8_t *)_buffer;
+	while (size){
+		if (!this->fill_input())
+			throw LzmaOperationException(decoder_error_message(LZMA_BUF_ERROR));
+		auto n = std::min(size, this->input_end - this->input_begin);
+		memcpy(buffer, &this->input_buffer[this->input_begin], n);
+		this->input_begin += n;
+		buffer += n;
+		size -= n;
+	}
+}
+
+void LzmaInputStream::read_stream_header(){
+	uint8_t header[LZMA_STREAM_HEADER_SIZE];
+	this->read_input(header, sizeof(header));
+	check_decoder(lzma_stream_header_decode(&this->stream_flags, header));
+	this->header_read = true;
+}
+
+// The input must be at a block header.
+std::unique_ptr<LzmaInputStream::Block> LzmaInputStream::read_block_header(){
+	std::unique_ptr<Block> ret(new Block);
+	auto &options = ret->options;
+	options.version = 1;
+	options.check = this->stream_flags.check;
+	options.filters = ret->filters;
+	options.header_size = lzma_block_header_size_decode(this->input_buffer[this->input_begin]);
+	uint8_t header[LZMA_BLOCK_HEADER_SIZE_MAX];
+	this->read_input(header, options.header_size);
+	check_decoder(lzma_block_header_decode(&options, nullptr, header));
+	// Checks were never verified, and the encoder doesn't write any.
+	options.ignore_check = true;
+
+	if (options.compressed_size == LZMA_VLI_UNKNOWN || options.uncompressed_size == LZMA_VLI_UNKNOWN)
+		return ret;
+	auto input_size = lzma_block_total_size(&options) - options.header_size;
+	auto output_size = options.uncompressed_size;
+	auto dictionary = lzma_raw_decoder_memusage(ret->filters);
+	auto limit = this->memory_limit;
+	// Each one is checked first, so that the sum can't overflow.
+	if (input_size > limit || output_size > limit || dictionary > limit || input_size + output_size + dictionary > limit)
+		return ret;
+	ret->streamed = false;
+	ret->input_size = (size_t)input_size;
+	ret->output_size = (size_t)output_size;
+	ret->memory_usage = input_size + output_size + dictionary;
+	return ret;
+}
+
+// Reads ahead as many block headers, and hands as many blocks to the workers,
+// as the limits allow.
+void LzmaInputStream::queue_blocks(){
+	if (!this->header_read)
+		this->read_stream_header();
+	while (!this->index_reached){
+		if (!this->next_block){
+			if (!this->fill_input())
+				throw LzmaOperationException(decoder_error_message(LZMA_BUF_ERROR));
+			// Where a block header has its size, the index has a 0.
+			if (!this->input_buffer[this->input_begin]){
+				this->index_reached = true;
+				break;
+			}
+			this->next_block = this->read_block_header();
+		}
+		auto &block = *this->next_block;
+		if (block.streamed)
+			break;
+		if (this->blocks.size() && (this->blocks.size() >= this->max_blocks || this->memory_in_use + block.memory_usage > this->memory_limit))
+			break;
+		block.input.resize(block.input_size);
+		this->read_input(&block.input[0], block.input.size());
+		check_decoder(lzma_index_hash_append(this->index_hash, lzma_block_unpadded_size(&block.options), block.options.uncompressed_size));
+		this->memory_in_use += block.memory_usage;
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->queue.push_back(&block);
+		}
+		this->work_available.notify_one();
+		this->blocks.push_back(std::move(this->next_block));
+	}
+}
+
+// Copies out what it can of the oldest block, once it is decoded.
+size_t LzmaInputStream::take_output(uint8_t *buffer, size_t size){
+	auto &block = *this->blocks.front();
+	{
+		std::unique_lock<std::mutex> lock(this->mutex);
+		if (block.state == Block::State::Queued){
+			// Nothing can be returned before this block anyway.
+			assert(this->queue.front() == &block);
+			this->queue.pop_front();
+			block.state = Block::State::Running;
+			lock.unlock();
+			block.decode();
+			lock.lock();
+			block.state = Block::State::Done;
+		}else
+			this->work_done.wait(lock, [&block](){ return block.state == Block::State::Done; });
+	}
+	check_decoder(block.result);
+	auto ret = std::min(size, block.output_size - block.output_position);
+	memcpy(buffer, block.output.get() + block.output_position, ret);
+	block.output_position += ret;
+	if (block.output_position == block.output_size){
+		this->memory_in_use -= block.memory_usage;
+		this->blocks.pop_front();
+	}
+	return ret;
+}
+
+void LzmaInputStream::start_streamed_block(){
+	this->streamed_block = std::move(this->next_block);
+	check_decoder(lzma_block_decoder(&this->lstream, &this->streamed_block->options));
+}
+
+size_t LzmaInputStream::decode_streamed_block(uint8_t *buffer, size_t size){
+	this->lstream.next_out = buffer;
 	this->lstream.avail_out = size;
 	while (this->lstream.avail_out){
-		if (this->lstream.avail_in == 0 && !this->stream->eof()){
-			this->lstream.next_in = &this->input_buffer[0];
-			this->lstream.avail_in = this->stream->read(&this->input_buffer[0], this->input_buffer.size());
-			this->bytes_read += this->lstream.avail_in;
-			if (this->stream->eof()){
-				this->action = LZMA_FINISH;
-			}
+		if (!this->fill_input())
+			throw LzmaOperationException(decoder_error_message(LZMA_BUF_ERROR));
+		this->lstream.next_in = &this->input_buffer[this->input_begin];
+		this->lstream.avail_in = this->input_end - this->input_begin;
+		auto ret = lzma_code(&this->lstream, LZMA_RUN);
+		this->input_begin = this->input_end - this->lstream.avail_in;
+		if (ret == LZMA_STREAM_END){
+			// The decoder has filled in the sizes.
+			auto &options = this->streamed_block->options;
+			check_decoder(lzma_index_hash_append(this->index_hash, lzma_block_unpadded_size(&options), options.uncompressed_size));
+			this->streamed_block.reset();
+			break;
 		}
-		lzma_ret ret_code = lzma_code(&this->lstream, action);
-		if (ret_code != LZMA_OK) {
-			if (ret_code == LZMA_STREAM_END)
-				break;
-			const char *msg;
-			switch (ret_code) {
-			case LZMA_MEM_ERROR:
-				msg = "Memory allocation failed.";
-				break;
-			case LZMA_FORMAT_ERROR:
-				msg = "The input is not in the .xz format.";
-				break;
-			case LZMA_OPTIONS_ERROR:
-				msg = "Unsupported compression options.";
-				break;
-			case LZMA_DATA_ERROR:
-				msg = "Compressed file is corrupt.";
-				break;
-			case LZMA_BUF_ERROR:
-				msg = "Compressed file is truncated or otherwise corrupt.";
-				break;
-			default:
-				msg = "Unknown error.";
-				break;
-			}
-			throw LzmaOperationException(msg);
+		check_decoder(ret);
+	}
+	return size - this->lstream.avail_out;
+}
+
+// Checks the index and the stream footer against the blocks read.
+void LzmaInputStream::read_index(){
+	lzma_ret ret;
+	do{
+		if (!this->fill_input())
+			throw LzmaOperationException(decoder_error_message(LZMA_BUF_ERROR));
+		ret = lzma_index_hash_decode(this->index_hash, &this->input_buffer[0], &this->input_begin, this->input_end);
+	}while (ret == LZMA_OK);
+	if (ret != LZMA_STREAM_END)
+		check_decoder(ret);
+	uint8_t footer[LZMA_STREAM_HEADER_SIZE];
+	this->read_input(footer, sizeof(footer));
+	lzma_stream_flags footer_flags;
+	check_decoder(lzma_stream_footer_decode(&footer_flags, footer));
+	if (lzma_stream_flags_compare(&this->stream_flags, &footer_flags) != LZMA_OK || footer_flags.backward_size != lzma_index_hash_size(this->index_hash))
+		check_decoder(LZMA_DATA_ERROR);
+}
+
+// Starts over at the stream after the one just read, if there is one.
+bool LzmaInputStream::next_stream(){
+	// Every stream starts with the same magic bytes.
+	if (!this->fill_input() || this->input_buffer[this->input_begin] != 0xFD)
+		return false;
+	this->header_read = false;
+	this->index_reached = false;
+	this->index_hash = lzma_index_hash_init(this->index_hash, nullptr);
+	return true;
+}
+
+size_t LzmaInputStream::read(void *_buffer, size_t size){
+	auto buffer = (uint8_t *)_buffer;
+	size_t ret = 0;
+	while (ret < size && !this->at_eof){
+		if (this->streamed_block){
+			ret += this->decode_streamed_block(buffer + ret, size - ret);
+			continue;
+		}
+		this->queue_blocks();
+		if (this->blocks.size())
+			ret += this->take_output(buffer + ret, size - ret);
+		else if (this->next_block)
+			this->start_streamed_block();
+		else{
+			this->read_index();
+			this->at_eof = !this->next_stream();
 		}
 	}
-	ret = size - this->lstream.avail_out;
-	this->bytes_written += ret;
-	this->at_eof = !ret && size;
 	return ret;
 }
 
@@ -238,6 +885,64 @@ EXPORT_THIS void *filter_input_stream_through_lzma(void *p){
 	return new std::shared_ptr<InStream>(new LzmaInputStream(*stream));
 }
 
+// Opens the frame at [frame_offset; frame_offset + frame_size) of the archive
+// at path, and skips the first skip bytes of what it decompresses to. For
+// archives whose only filter is compression, whose frames are each .xz data
+// on their own. Returns a Win32 error code, ERROR_INVALID_DATA if the frame
+// is corrupt or truncated.
+EXPORT_THIS int open_archive_frame(void **stream, const wchar_t *path, std::uint64_t frame_offset, std::uint64_t frame_size, std::uint64_t skip){
+	*stream = nullptr;
+	try{
+		auto file = std::make_shared<FileInputStream>(path);
+		file->seek(frame_offset);
+		std::shared_ptr<InStream> frame(new BoundedInputStream(file, frame_size));
+		std::shared_ptr<InStream> decompressed(new LzmaInputStream(frame));
+		std::vector<uint8_t> buffer((size_t)std::min<std::uint64_t>(skip, default_buffer_size));
+		while (skip){
+			auto n = decompressed->read(&buffer[0], (size_t)std::min<std::uint64_t>(skip, buffer.size()));
+			if (!n)
+				break;
+			skip -= n;
+		}
+		*stream = new std::shared_ptr<InStream>(decompressed);
+	}catch (Win32Error &e){
+		return e.error;
+	}catch (LzmaOperationException &){
+		return ERROR_INVALID_DATA;
+	}catch (LzmaInitializationException &){
+		return ERROR_INVALID_PARAMETER;
+	}catch (std::bad_alloc &){
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}catch (std::exception &){
+		return ERROR_INVALID_DATA;
+	}
+	return 0;
+}
+
+EXPORT_THIS int filter_output_stream_through_lzma_with_options(void **result, void *p, LzmaEncoderOptions *options){
+	*result = nullptr;
+	try{
+		auto stream = (std::shared_ptr<OutStream> *)p;
+		*result = new std::shared_ptr<OutStream>(new LzmaOutputStream(*stream, *options));
+	}catch (Win32Error &e){
+		return e.error;
+	}catch (LzmaInitializationException &){
+		return ERROR_INVALID_PARAMETER;
+	}catch (std::bad_alloc &){
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}catch (std::exception &){
+		return ERROR_INVALID_PARAMETER;
+	}
+	return 0;
+}
+
+EXPORT_THIS void lzma_output_stream_begin_file(void *p, std::uint64_t size){
+	auto stream = (std::shared_ptr<OutStream> *)p;
+	auto lzma = dynamic_cast<LzmaOutputStream *>(stream->get());
+	if (lzma)
+		lzma->begin_file(size);
+}
+
 EXPORT_THIS void *filter_output_stream_through_lzma(void *p){
 	auto stream = (std::shared_ptr<OutStream> *)p;
 	bool mt = true;
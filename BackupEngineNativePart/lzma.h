@@ -1,5 +1,7 @@
 #pragma once
 #include "streams.h"
+#include <mutex>
+#include <condition_variable>
 
 // This is appears to be what .NET uses by default for System.IO.Stream.CopyTo().
 const size_t default_buffer_size = 81920;
@@ -22,6 +24,70 @@ public:
 	}
 };
 
+// Settings for LzmaOutputStream, also passed in from managed code, hence the
+// fixed-size fields. Fields left at 0 are chosen by the stream, and on return
+// every field holds what was actually used. The exception is preset, where 0
+// is the fastest level rather than the default; a zero-filled struct from
+// managed code asks for preset 0.
+struct LzmaEncoderOptions{
+	// Input is split into blocks of this size, each compressed by one
+	// thread. 0 lets liblzma pick, which is three times the dictionary size.
+	// The single-threaded encoder writes one block, and reports 0.
+	std::uint64_t block_size;
+	// 0 uses the dictionary of the preset, unless memory_limit requires a
+	// smaller one.
+	std::uint64_t dictionary_size;
+	// What the encoder may use, in bytes; 0 for no limit. Threads are
+	// dropped first to fit it, then the dictionary is shrunk, unless it was
+	// given.
+	std::uint64_t memory_limit;
+	// Output only: what liblzma expects the encoder to use.
+	std::uint64_t memory_usage;
+	// 0-9; 7 unless set.
+	std::uint32_t preset;
+	// Non-zero to add LZMA_PRESET_EXTREME to the preset.
+	std::uint32_t extreme;
+	// 0 for one per processor. With 1, the single-threaded encoder is used.
+	std::uint32_t threads;
+
+	LzmaEncoderOptions():
+		block_size(0),
+		dictionary_size(0),
+		memory_limit(0),
+		memory_usage(0),
+		preset(7),
+		extreme(0),
+		threads(0){}
+};
+
+// The filter ahead of LZMA2 that suits some data.
+struct FilterChain{
+	// LZMA_FILTER_X86, LZMA_FILTER_ARM, LZMA_FILTER_ARMTHUMB,
+	// LZMA_FILTER_DELTA, or LZMA_VLI_UNKNOWN for none.
+	lzma_vli filter;
+	// For LZMA_FILTER_DELTA: the size of a sample or pixel.
+	std::uint32_t delta_distance;
+
+	FilterChain(lzma_vli filter = LZMA_VLI_UNKNOWN, std::uint32_t delta_distance = 0): filter(filter), delta_distance(delta_distance){}
+	bool operator==(const FilterChain &other) const{
+		return this->filter == other.filter && this->delta_distance == other.delta_distance;
+	}
+	bool operator!=(const FilterChain &other) const{
+		return !(*this == other);
+	}
+	const char *name() const;
+};
+
+// Looks at the start of a file: BCJ for x86 and ARM executables (PE and ELF),
+// delta for uncompressed PCM audio (WAV) and 24- and 32-bit bitmaps (BMP),
+// and nothing otherwise.
+FilterChain choose_filter_chain(const void *head, size_t size);
+
+// Whether a sample of some data shows that LZMA2 would save less than 2% of
+// it. The entropy of the bytes rules out most compressible data cheaply; the
+// rest is compressed at preset 0.
+bool is_incompressible(const void *sample, size_t size);
+
 class LzmaOutputStream : public OutStream{
 	std::shared_ptr<OutStream> stream;
 	lzma_stream lstream;
@@ -29,29 +95,132 @@ class LzmaOutputStream : public OutStream{
 	std::vector<uint8_t> output_buffer;
 	uint64_t bytes_read,
 		bytes_written;
+	// What initialize() settled on, to restart the encoder with.
+	lzma_options_lzma lzma_options;
+	lzma_options_delta delta_options;
+	std::uint64_t block_size;
+	std::uint32_t threads;
+	FilterChain filter_chain;
+	// Input since the encoder was last started.
+	uint64_t encoder_bytes_read;
+	// Data that doesn't compress goes in a .xz stream of its own, as LZMA2
+	// uncompressed chunks, instead of through the encoder.
+	bool storing;
+	lzma_index *stored_index;
+	std::vector<uint8_t> stored_input,
+		stored_output;
+	// Gathered from the start of the file begun last, and then from every
+	// sample_interval bytes of it, to choose how to compress what follows.
+	std::vector<uint8_t> sample;
+	bool sampling,
+		sampling_file_start;
+	std::uint64_t file_position,
+		next_sample;
 
-	bool initialize_single_threaded(int, size_t, bool);
-	bool initialize_multithreaded(int, size_t, bool);
+	void initialize(LzmaEncoderOptions &, size_t buffer_size);
+	void start_encoder();
+	void start_storing();
+	void set_mode(bool store, const FilterChain &);
+	void finish_stream();
+	void end_sample();
+	void encode(const void *buffer, size_t size);
+	void store(const void *buffer, size_t size);
+	void write_stored_block();
+	void write_stored_output(const void *buffer, size_t size);
 	bool pass_data_to_stream(lzma_ret ret);
 public:
+	LzmaOutputStream(std::shared_ptr<OutStream> wrapped_stream, LzmaEncoderOptions &options, size_t buffer_size = default_buffer_size);
+	// Uses one thread per processor if multithreaded is set, and sets it to
+	// whether more than one thread is used.
 	LzmaOutputStream(std::shared_ptr<OutStream> wrapped_stream, bool &multithreaded, int compression_level = 7, size_t buffer_size = default_buffer_size, bool extreme_mode = false);
 	~LzmaOutputStream();
 	void write(const void *buffer, size_t size) override;
 	void flush() override;
+	// Tells the stream that a file of size bytes starts with the next
+	// write(), so that it can pick filters for it; see
+	// choose_filter_chain(). Large files are also sampled as they come in,
+	// and stored while the samples are incompressible. Changing filters, or
+	// between compressing and storing, ends the .xz stream and starts
+	// another, so small files keep the filters they find, unless those are
+	// delta, which only suits what it was chosen for, or they are being
+	// stored. Without calls to this, everything is compressed with LZMA2
+	// alone.
+	void begin_file(std::uint64_t size);
+	const FilterChain &get_filter_chain() const{
+		return this->filter_chain;
+	}
+	bool is_storing() const{
+		return this->storing;
+	}
 };
 
+/*
+Decodes an .xz stream, several blocks at a time. The input can't seek, so
+the index at the end is no help; instead the block headers are read as the
+input comes in, and every block whose header gives its sizes, as the
+multithreaded encoder writes them, is read whole and handed to a worker
+thread. Output is returned in order, and the caller decodes the oldest
+block itself if no worker has started on it yet.
+
+Blocks being decoded or waiting to be read take at most memory_limit bytes
+between them: compressed input, output, and the decoder's dictionary. A
+block without sizes, such as the single block of the single-threaded
+encoder, or one too large for the limit alone, is decoded as a stream by
+read(), once every block before it has been returned. The index and footer
+are checked against the blocks read.
+
+Concatenated streams, which the encoder writes when it changes filters, are
+decoded as one. Whatever else follows a stream is left unread.
+*/
 class LzmaInputStream : public InStream{
+	struct Block;
+
 	std::shared_ptr<InStream> stream;
-	lzma_stream lstream;
-	lzma_action action;
+	// Compressed input read from stream, of which [input_begin; input_end)
+	// hasn't been consumed.
 	std::vector<uint8_t> input_buffer;
-	const uint8_t *queued_buffer;
-	size_t queued_bytes;
-	uint64_t bytes_read,
-		bytes_written;
-	bool at_eof;
+	size_t input_begin,
+		input_end;
+	lzma_stream_flags stream_flags;
+	lzma_index_hash *index_hash;
+	bool header_read,
+		index_reached,
+		at_eof;
+	std::uint64_t memory_limit,
+		memory_in_use;
+	unsigned max_blocks;
+
+	// Blocks handed to the workers, in stream order, and the block whose
+	// header was read last, if it isn't one of them yet.
+	std::deque<std::unique_ptr<Block> > blocks;
+	std::unique_ptr<Block> next_block;
+	// The block being decoded by read(), through lstream.
+	std::unique_ptr<Block> streamed_block;
+	lzma_stream lstream;
+
+	std::mutex mutex;
+	std::condition_variable work_available,
+		work_done;
+	std::deque<Block *> queue;
+	bool stopping;
+	std::vector<std::unique_ptr<Thread> > threads;
+
+	bool fill_input();
+	void read_input(void *buffer, size_t size);
+	void read_stream_header();
+	std::unique_ptr<Block> read_block_header();
+	void queue_blocks();
+	size_t take_output(uint8_t *buffer, size_t size);
+	void start_streamed_block();
+	size_t decode_streamed_block(uint8_t *buffer, size_t size);
+	void read_index();
+	bool next_stream();
+	void worker_thread();
+	void stop();
 public:
-	LzmaInputStream(std::shared_ptr<InStream> wrapped_stream, size_t buffer_size = default_buffer_size);
+	// threads = 0 uses one per processor; 1 decodes everything on the
+	// calling thread. memory_limit = 0 allows 64 MiB per thread.
+	LzmaInputStream(std::shared_ptr<InStream> wrapped_stream, size_t buffer_size = default_buffer_size, unsigned threads = 0, std::uint64_t memory_limit = 0);
 	~LzmaInputStream();
 	size_t read(void *buffer, size_t size) override;
 	bool eof() override;
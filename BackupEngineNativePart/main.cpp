@@ -14,7 +14,13 @@ int main(){
 		"Comparing files: " << double(t2 - t1) / CLOCKS_PER_SEC << " s.\n";
 
 	std::cout
-		<< "Old SHA1: " << PrintableBuffer(cmp.get_old_digest(), 20) << "\n"
-		"New SHA1: " << PrintableBuffer(cmp.get_new_digest(), 20) << std::endl;
+		<< "Old digest: " << PrintableBuffer(cmp.get_old_digest(), 20) << "\n"
+		"New digest: " << PrintableBuffer(cmp.get_new_digest(), 20) << std::endl;
+
+	auto &stats = cmp.get_pipeline_statistics();
+	std::cout
+		<< "Blocks hashed: " << stats.blocks << "\n"
+		"Comparer stalls: " << stats.producer_stalls << " (" << stats.producer_stall_seconds << " s)\n"
+		"Hasher stalls: " << stats.consumer_stalls << " (" << stats.consumer_stall_seconds << " s)\n";
 	return 0;
 }
@@ -0,0 +1,45 @@
+#include "stdafx.h"
+#include "sliding_window.h"
+
+sliding_window::sliding_window(size_t capacity): buffer(nullptr), backing_size(0), m_capacity(0), start(0), m_size(0){
+	this->reset(capacity);
+}
+
+sliding_window::~sliding_window(){
+	delete[] this->buffer;
+}
+
+void sliding_window::reset(size_t capacity){
+	if (this->m_capacity != capacity || !this->buffer){
+		auto backing_size = capacity + std::max(capacity, minimum_slack);
+		auto buffer = new byte_t[backing_size];
+		delete[] this->buffer;
+		this->buffer = buffer;
+		this->backing_size = backing_size;
+		this->m_capacity = capacity;
+	}
+	this->start = 0;
+	this->m_size = 0;
+}
+
+void sliding_window::make_room(size_t n){
+	if (this->start + this->m_size + n <= this->backing_size)
+		return;
+	memmove(this->buffer, this->buffer + this->start, this->m_size);
+	this->start = 0;
+}
+
+size_t sliding_window::append(const byte_t *buf, size_t size){
+	size = std::min(size, this->m_capacity - this->m_size);
+	this->make_room(size);
+	memcpy(this->buffer + this->start + this->m_size, buf, size);
+	this->m_size += size;
+	return size;
+}
+
+void sliding_window::push_back(byte_t byte){
+	if (this->full())
+		return;
+	this->make_room(1);
+	this->buffer[this->start + this->m_size++] = byte;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+/*
+A window of up to capacity() bytes that always lies in one contiguous run of
+memory. It sits in a backing buffer larger than the window and moves forward
+through it as bytes are dropped from the front and appended at the back. When
+it reaches the end of the backing buffer, it is copied back to the start,
+which happens once every (backing size - capacity) bytes, so the cost per
+byte stays low.
+*/
+class sliding_window{
+	byte_t *buffer;
+	size_t backing_size;
+	size_t m_capacity;
+	size_t start;
+	size_t m_size;
+
+	sliding_window(const sliding_window &){}
+	void operator=(const sliding_window &){}
+	void make_room(size_t n);
+public:
+	// At least this much slack is kept beyond the window, however small it is.
+	static const size_t minimum_slack = 1 << 16;
+
+	sliding_window(size_t capacity = 0);
+	~sliding_window();
+	// Empties the window, reallocating only if the capacity changes.
+	void reset(size_t capacity);
+	const byte_t *data() const{
+		return this->buffer + this->start;
+	}
+	size_t size() const{
+		return this->m_size;
+	}
+	size_t capacity() const{
+		return this->m_capacity;
+	}
+	bool full() const{
+		return this->m_size == this->m_capacity;
+	}
+	byte_t front() const{
+		return this->buffer[this->start];
+	}
+	// Appends as much of buf as fits and returns how much that was.
+	size_t append(const byte_t *buf, size_t size);
+	void push_back(byte_t);
+	// Drops the n oldest bytes.
+	void advance(size_t n){
+		n = std::min(n, this->m_size);
+		this->start += n;
+		this->m_size -= n;
+	}
+	// Drops the size oldest bytes and appends buf in their place.
+	void slide(const byte_t *buf, size_t size){
+		size = std::min(size, this->m_size);
+		this->advance(size);
+		this->append(buf, size);
+	}
+};
@@ -31,6 +31,7 @@
 #include <vswriter.h>
 #include <vsbackup.h>
 #include <limits>
+#include <functional>
 
 #include "SimpleTypes.h"
 #include "GlobalConstants.h"
@@ -1,25 +1,35 @@
 #include "stdafx.h"
+#define LZMA_API_STATIC
+#include <lzma.h>
 #include "streams.h"
+#include "lzma.h"
 #include "MiscFunctions.h"
 #include "MiscTypes.h"
 #include "ExportedFunctions.h"
+#include "IoThrottle.h"
 
-FileOutputStream::FileOutputStream(const wchar_t *_path){
-	auto path = path_from_string(_path);
-	this->file = CreateFileW(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, 0, nullptr);
-	if (this->file == INVALID_HANDLE_VALUE)
-		throw Win32Error();
+static const size_t unbuffered_staging_size = 1 << 20;
+
+static size_t align_down(size_t size){
+	return size / unbuffered_io_alignment * unbuffered_io_alignment;
 }
 
-FileOutputStream::~FileOutputStream(){
-	if (this->file && this->file != INVALID_HANDLE_VALUE)
-		CloseHandle(this->file);
+static size_t align_up(size_t size){
+	return align_down(size + unbuffered_io_alignment - 1);
 }
 
-void FileOutputStream::write(const void *buffer, size_t size){
+static void set_file_pointer(HANDLE file, file_offset_t offset){
+	LARGE_INTEGER li;
+	li.QuadPart = offset;
+	if (!SetFilePointerEx(file, li, nullptr, FILE_BEGIN))
+		throw Win32Error();
+}
+
+static void write_all(HANDLE file, const void *buffer, size_t size, IoThrottle *throttle){
 	while (size){
+		ThrottledRequest request(throttle, size);
 		DWORD bytes_written;
-		auto success = WriteFile(this->file, buffer, size & 0xFFFFFFFF, &bytes_written, nullptr);
+		auto success = WriteFile(file, buffer, size & 0xFFFFFFFF, &bytes_written, nullptr);
 		if (!success)
 			throw Win32Error();
 		if (bytes_written > size)
@@ -31,15 +41,231 @@ void FileOutputStream::write(const void *buffer, size_t size){
 	}
 }
 
+FileOutputStream::FileOutputStream(const wchar_t *_path, bool unbuffered):
+		unbuffered(unbuffered),
+		staged(0),
+		staging_offset(0),
+		throttle(get_io_throttle(_path)){
+	auto path = path_from_string(_path);
+	this->file = CreateFileW(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, unbuffered ? FILE_FLAG_NO_BUFFERING : 0, nullptr);
+	if (this->file == INVALID_HANDLE_VALUE)
+		throw Win32Error();
+	if (unbuffered)
+		this->staging = BufferPool(unbuffered_staging_size).acquire();
+}
+
+FileOutputStream::~FileOutputStream(){
+	if (this->unbuffered){
+		try{
+			this->write_tail();
+		}catch (Win32Error &){
+		}
+	}
+	if (this->file && this->file != INVALID_HANDLE_VALUE)
+		CloseHandle(this->file);
+}
+
+void FileOutputStream::write(const void *buffer, size_t size){
+	if (!this->unbuffered){
+		write_all(this->file, buffer, size, this->throttle.get());
+		return;
+	}
+	while (size){
+		auto n = std::min(this->staging.capacity() - this->staged, size);
+		memcpy(this->staging.data() + this->staged, buffer, n);
+		this->staged += n;
+		buffer = (const char *)buffer + n;
+		size -= n;
+		if (this->staged == this->staging.capacity()){
+			this->write_staging(this->staged);
+			this->staging_offset += this->staged;
+			this->staged = 0;
+		}
+	}
+}
+
+void FileOutputStream::write_staging(size_t size){
+	// A previous write_tail() may have left the file pointer past a
+	// partial sector that is about to be written again.
+	set_file_pointer(this->file, this->staging_offset);
+	write_all(this->file, this->staging.data(), size, this->throttle.get());
+}
+
+void FileOutputStream::write_tail(){
+	if (!this->staged)
+		return;
+	auto whole = align_down(this->staged);
+	auto padded = align_up(this->staged);
+	memset(this->staging.data() + this->staged, 0, padded - this->staged);
+	this->write_staging(padded);
+	set_file_pointer(this->file, this->staging_offset + this->staged);
+	if (!SetEndOfFile(this->file))
+		throw Win32Error();
+	// Keep the partial sector, which the next write will complete.
+	memmove(this->staging.data(), this->staging.data() + whole, this->staged - whole);
+	this->staging_offset += whole;
+	this->staged -= whole;
+}
+
 void FileOutputStream::flush(){
+	if (this->unbuffered)
+		this->write_tail();
 	FlushFileBuffers(this->file);
 }
 
-FileInputStream::FileInputStream(const wchar_t *_path){
+WriteBehindParameters::WriteBehindParameters(size_t chunk_size, unsigned chunk_count):
+		chunk_size(chunk_size),
+		chunk_count(chunk_count),
+		extent_size(64 << 20),
+		unbuffered(false){}
+
+static WriteBehindParameters normalize(WriteBehindParameters parameters){
+	parameters.chunk_size = align_up(std::max<size_t>(parameters.chunk_size, 1));
+	parameters.chunk_count = std::max(parameters.chunk_count, 1U);
+	return parameters;
+}
+
+WriteBehindFileOutputStream::WriteBehindFileOutputStream(const wchar_t *_path, const WriteBehindParameters &parameters):
+		parameters(normalize(parameters)),
+		throttle(get_io_throttle(_path)),
+		pipeline(this->parameters.chunk_size, this->parameters.chunk_count),
+		chunk(nullptr),
+		fill(0),
+		write_offset(0),
+		file_end(0),
+		failed(false){
 	auto path = path_from_string(_path);
-	this->file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, 0, nullptr);
+	this->file = CreateFileW(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, this->parameters.unbuffered ? FILE_FLAG_NO_BUFFERING : 0, nullptr);
 	if (this->file == INVALID_HANDLE_VALUE)
 		throw Win32Error();
+	try{
+		this->writer.reset(new Thread([this](){ this->writer_thread(); }));
+	}catch (...){
+		CloseHandle(this->file);
+		throw;
+	}
+}
+
+WriteBehindFileOutputStream::~WriteBehindFileOutputStream(){
+	// The last chunk is partial even if empty, so the writer truncates the
+	// file.
+	try{
+		this->hand_off();
+	}catch (std::bad_alloc &){
+	}
+	this->pipeline.close();
+	this->writer.reset();
+	CloseHandle(this->file);
+}
+
+void WriteBehindFileOutputStream::write(const void *buffer, size_t size){
+	this->check_error();
+	while (size){
+		if (!this->chunk)
+			this->chunk = this->pipeline.begin_write();
+		auto n = std::min(this->parameters.chunk_size - this->fill, size);
+		memcpy(this->chunk + this->fill, buffer, n);
+		this->fill += n;
+		buffer = (const char *)buffer + n;
+		size -= n;
+		if (this->fill == this->parameters.chunk_size)
+			this->hand_off();
+	}
+}
+
+void WriteBehindFileOutputStream::flush(){
+	this->check_error();
+	// The partial sector at the end of an unbuffered chunk is written
+	// padded, and written again at the start of the next chunk.
+	byte_t partial_sector[unbuffered_io_alignment];
+	size_t carried = 0;
+	if (this->parameters.unbuffered){
+		auto whole = align_down(this->fill);
+		carried = this->fill - whole;
+		if (carried)
+			memcpy(partial_sector, this->chunk + whole, carried);
+	}
+	this->hand_off();
+	this->partial_chunk_written.wait();
+	this->check_error();
+	FlushFileBuffers(this->file);
+	if (carried){
+		this->chunk = this->pipeline.begin_write();
+		memcpy(this->chunk, partial_sector, carried);
+		this->fill = carried;
+	}
+}
+
+void WriteBehindFileOutputStream::hand_off(){
+	if (!this->chunk)
+		this->chunk = this->pipeline.begin_write();
+	if (this->parameters.unbuffered)
+		memset(this->chunk + this->fill, 0, align_up(this->fill) - this->fill);
+	this->pipeline.end_write(this->fill);
+	this->chunk = nullptr;
+	this->fill = 0;
+}
+
+void WriteBehindFileOutputStream::check_error(){
+	if (this->failed.load(std::memory_order_acquire))
+		std::rethrow_exception(this->error);
+}
+
+void WriteBehindFileOutputStream::writer_thread(){
+	const byte_t *data;
+	size_t size;
+	while (this->pipeline.begin_read(data, size)){
+		// After an error, chunks are still taken, so that the caller never
+		// waits for a free one forever.
+		if (!this->failed.load(std::memory_order_relaxed)){
+			try{
+				this->write_chunk(data, size);
+			}catch (...){
+				this->error = std::current_exception();
+				this->failed.store(true, std::memory_order_release);
+			}
+		}
+		bool partial = size < this->parameters.chunk_size;
+		this->pipeline.end_read();
+		if (partial)
+			this->partial_chunk_written.set();
+	}
+}
+
+void WriteBehindFileOutputStream::write_chunk(const byte_t *data, size_t size){
+	auto padded = this->parameters.unbuffered ? align_up(size) : size;
+	auto end = this->write_offset + padded;
+	auto extent = this->parameters.extent_size;
+	if (extent && end > this->file_end){
+		this->file_end = (end + extent - 1) / extent * extent;
+		// If the file can't be extended, the write itself will fail, and
+		// say why.
+		fast_file_expansion(this->file, this->file_end);
+	}
+	set_file_pointer(this->file, this->write_offset);
+	write_all(this->file, data, padded, this->throttle.get());
+	if (size == this->parameters.chunk_size){
+		this->write_offset = end;
+		return;
+	}
+	this->file_end = this->write_offset + size;
+	set_file_pointer(this->file, this->file_end);
+	if (!SetEndOfFile(this->file))
+		throw Win32Error();
+	this->write_offset += this->parameters.unbuffered ? align_down(size) : size;
+}
+
+FileInputStream::FileInputStream(const wchar_t *_path, bool unbuffered):
+		unbuffered(unbuffered),
+		staged_begin(0),
+		staged_end(0),
+		throttle(get_io_throttle(_path)){
+	auto path = path_from_string(_path);
+	this->file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, unbuffered ? FILE_FLAG_NO_BUFFERING : 0, nullptr);
+	if (this->file == INVALID_HANDLE_VALUE)
+		throw Win32Error();
+	if (unbuffered)
+		this->staging = BufferPool(unbuffered_staging_size).acquire();
 }
 
 FileInputStream::~FileInputStream(){
@@ -49,11 +275,38 @@ FileInputStream::~FileInputStream(){
 
 size_t FileInputStream::read(void *buffer, size_t size){
 	size_t ret = 0;
+	if (this->unbuffered){
+		while (size){
+			if (this->staged_begin == this->staged_end){
+				// Only the last read of the file comes back short, and it
+				// ends the file, so the file pointer stays aligned.
+				ThrottledRequest request(this->throttle.get(), this->staging.capacity());
+				DWORD bytes_read;
+				if (!ReadFile(this->file, this->staging.data(), (DWORD)this->staging.capacity(), &bytes_read, nullptr))
+					throw Win32Error();
+				if (!bytes_read)
+					break;
+				this->staged_begin = 0;
+				this->staged_end = bytes_read;
+			}
+			auto n = std::min(this->staged_end - this->staged_begin, size);
+			memcpy(buffer, this->staging.data() + this->staged_begin, n);
+			this->staged_begin += n;
+			buffer = (char *)buffer + n;
+			size -= n;
+			ret += n;
+		}
+		return ret;
+	}
 	while (size){
+		ThrottledRequest request(this->throttle.get(), size);
 		DWORD bytes_read;
 		auto success = ReadFile(this->file, buffer, size & 0xFFFFFFFF, &bytes_read, nullptr);
 		if (!success)
 			throw Win32Error();
+		// End of file.
+		if (!bytes_read)
+			break;
 		if (bytes_read > size)
 			// Huh?
 			size = 0;
@@ -66,6 +319,8 @@ size_t FileInputStream::read(void *buffer, size_t size){
 }
 
 bool FileInputStream::eof(){
+	if (this->staged_begin != this->staged_end)
+		return false;
 	LARGE_INTEGER li, size;
 	li.QuadPart = 0;
 	if (!SetFilePointerEx(this->file, li, &li, FILE_CURRENT))
@@ -74,6 +329,33 @@ bool FileInputStream::eof(){
 	return li.QuadPart >= size.QuadPart;
 }
 
+void FileInputStream::seek(file_offset_t offset){
+	this->staged_begin = this->staged_end = 0;
+	if (!this->unbuffered){
+		set_file_pointer(this->file, offset);
+		return;
+	}
+	// Unbuffered reads have to start on a sector boundary.
+	auto aligned = offset / unbuffered_io_alignment * unbuffered_io_alignment;
+	set_file_pointer(this->file, aligned);
+	std::vector<byte_t> skipped((size_t)(offset - aligned));
+	if (skipped.size())
+		this->read(&skipped[0], skipped.size());
+}
+
+size_t BoundedInputStream::read(void *buffer, size_t size){
+	size = (size_t)std::min<std::uint64_t>(size, this->remaining);
+	if (!size)
+		return 0;
+	auto ret = this->stream->read(buffer, size);
+	this->remaining -= ret;
+	return ret;
+}
+
+bool BoundedInputStream::eof(){
+	return !this->remaining || this->stream->eof();
+}
+
 DotNetInputStream::DotNetInputStream(read_callback_t read, eof_callback_t eof, release_callback_t release){
 	this->read_callback = read;
 	this->eof_callback = eof;
@@ -139,6 +421,32 @@ EXPORT_THIS void *encapsulate_dot_net_output_stream(DotNetOutputStream::write_ca
 	return new std::shared_ptr<OutStream>(new DotNetOutputStream(w, f, r));
 }
 
+EXPORT_THIS int open_file_input_stream(void **stream, const wchar_t *path, bool unbuffered){
+	*stream = nullptr;
+	try{
+		*stream = new std::shared_ptr<InStream>(new FileInputStream(path, unbuffered));
+	}catch (Win32Error &e){
+		return e.error;
+	}catch (std::bad_alloc &){
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+	return 0;
+}
+
+EXPORT_THIS int open_write_behind_output_stream(void **stream, const wchar_t *path, bool unbuffered){
+	*stream = nullptr;
+	try{
+		WriteBehindParameters parameters;
+		parameters.unbuffered = unbuffered;
+		*stream = new std::shared_ptr<OutStream>(new WriteBehindFileOutputStream(path, parameters));
+	}catch (Win32Error &e){
+		return e.error;
+	}catch (std::bad_alloc &){
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+	return 0;
+}
+
 EXPORT_THIS void release_input_stream(void *p){
 	delete (std::shared_ptr<InStream> *)p;
 }
@@ -149,15 +457,43 @@ EXPORT_THIS void release_output_stream(void *p){
 
 EXPORT_THIS int read_from_input_stream(void *p, std::uint8_t *buffer, int offset, int length){
 	auto stream = (std::shared_ptr<InStream> *)p;
-	return (*stream)->read(buffer + offset, length);
+	try{
+		return (int)(*stream)->read(buffer + offset, length);
+	}catch (Win32Error &e){
+		return -(int)e.error;
+	}catch (LzmaOperationException &){
+		return -ERROR_INVALID_DATA;
+	}catch (std::bad_alloc &){
+		return -ERROR_NOT_ENOUGH_MEMORY;
+	}catch (std::exception &){
+		return -ERROR_READ_FAULT;
+	}
 }
 
-EXPORT_THIS void write_to_output_stream(void *p, std::uint8_t *buffer, int offset, int length){
+EXPORT_THIS int write_to_output_stream(void *p, std::uint8_t *buffer, int offset, int length){
 	auto stream = (std::shared_ptr<OutStream> *)p;
-	(*stream)->write(buffer + offset, length);
+	try{
+		(*stream)->write(buffer + offset, length);
+	}catch (Win32Error &e){
+		return e.error;
+	}catch (std::bad_alloc &){
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}catch (std::exception &){
+		return ERROR_WRITE_FAULT;
+	}
+	return 0;
 }
 
-EXPORT_THIS void flush_output_stream(void *p){
+EXPORT_THIS int flush_output_stream(void *p){
 	auto stream = (std::shared_ptr<OutStream> *)p;
-	(*stream)->flush();
+	try{
+		(*stream)->flush();
+	}catch (Win32Error &e){
+		return e.error;
+	}catch (std::bad_alloc &){
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}catch (std::exception &){
+		return ERROR_WRITE_FAULT;
+	}
+	return 0;
 }
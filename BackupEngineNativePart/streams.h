@@ -1,4 +1,8 @@
 #pragma once
+#include "BufferPool.h"
+#include "BlockPipeline.h"
+
+class IoThrottle;
 
 class InStream{
 public:
@@ -14,24 +18,125 @@ public:
 	virtual void flush() = 0;
 };
 
+// File streams are paced by the budget of their volume, if it has one; see
+// set_io_budget().
 class FileInputStream : public InStream{
 	HANDLE file;
+	bool unbuffered;
+	// Unbuffered reads go through this sector-aligned buffer, of which
+	// [staged_begin; staged_end) hasn't been returned yet.
+	WritableBuffer staging;
+	size_t staged_begin,
+		staged_end;
+	std::shared_ptr<IoThrottle> throttle;
 public:
-	FileInputStream(const wchar_t *path);
+	// An unbuffered stream bypasses the system cache; see
+	// ReadAheadParameters::unbuffered.
+	FileInputStream(const wchar_t *path, bool unbuffered = false);
 	~FileInputStream();
 	size_t read(void *buffer, size_t size) override;
 	bool eof() override;
+	void seek(file_offset_t offset);
+};
+
+// Passes on at most size bytes of another stream.
+class BoundedInputStream : public InStream{
+	std::shared_ptr<InStream> stream;
+	std::uint64_t remaining;
+public:
+	BoundedInputStream(std::shared_ptr<InStream> stream, std::uint64_t size): stream(stream), remaining(size){}
+	size_t read(void *buffer, size_t size) override;
+	bool eof() override;
 };
 
 class FileOutputStream : public OutStream{
 	HANDLE file;
+	bool unbuffered;
+	// Unbuffered writes are gathered in this sector-aligned buffer and
+	// written from it in whole sectors. It holds staged bytes, which go at
+	// staging_offset in the file, always a multiple of the sector size.
+	WritableBuffer staging;
+	size_t staged;
+	file_offset_t staging_offset;
+	std::shared_ptr<IoThrottle> throttle;
+
+	void write_staging(size_t size);
+	void write_tail();
 public:
-	FileOutputStream(const wchar_t *path);
+	// An unbuffered stream bypasses the system cache; see
+	// ReadAheadParameters::unbuffered. The last partial sector is padded
+	// when written, and the file truncated to its actual size, on every
+	// flush() and on destruction.
+	FileOutputStream(const wchar_t *path, bool unbuffered = false);
 	~FileOutputStream();
 	void write(const void *buffer, size_t size) override;
 	void flush() override;
 };
 
+struct WriteBehindParameters{
+	// write() copies into chunks of this size, rounded up to a multiple of
+	// unbuffered_io_alignment, and only full chunks are written.
+	size_t chunk_size;
+	// Chunks filled or being written at once; with 2, one is filled while
+	// the other is written.
+	unsigned chunk_count;
+	// The file is extended this much at a time, ahead of the writes, so
+	// that it is allocated in a few large pieces. 0 leaves it to grow with
+	// every write.
+	file_size_t extent_size;
+	// See FileOutputStream.
+	bool unbuffered;
+	WriteBehindParameters(size_t chunk_size = 8 << 20, unsigned chunk_count = 2);
+};
+
+/*
+A FileOutputStream whose write() only copies the data, while a background
+thread writes the chunks filled so far. The caller only waits for the disk
+when every chunk is full. flush() waits for everything handed over to be
+written; it and the destructor also truncate the file to what was actually
+written, cutting off the space extended ahead.
+
+An error on the background thread stops all further writing, and is thrown
+by the next write() or flush().
+*/
+class WriteBehindFileOutputStream : public OutStream{
+	HANDLE file;
+	WriteBehindParameters parameters;
+	std::shared_ptr<IoThrottle> throttle;
+	BlockPipeline pipeline;
+	// The chunk being filled, if any, and how much of it is.
+	byte_t *chunk;
+	size_t fill;
+	// Only used by the writer thread: where the next chunk goes, and where
+	// the file currently ends.
+	file_offset_t write_offset;
+	file_offset_t file_end;
+	// Set by the writer thread after every partial chunk, which only
+	// flush() and the destructor hand over.
+	AutoResetEvent partial_chunk_written;
+	std::atomic<bool> failed;
+	std::exception_ptr error;
+	std::unique_ptr<Thread> writer;
+
+	void writer_thread();
+	void write_chunk(const byte_t *data, size_t size);
+	void hand_off();
+	void check_error();
+public:
+	WriteBehindFileOutputStream(const wchar_t *path, const WriteBehindParameters & = WriteBehindParameters());
+	~WriteBehindFileOutputStream();
+	void write(const void *buffer, size_t size) override;
+	void flush() override;
+	// How many times, and for how long in total, write() and flush() had
+	// to wait for a chunk to be free.
+	std::uint64_t get_stalls() const{
+		return this->pipeline.get_statistics().producer_stalls;
+	}
+	double get_stall_seconds() const{
+		return this->pipeline.get_statistics().producer_stall_seconds;
+	}
+};
+
 class DotNetInputStream : public InStream{
 public:
 	typedef int (*read_callback_t)(std::uint8_t *, int);
@@ -0,0 +1,27 @@
+#pragma once
+
+// Each benchmark receives the command line arguments that follow its name.
+int rolling_checksum_benchmark(int argc, char **argv);
+int hash_index_benchmark(int argc, char **argv);
+int cdc_benchmark(int argc, char **argv);
+int read_ahead_benchmark(int argc, char **argv);
+int handoff_benchmark(int argc, char **argv);
+int unbuffered_io_benchmark(int argc, char **argv);
+int write_behind_benchmark(int argc, char **argv);
+int lzma_filters_benchmark(int argc, char **argv);
+int signature_benchmark(int argc, char **argv);
+
+class BenchmarkTimer{
+	clock_t start;
+public:
+	BenchmarkTimer(): start(clock()){}
+	double elapsed() const{
+		return double(clock() - this->start) / CLOCKS_PER_SEC;
+	}
+};
+
+inline double to_gbps(u64 bytes, double seconds){
+	return seconds > 0 ? bytes / seconds / (1 << 30) : 0;
+}
+
+std::vector<byte_t> random_buffer(size_t size, unsigned seed = 0);
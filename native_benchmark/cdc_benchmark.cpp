@@ -0,0 +1,118 @@
+#include "stdafx.h"
+#include "benchmarks.h"
+#include "ContentDefinedChunker.h"
+#include "RsyncableFile.h"
+#include "FileComparer.h"
+#include "MiscTypes.h"
+#include <random>
+
+namespace{
+
+std::wstring widen(const char *s){
+	std::string temp = s;
+	return std::wstring(temp.begin(), temp.end());
+}
+
+void write_file(const char *path, const std::vector<byte_t> &data){
+	std::ofstream file(path, std::ios::binary);
+	if (data.size())
+		file.write((const char *)&data[0], data.size());
+}
+
+// A copy of data with edits scattered through it: insertions, deletions and
+// overwrites of up to a few KiB each.
+std::vector<byte_t> edit_buffer(const std::vector<byte_t> &data, size_t edits, unsigned seed){
+	std::mt19937 rng(seed);
+	std::vector<size_t> positions(edits);
+	for (auto &p : positions)
+		p = rng() % data.size();
+	std::sort(positions.begin(), positions.end());
+	std::vector<byte_t> ret;
+	ret.reserve(data.size() + data.size() / 16);
+	size_t copied = 0;
+	for (auto p : positions){
+		if (p < copied)
+			continue;
+		ret.insert(ret.end(), data.begin() + copied, data.begin() + p);
+		copied = p;
+		size_t length = rng() % 4096 + 1;
+		switch (rng() % 3){
+			case 0:
+				for (size_t i = 0; i < length; i++)
+					ret.push_back((byte_t)rng());
+				break;
+			case 1:
+				copied = std::min(data.size(), copied + length);
+				break;
+			case 2:
+				for (size_t i = 0; i < length && copied < data.size(); i++, copied++)
+					ret.push_back((byte_t)rng());
+				break;
+		}
+	}
+	ret.insert(ret.end(), data.begin() + copied, data.end());
+	return ret;
+}
+
+u64 literal_bytes(const std::vector<rsync_command> &commands){
+	u64 ret = 0;
+	for (auto &command : commands)
+		if (!command.copy_from_old())
+			ret += command.get_length();
+	return ret;
+}
+
+}
+
+// Usage: cdc [<old file> <new file>]
+// Without arguments, compares a generated 64 MiB file with an edited copy.
+int cdc_benchmark(int argc, char **argv){
+	const char *old_path = "cdc_benchmark_old.tmp",
+		*new_path = "cdc_benchmark_new.tmp";
+	bool generated = argc < 2;
+	if (generated){
+		auto old_data = random_buffer(64 << 20);
+		write_file(old_path, old_data);
+		write_file(new_path, edit_buffer(old_data, 256, 1));
+	}else{
+		old_path = argv[0];
+		new_path = argv[1];
+	}
+	auto old_wpath = widen(old_path),
+		new_wpath = widen(new_path);
+	auto new_size = get_file_size(new_wpath.c_str());
+
+	std::cout << std::fixed << std::setprecision(2);
+	{
+		BenchmarkTimer timer;
+		std::shared_ptr<RsyncableFile> old_file(new RsyncableFile(old_wpath));
+		FileComparer comparer(new_wpath.c_str(), old_file);
+		comparer.process();
+		auto seconds = timer.elapsed();
+		auto result = comparer.get_result();
+		std::cout << "rsync, block " << format_size(old_file->get_block_size())
+			<< ": " << seconds << " s, literal " << format_size(literal_bytes(*result))
+			<< " in " << result->size() << " commands\n";
+	}
+
+	const size_t average_sizes[] = { 2 << 10, 8 << 10, 32 << 10, 128 << 10 };
+	for (auto average_size : average_sizes){
+		ContentDefinedChunker::Parameters parameters(average_size);
+		BenchmarkTimer timer;
+		ChunkedFile old_file(old_wpath, parameters);
+		ChunkedFile new_file(new_wpath, parameters);
+		auto chunking_seconds = timer.elapsed();
+		auto result = new_file.compare(old_file);
+		auto seconds = timer.elapsed();
+		std::cout << "CDC, average " << std::setw(8) << format_size((u64)average_size)
+			<< ": " << seconds << " s (chunking " << to_gbps(get_file_size(old_wpath.c_str()) + new_size, chunking_seconds) << " GiB/s)"
+			", literal " << format_size(literal_bytes(*result))
+			<< " in " << result->size() << " commands, " << new_file.get_chunks().size() << " chunks\n";
+	}
+
+	if (generated){
+		remove(old_path);
+		remove(new_path);
+	}
+	return 0;
+}
@@ -0,0 +1,129 @@
+#include "stdafx.h"
+#include "benchmarks.h"
+#include "Threads.h"
+#include "BlockPipeline.h"
+
+namespace{
+
+#ifdef _WIN32
+// What Threads.h used to be: every wait and every wakeup is a kernel call.
+class KernelEvent{
+	HANDLE event;
+	KernelEvent(const KernelEvent &){}
+public:
+	KernelEvent(): event(CreateEvent(nullptr, false, false, nullptr)){}
+	~KernelEvent(){
+		CloseHandle(this->event);
+	}
+	void set(){
+		SetEvent(this->event);
+	}
+	void wait(){
+		WaitForSingleObject(this->event, INFINITE);
+	}
+};
+
+class CriticalSection{
+	CRITICAL_SECTION mutex;
+	CriticalSection(const CriticalSection &){}
+public:
+	CriticalSection(){
+		InitializeCriticalSection(&this->mutex);
+	}
+	~CriticalSection(){
+		DeleteCriticalSection(&this->mutex);
+	}
+	void lock(){
+		EnterCriticalSection(&this->mutex);
+	}
+	void unlock(){
+		LeaveCriticalSection(&this->mutex);
+	}
+};
+#endif
+
+// Two threads pass a counter back and forth, each hand-off being a locked
+// update followed by a wakeup, the way FileComparer used to queue blocks.
+// Returns the time of one round trip, in microseconds.
+template <typename Event, typename Lock>
+double ping_pong(unsigned round_trips){
+	Event ping, pong;
+	Lock lock;
+	unsigned counter = 0;
+	BenchmarkTimer timer;
+	{
+		Thread other([&](){
+			for (unsigned i = 0; i < round_trips; i++){
+				ping.wait();
+				lock.lock();
+				counter++;
+				lock.unlock();
+				pong.set();
+			}
+		});
+		for (unsigned i = 0; i < round_trips; i++){
+			lock.lock();
+			counter++;
+			lock.unlock();
+			ping.set();
+			pong.wait();
+		}
+	}
+	auto ret = timer.elapsed() / round_trips * 1e6;
+	if (counter != round_trips * 2)
+		std::cout << "Lost a hand-off!\n";
+	return ret;
+}
+
+}
+
+// Usage: handoff [<round trips>]
+// Measures the latency of waking another thread, with kernel events and a
+// critical section (Windows only) and with Threads.h, then the cost per block
+// of BlockPipeline at several depths.
+int handoff_benchmark(int argc, char **argv){
+	unsigned round_trips = argc >= 1 ? (unsigned)atoi(argv[0]) : 200000;
+	round_trips = std::max(round_trips, 1U);
+
+	std::cout << std::fixed << std::setprecision(3)
+		<< "Processors: " << get_processor_count() << ", spin count: " << get_spin_count() << "\n"
+		"Round trip, us:\n";
+#ifdef _WIN32
+	std::cout << std::setw(30) << std::left << "    kernel event + CS: " << ping_pong<KernelEvent, CriticalSection>(round_trips) << std::endl;
+#endif
+	std::cout << std::setw(30) << std::left << "    AutoResetEvent + Mutex: " << ping_pong<AutoResetEvent, Mutex>(round_trips) << std::endl;
+
+	const size_t block_size = 4 << 10;
+	const unsigned depths[] = { 1, 2, 8, 32 };
+	u32 checksum = 0;
+	std::cout << "BlockPipeline, " << block_size << " byte blocks:\n";
+	for (auto depth : depths){
+		BlockPipeline pipeline(block_size, depth);
+		const unsigned blocks = round_trips * 4;
+		BenchmarkTimer timer;
+		{
+			Thread producer([&](){
+				for (unsigned i = 0; i < blocks; i++){
+					auto block = pipeline.begin_write();
+					block[0] = (byte_t)i;
+					pipeline.end_write(block_size);
+				}
+				pipeline.close();
+			});
+			const byte_t *block;
+			size_t size;
+			while (pipeline.begin_read(block, size)){
+				checksum += block[0];
+				pipeline.end_read();
+			}
+		}
+		auto seconds = timer.elapsed();
+		auto &stats = pipeline.get_statistics();
+		std::cout << "    depth " << std::right << std::setw(2) << depth << ": "
+			<< seconds / blocks * 1e9 << " ns/block, "
+			<< stats.producer_stalls << " producer stalls (" << stats.producer_stall_seconds << " s), "
+			<< stats.consumer_stalls << " consumer stalls (" << stats.consumer_stall_seconds << " s)" << std::endl;
+	}
+	std::cout << "(" << std::hex << checksum << std::dec << ")\n";
+	return 0;
+}
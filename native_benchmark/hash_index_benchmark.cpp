@@ -0,0 +1,128 @@
+#include "stdafx.h"
+#include "benchmarks.h"
+#include "RsyncIndex.h"
+#include "binary_search.h"
+#include <random>
+
+namespace{
+
+// The lookup path RsyncIndex replaced: a bitmap over the low 24 bits of the
+// checksum, followed by binary searches over the sorted table.
+class SortedTable{
+	const std::vector<rsync_table_item> &table;
+	std::vector<u64> bitmap;
+public:
+	SortedTable(const std::vector<rsync_table_item> &table): table(table), bitmap((1 << 24) / 64){
+		for (auto &i : table){
+			auto x = i.rolling_checksum & 0xFFFFFF;
+			this->bitmap[x / 64] |= (u64)1 << (x % 64);
+		}
+	}
+	bool find(rolling_checksum_t checksum, const byte_t *hash, file_offset_t &dst) const{
+		auto x = checksum & 0xFFFFFF;
+		if (!((this->bitmap[x / 64] >> (x % 64)) & 1))
+			return false;
+		const rsync_table_item *begin = &this->table[0],
+			*end = begin + this->table.size(),
+			*begin0, *end0,
+			*begin1, *end1;
+		auto by_checksum = [checksum](const rsync_table_item &a){
+			return a.rolling_checksum < checksum ? -1 : (a.rolling_checksum > checksum ? 1 : 0);
+		};
+		triple_search(begin0, end0, begin, end, by_checksum);
+		if (begin0 == end0)
+			return false;
+		auto by_hash = [hash](const rsync_table_item &a){
+			return memcmp(a.complex_hash, hash, sizeof(a.complex_hash));
+		};
+		triple_search(begin1, end1, begin0, end0, by_hash);
+		if (begin1 == end1)
+			return false;
+		dst = begin1->file_offset;
+		return true;
+	}
+};
+
+struct Query{
+	rolling_checksum_t checksum;
+	byte_t hash[20];
+};
+
+}
+
+// Usage: hash_index [entries] [queries]
+int hash_index_benchmark(int argc, char **argv){
+	size_t entries = argc >= 1 ? atoi(argv[0]) : 1 << 21;
+	size_t query_count = argc >= 2 ? atoi(argv[1]) : 1 << 24;
+
+	std::mt19937 rng(1);
+	std::vector<rsync_table_item> table(entries);
+	for (size_t i = 0; i < entries; i++){
+		auto &item = table[i];
+		item.rolling_checksum = rng();
+		for (auto &b : item.complex_hash)
+			b = (byte_t)rng();
+		item.file_offset = (file_offset_t)i * 512;
+	}
+	std::sort(table.begin(), table.end());
+
+	RsyncIndex index;
+	{
+		BenchmarkTimer timer;
+		index.build(table, 512);
+		std::cout << "Built index over " << entries << " entries in " << timer.elapsed() << " s\n";
+	}
+	SortedTable old_index(table);
+
+	// Misses are random checksums, as the scan of a changed region produces;
+	// hits are blocks that exist in the table.
+	std::vector<Query> misses(query_count),
+		hits(query_count);
+	for (auto &q : misses){
+		q.checksum = rng();
+		memset(q.hash, 0, sizeof(q.hash));
+	}
+	for (auto &q : hits){
+		auto &item = table[rng() % entries];
+		q.checksum = item.rolling_checksum;
+		memcpy(q.hash, item.complex_hash, sizeof(q.hash));
+	}
+
+	const std::pair<const char *, const std::vector<Query> *> sets[] = {
+		{ "misses", &misses },
+		{ "hits", &hits },
+	};
+	for (auto &set : sets){
+		auto &queries = *set.second;
+		u64 old_found = 0,
+			new_found = 0;
+		double old_seconds, new_seconds;
+		{
+			BenchmarkTimer timer;
+			for (auto &q : queries){
+				file_offset_t offset;
+				if (old_index.find(q.checksum, q.hash, offset))
+					old_found += offset + 1;
+			}
+			old_seconds = timer.elapsed();
+		}
+		{
+			BenchmarkTimer timer;
+			for (auto &q : queries){
+				RsyncIndex::Group group;
+				file_offset_t offset;
+				if (index.find(q.checksum, group) && index.find(group, q.hash, false, 0, offset))
+					new_found += offset + 1;
+			}
+			new_seconds = timer.elapsed();
+		}
+		if (old_found != new_found){
+			std::cout << set.first << ": results differ between the two indices!\n";
+			return 1;
+		}
+		std::cout << std::setw(8) << set.first << std::fixed << std::setprecision(1)
+			<< ": sorted table " << queries.size() / old_seconds / 1e6 << " M/s"
+			", hash index " << queries.size() / new_seconds / 1e6 << " M/s\n";
+	}
+	return 0;
+}
@@ -0,0 +1,222 @@
+#include "stdafx.h"
+#include "benchmarks.h"
+#define LZMA_API_STATIC
+#include <lzma.h>
+#include "lzma.h"
+#include <random>
+#include <cmath>
+
+namespace{
+
+class CountingOutStream : public OutStream{
+public:
+	u64 size;
+	CountingOutStream(): size(0){}
+	void write(const void *, size_t size) override{
+		this->size += size;
+	}
+	void flush() override{}
+};
+
+struct CorpusFile{
+	std::string name;
+	std::vector<byte_t> data;
+};
+
+void put_u16(std::vector<byte_t> &v, size_t offset, u32 x){
+	v[offset] = (byte_t)x;
+	v[offset + 1] = (byte_t)(x >> 8);
+}
+
+void put_u32(std::vector<byte_t> &v, size_t offset, u32 x){
+	put_u16(v, offset, x);
+	put_u16(v, offset + 2, x >> 16);
+}
+
+// A PE header followed by code-like bytes, with a call to one of a few
+// hundred functions every few bytes. The relative targets differ at every
+// call site, which is what BCJ undoes.
+std::vector<byte_t> synthetic_executable(size_t size){
+	std::vector<byte_t> ret(size);
+	ret[0] = 'M';
+	ret[1] = 'Z';
+	put_u32(ret, 0x3C, 0x80);
+	memcpy(&ret[0x80], "PE\0\0", 4);
+	put_u16(ret, 0x84, 0x8664);
+	std::mt19937 rng(1);
+	auto opcodes = random_buffer(4096, 2);
+	for (size_t i = 0x400; i + 5 <= size;){
+		if (rng() % 4){
+			auto n = std::min<size_t>(rng() % 6 + 1, size - i);
+			auto start = rng() % (opcodes.size() - n);
+			memcpy(&ret[i], &opcodes[start], n);
+			i += n;
+			continue;
+		}
+		u32 target = (rng() % 300) * 0x1000;
+		ret[i] = 0xE8;
+		put_u32(ret, i + 1, target - (u32)(i + 5));
+		i += 5;
+	}
+	return ret;
+}
+
+// 16-bit stereo PCM.
+std::vector<byte_t> synthetic_wav(size_t frames){
+	std::vector<byte_t> ret(44 + frames * 4);
+	memcpy(&ret[0], "RIFF", 4);
+	put_u32(ret, 4, (u32)ret.size() - 8);
+	memcpy(&ret[8], "WAVEfmt ", 8);
+	put_u32(ret, 16, 16);
+	put_u16(ret, 20, 1);
+	put_u16(ret, 22, 2);
+	put_u32(ret, 24, 44100);
+	put_u32(ret, 28, 44100 * 4);
+	put_u16(ret, 32, 4);
+	put_u16(ret, 34, 16);
+	memcpy(&ret[36], "data", 4);
+	put_u32(ret, 40, (u32)frames * 4);
+	std::mt19937 rng(3);
+	for (size_t i = 0; i < frames; i++){
+		auto left = 12000 * sin(i * 0.031) + 3000 * sin(i * 0.0047) + (int)(rng() % 64);
+		auto right = 9000 * sin(i * 0.023) + 4000 * sin(i * 0.0061) + (int)(rng() % 64);
+		put_u16(ret, 44 + i * 4, (u32)(int)left);
+		put_u16(ret, 46 + i * 4, (u32)(int)right);
+	}
+	return ret;
+}
+
+// A 24-bit bitmap of smooth gradients.
+std::vector<byte_t> synthetic_bmp(u32 width, u32 height){
+	std::vector<byte_t> ret(54 + width * height * 3);
+	ret[0] = 'B';
+	ret[1] = 'M';
+	put_u32(ret, 2, (u32)ret.size());
+	put_u32(ret, 10, 54);
+	put_u32(ret, 14, 40);
+	put_u32(ret, 18, width);
+	put_u32(ret, 22, height);
+	put_u16(ret, 26, 1);
+	put_u16(ret, 28, 24);
+	std::mt19937 rng(4);
+	for (u32 y = 0; y < height; y++){
+		for (u32 x = 0; x < width; x++){
+			auto pixel = &ret[54 + (y * width + x) * 3];
+			pixel[0] = (byte_t)(x / 4 + rng() % 4);
+			pixel[1] = (byte_t)(y / 4 + rng() % 4);
+			pixel[2] = (byte_t)((x + y) / 8 + rng() % 4);
+		}
+	}
+	return ret;
+}
+
+std::vector<byte_t> synthetic_text(size_t size){
+	static const char * const words[] = { "the", "backup", "of", "a", "file", "is", "stored", "in", "an", "archive", "version", "and", "compressed" };
+	std::mt19937 rng(5);
+	std::string ret;
+	while (ret.size() < size){
+		ret += words[rng() % (sizeof(words) / sizeof(*words))];
+		ret += rng() % 12 ? ' ' : '\n';
+	}
+	ret.resize(size);
+	return std::vector<byte_t>(ret.begin(), ret.end());
+}
+
+// Returns the compressed size, and sets the time taken, in seconds, and the
+// filter used.
+u64 compress(const std::vector<byte_t> &data, int preset, bool choose_filters, double &seconds, const char *&filter){
+	auto counter = std::make_shared<CountingOutStream>();
+	LzmaEncoderOptions options;
+	options.preset = preset;
+	// A single thread, so that the time is CPU time.
+	options.threads = 1;
+	BenchmarkTimer timer;
+	{
+		LzmaOutputStream stream(counter, options);
+		if (choose_filters)
+			stream.begin_file(data.size());
+		const size_t piece = 80 << 10;
+		for (size_t i = 0; i < data.size(); i += piece)
+			stream.write(&data[i], std::min(piece, data.size() - i));
+		stream.flush();
+		filter = stream.is_storing() ? "stored" : stream.get_filter_chain().name();
+	}
+	seconds = timer.elapsed();
+	return counter->size;
+}
+
+}
+
+// Usage: lzma_filters [-<preset>] [<file>...]
+// Compresses each file with LZMA2 alone and the way LzmaOutputStream does
+// once told where files begin, with the filters choose_filter_chain() picks
+// or stored if is_incompressible(), single-threaded at preset 7 by default,
+// and shows the ratio (compressed over original size) and speed of both.
+// Without files, uses a synthetic executable, WAV, bitmap, text and random
+// data, about 4 MiB each; real executables make for a fairer look at BCJ.
+int lzma_filters_benchmark(int argc, char **argv){
+	int preset = 7;
+	if (argc >= 1 && argv[0][0] == '-'){
+		preset = atoi(argv[0] + 1);
+		argc--;
+		argv++;
+	}
+	std::vector<CorpusFile> corpus;
+	for (int i = 0; i < argc; i++){
+		std::ifstream file(argv[i], std::ios::binary);
+		if (!file){
+			std::cerr << "Can't open " << argv[i] << std::endl;
+			return 1;
+		}
+		CorpusFile f;
+		f.name = argv[i];
+		f.data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		corpus.push_back(f);
+	}
+	if (corpus.empty()){
+		CorpusFile files[] = {
+			{ "executable", synthetic_executable(4 << 20) },
+			{ "wav", synthetic_wav(1 << 20) },
+			{ "bmp", synthetic_bmp(1024, 1365) },
+			{ "text", synthetic_text(4 << 20) },
+			{ "compressed", random_buffer(4 << 20) },
+		};
+		corpus.assign(files, files + sizeof(files) / sizeof(*files));
+	}
+
+	std::cout << std::fixed << std::setprecision(3)
+		<< std::setw(24) << std::left << "file" << std::setw(11) << "filter" << std::right
+		<< std::setw(12) << "size" << std::setw(10) << "alone" << std::setw(10) << "MiB/s"
+		<< std::setw(10) << "adaptive" << std::setw(10) << "MiB/s" << std::endl;
+	u64 total_size = 0,
+		total_plain = 0,
+		total_filtered = 0;
+	double total_plain_seconds = 0,
+		total_filtered_seconds = 0;
+	auto ratio = [](u64 compressed, u64 size){
+		return size ? (double)compressed / size : 0;
+	};
+	auto speed = [](u64 size, double seconds){
+		return seconds > 0 ? size / seconds / (1 << 20) : 0;
+	};
+	for (auto &file : corpus){
+		double plain_seconds, filtered_seconds;
+		const char *none, *filter;
+		auto plain = compress(file.data, preset, false, plain_seconds, none);
+		auto filtered = compress(file.data, preset, true, filtered_seconds, filter);
+		u64 size = file.data.size();
+		std::cout << std::setw(24) << std::left << file.name << std::setw(11) << filter << std::right
+			<< std::setw(12) << size
+			<< std::setw(10) << ratio(plain, size) << std::setw(10) << speed(size, plain_seconds)
+			<< std::setw(10) << ratio(filtered, size) << std::setw(10) << speed(size, filtered_seconds) << std::endl;
+		total_size += size;
+		total_plain += plain;
+		total_filtered += filtered;
+		total_plain_seconds += plain_seconds;
+		total_filtered_seconds += filtered_seconds;
+	}
+	std::cout << std::setw(35) << std::left << "total" << std::right << std::setw(12) << total_size
+		<< std::setw(10) << ratio(total_plain, total_size) << std::setw(10) << speed(total_size, total_plain_seconds)
+		<< std::setw(10) << ratio(total_filtered, total_size) << std::setw(10) << speed(total_size, total_filtered_seconds) << std::endl;
+	return 0;
+}
@@ -0,0 +1,41 @@
+#include "stdafx.h"
+#include "benchmarks.h"
+#include <random>
+
+struct benchmark_entry{
+	const char *name;
+	int (*function)(int, char **);
+};
+
+static const benchmark_entry benchmarks[] = {
+	{ "rolling_checksum", rolling_checksum_benchmark },
+	{ "hash_index", hash_index_benchmark },
+	{ "cdc", cdc_benchmark },
+	{ "read_ahead", read_ahead_benchmark },
+	{ "handoff", handoff_benchmark },
+	{ "unbuffered_io", unbuffered_io_benchmark },
+	{ "write_behind", write_behind_benchmark },
+	{ "lzma_filters", lzma_filters_benchmark },
+	{ "signature", signature_benchmark },
+};
+
+std::vector<byte_t> random_buffer(size_t size, unsigned seed){
+	std::vector<byte_t> ret(size);
+	std::mt19937 rng(seed);
+	for (auto &b : ret)
+		b = (byte_t)rng();
+	return ret;
+}
+
+int main(int argc, char **argv){
+	if (argc >= 2){
+		for (auto &b : benchmarks)
+			if (!strcmp(argv[1], b.name))
+				return b.function(argc - 2, argv + 2);
+	}
+	std::cerr << "Usage: native_benchmark <benchmark> [arguments]\n"
+		"Available benchmarks:\n";
+	for (auto &b : benchmarks)
+		std::cerr << "    " << b.name << std::endl;
+	return 1;
+}
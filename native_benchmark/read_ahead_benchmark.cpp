@@ -0,0 +1,88 @@
+#include "stdafx.h"
+#include "benchmarks.h"
+#include "ReadAhead.h"
+#include "MiscFunctions.h"
+
+namespace{
+
+std::wstring widen(const char *s){
+	std::string temp = s;
+	return std::wstring(temp.begin(), temp.end());
+}
+
+const char *backend_name(ReadAheadBackend backend){
+	switch (backend){
+		case ReadAheadBackend::Overlapped:
+			return "overlapped";
+		case ReadAheadBackend::ThreadPool:
+			return "thread pool";
+		case ReadAheadBackend::Mapping:
+			return "mapping";
+	}
+	return "?";
+}
+
+}
+
+// Usage: read_ahead [<file>]
+// Reads the file sequentially with every combination of backend, request size
+// and queue depth (which mapping ignores). Without arguments, reads a
+// generated 256 MiB file. Unless the file is larger than memory, every pass
+// after the first is served from the cache, which measures overhead rather
+// than the device.
+int read_ahead_benchmark(int argc, char **argv){
+	const char *path = "read_ahead_benchmark.tmp";
+	bool generated = argc < 1;
+	if (generated){
+		auto data = random_buffer(256 << 20);
+		std::ofstream file(path, std::ios::binary);
+		file.write((const char *)&data[0], data.size());
+	}else
+		path = argv[0];
+	auto wpath = widen(path);
+
+	std::vector<ReadAheadBackend> backends;
+#ifdef _WIN32
+	backends.push_back(ReadAheadBackend::Overlapped);
+#endif
+	backends.push_back(ReadAheadBackend::ThreadPool);
+#ifdef _WIN32
+	backends.push_back(ReadAheadBackend::Mapping);
+#endif
+	const size_t request_sizes[] = { 8 << 10, 64 << 10, 256 << 10, 1 << 20, 4 << 20 };
+	const unsigned queue_depths[] = { 1, 2, 4, 8, 16, 32 };
+
+	u32 checksum = 0;
+	std::cout << std::fixed << std::setprecision(2);
+	for (auto backend : backends){
+		std::cout << backend_name(backend) << ", GiB/s by request size (rows) and queue depth (columns):\n"
+			<< std::setw(10) << "";
+		for (auto depth : queue_depths)
+			std::cout << std::setw(8) << depth;
+		std::cout << std::endl;
+		for (auto request_size : request_sizes){
+			std::cout << std::setw(10) << format_size((u64)request_size);
+			for (auto depth : queue_depths){
+				ReadAheadParameters parameters(request_size, depth);
+				parameters.backend = backend;
+				u64 total = 0;
+				BenchmarkTimer timer;
+				auto reader = open_sequential_reader(wpath.c_str(), parameters);
+				for (auto buffer = reader->next(); buffer.size(); buffer = reader->next()){
+					// Touch every page, or a mapping would never be read.
+					for (size_t i = 0; i < buffer.size(); i += 4096)
+						checksum += buffer.data()[i];
+					total += buffer.size();
+				}
+				std::cout << std::setw(8) << to_gbps(total, timer.elapsed()) << std::flush;
+			}
+			std::cout << std::endl;
+		}
+	}
+
+	std::cout << "(" << std::hex << checksum << std::dec << ")\n";
+
+	if (generated)
+		remove(path);
+	return 0;
+}
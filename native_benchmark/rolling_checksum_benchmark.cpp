@@ -0,0 +1,45 @@
+#include "stdafx.h"
+#include "benchmarks.h"
+#include "RollingChecksum.h"
+#include "MiscFunctions.h"
+
+static bool verify_kernel(const std::vector<byte_t> &data){
+	const byte_t *p = &data[0];
+	const size_t sizes[] = { 0, 1, 15, 16, 17, 31, 32, 33, 511, 512, 4095, 65537 };
+	for (auto size : sizes){
+		if (compute_rsync_rolling_checksum(p + 3, size) != compute_rsync_rolling_checksum<const byte_t *>(p + 3, size))
+			return false;
+		if (compute_rsync_rolling_checksum(p + 5, size, 100, 200000, 0x12345678) != compute_rsync_rolling_checksum<const byte_t *>(p + 5, size, 100, 200000, 0x12345678))
+			return false;
+	}
+	return true;
+}
+
+// Usage: rolling_checksum [megabytes]
+int rolling_checksum_benchmark(int argc, char **argv){
+	size_t total = (argc >= 1 ? atoi(argv[0]) : 256) << 20;
+	auto data = random_buffer(total);
+	const size_t block_sizes[] = { 512, 4 << 10, 64 << 10, 1 << 20 };
+	const int passes = 4;
+
+	for (auto &kernel : get_rolling_checksum_kernels()){
+		set_rolling_checksum_kernel(kernel);
+		if (!verify_kernel(data)){
+			std::cout << kernel.name << ": results differ from the reference implementation!\n";
+			return 1;
+		}
+		for (auto block_size : block_sizes){
+			rolling_checksum_t accumulator = 0;
+			BenchmarkTimer timer;
+			for (int pass = 0; pass < passes; pass++)
+				for (size_t offset = 0; offset + block_size <= total; offset += block_size)
+					accumulator += compute_rsync_rolling_checksum(&data[offset], block_size);
+			auto seconds = timer.elapsed();
+			std::cout << std::setw(8) << kernel.name
+				<< " block " << std::setw(8) << format_size((u64)block_size)
+				<< ": " << std::fixed << std::setprecision(2) << to_gbps((u64)total * passes, seconds) << " GiB/s"
+				" (" << std::hex << accumulator << std::dec << ")\n";
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,110 @@
+#include "stdafx.h"
+#include "benchmarks.h"
+#include "RsyncableFile.h"
+#include "SignatureBuilder.h"
+#include "ReadAhead.h"
+#include "MiscFunctions.h"
+
+namespace{
+
+std::wstring widen(const char *s){
+	std::string temp = s;
+	return std::wstring(temp.begin(), temp.end());
+}
+
+const char *algorithm_name(StrongHashAlgorithm algorithm){
+	switch (algorithm){
+		case StrongHashAlgorithm::Sha1:
+			return "SHA-1";
+		case StrongHashAlgorithm::Murmur3_128:
+			return "Murmur3";
+	}
+	return "?";
+}
+
+// Returns what differs between a and b, or nullptr if they are the same.
+const char *compare_signatures(const RsyncableFile &a, const RsyncableFile &b){
+	if (a.get_block_size() != b.get_block_size())
+		return "block size";
+	if (a.get_strong_hash_algorithm() != b.get_strong_hash_algorithm())
+		return "strong hash algorithm";
+	if (memcmp(a.get_digest(), b.get_digest(), 20))
+		return "digest";
+	auto &x = a.get_index();
+	auto &y = b.get_index();
+	if (x.size() != y.size() || x.get_image_size() != y.get_image_size() || memcmp(x.get_image(), y.get_image(), x.get_image_size()))
+		return "table";
+	return nullptr;
+}
+
+}
+
+// Usage: signature [<file> [<piece size>]]
+// Computes the signature of the file by reading it (RsyncableFile(path)), and
+// again by pushing it through a SignatureBuilder in pieces of the given size
+// (by default a prime, so that pieces straddle blocks), the way archiving
+// does. Checks that both, and the builder's signature after a round trip
+// through a signature file, are identical, since a delta against a saved
+// signature is only right if they are. Without arguments, uses a generated
+// file whose size isn't a multiple of any block size.
+int signature_benchmark(int argc, char **argv){
+	const char *path = "signature_benchmark.tmp";
+	bool generated = argc < 1;
+	if (generated){
+		auto data = random_buffer((100 << 20) + 777);
+		std::ofstream file(path, std::ios::binary);
+		file.write((const char *)&data[0], data.size());
+	}else
+		path = argv[0];
+	size_t piece_size = argc >= 2 ? atoi(argv[1]) : 65521;
+	piece_size = std::max<size_t>(piece_size, 1);
+	auto wpath = widen(path);
+	auto signature_path = std::string(path) + ".sig";
+	auto signature_wpath = widen(signature_path.c_str());
+	const auto file_size = get_file_size(wpath.c_str());
+
+	const StrongHashAlgorithm algorithms[] = { StrongHashAlgorithm::Sha1, StrongHashAlgorithm::Murmur3_128 };
+	int ret = 0;
+	std::cout << std::fixed << std::setprecision(2);
+	for (auto algorithm : algorithms){
+		double path_seconds, builder_seconds;
+		std::unique_ptr<RsyncableFile> from_path;
+		{
+			BenchmarkTimer timer;
+			from_path.reset(new RsyncableFile(wpath, algorithm));
+			path_seconds = timer.elapsed();
+		}
+		SignatureBuilder builder(file_size, algorithm);
+		{
+			BenchmarkTimer timer;
+			auto reader = open_sequential_reader(wpath.c_str(), ReadAheadParameters());
+			for (auto buffer = reader->next(); buffer.size(); buffer = reader->next())
+				for (size_t i = 0; i < buffer.size(); i += piece_size)
+					builder.update(buffer.data() + i, std::min(piece_size, buffer.size() - i));
+			builder.finish();
+			builder_seconds = timer.elapsed();
+		}
+		RsyncableFile from_builder(builder);
+		from_builder.save(signature_wpath.c_str());
+		auto loaded = RsyncableFile::load(signature_wpath.c_str());
+
+		std::cout << algorithm_name(algorithm) << ": from path " << to_gbps(file_size, path_seconds) << " GiB/s"
+			", from builder " << to_gbps(file_size, builder_seconds) << " GiB/s\n";
+		auto difference = compare_signatures(*from_path, from_builder);
+		if (difference){
+			std::cout << "    " << difference << " differs between the path and the builder!\n";
+			ret = 1;
+		}
+		difference = compare_signatures(from_builder, *loaded);
+		if (difference){
+			std::cout << "    " << difference << " differs after saving and loading the signature!\n";
+			ret = 1;
+		}
+		loaded.reset();
+		remove(signature_path.c_str());
+	}
+
+	if (generated)
+		remove(path);
+	return ret;
+}
@@ -0,0 +1,91 @@
+#include "stdafx.h"
+#include "benchmarks.h"
+#include "ReadAhead.h"
+#include "streams.h"
+#include "MiscFunctions.h"
+#include <psapi.h>
+
+namespace{
+
+std::wstring widen(const char *s){
+	std::string temp = s;
+	return std::wstring(temp.begin(), temp.end());
+}
+
+// Windows only reports the size of the whole system cache, so the difference
+// between two calls includes whatever else the machine was doing.
+u64 cached_bytes(){
+	PERFORMANCE_INFORMATION info;
+	if (!GetPerformanceInfo(&info, sizeof(info)))
+		return 0;
+	return (u64)info.SystemCache * info.PageSize;
+}
+
+void measure(const char *name, bool unbuffered, u64 bytes, const std::function<void()> &f){
+	auto before = cached_bytes();
+	BenchmarkTimer timer;
+	f();
+	auto seconds = timer.elapsed();
+	auto after = cached_bytes();
+	std::cout << std::setw(12) << std::left << name << std::setw(12) << (unbuffered ? "unbuffered" : "buffered") << std::right
+		<< std::setw(8) << to_gbps(bytes, seconds) << " GiB/s, cache "
+		<< (after >= before ? "+" : "-") << format_size(after >= before ? after - before : before - after) << std::endl;
+}
+
+}
+
+// Usage: unbuffered_io [<size in MiB>]
+// Writes a file (1 GiB by default) and reads it back, with and without
+// unbuffered I/O, and shows how much the system cache grew each time. The
+// file is first written unbuffered, so that the unbuffered reads find nothing
+// in the cache and the first buffered read has to fill it.
+int unbuffered_io_benchmark(int argc, char **argv){
+	u64 size = (u64)(argc >= 1 ? std::max(atoi(argv[0]), 1) : 1024) << 20;
+	const char *path = "unbuffered_io_benchmark.tmp";
+	auto wpath = widen(path);
+	auto data = random_buffer(1 << 20);
+	// An odd size, so that unbuffered writes keep ending mid-sector.
+	const size_t write_size = 999983;
+	u32 checksum = 0;
+
+	std::cout << std::fixed << std::setprecision(2);
+	auto write = [&](bool unbuffered){
+		measure("write", unbuffered, size, [&](){
+			FileOutputStream file(wpath.c_str(), unbuffered);
+			for (u64 written = 0; written < size;){
+				auto n = (size_t)std::min<u64>(write_size, size - written);
+				file.write(&data[0], n);
+				written += n;
+			}
+			file.flush();
+		});
+	};
+	write(true);
+	for (int unbuffered = 1; unbuffered >= 0; unbuffered--){
+		measure("read ahead", !!unbuffered, size, [&](){
+			ReadAheadParameters parameters(1 << 20, 8);
+			parameters.unbuffered = !!unbuffered;
+			auto reader = open_sequential_reader(wpath.c_str(), parameters);
+			for (auto buffer = reader->next(); buffer.size(); buffer = reader->next())
+				for (size_t i = 0; i < buffer.size(); i += 4096)
+					checksum += buffer.data()[i];
+		});
+		measure("stream", !!unbuffered, size, [&](){
+			FileInputStream file(wpath.c_str(), !!unbuffered);
+			std::vector<byte_t> buffer(write_size);
+			while (!file.eof()){
+				auto n = file.read(&buffer[0], buffer.size());
+				if (!n)
+					break;
+				checksum += buffer[0];
+			}
+		});
+	}
+	// The file is cached by now; start over, so that the growth shows.
+	remove(path);
+	write(false);
+
+	std::cout << "(" << std::hex << checksum << std::dec << ")\n";
+	remove(path);
+	return 0;
+}
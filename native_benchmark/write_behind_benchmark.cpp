@@ -0,0 +1,72 @@
+#include "stdafx.h"
+#include "benchmarks.h"
+#include "streams.h"
+#include "MiscFunctions.h"
+
+namespace{
+
+std::wstring widen(const char *s){
+	std::string temp = s;
+	return std::wstring(temp.begin(), temp.end());
+}
+
+// Stands in for the compressor: some work per byte before every write.
+u32 produce(const std::vector<byte_t> &data, unsigned passes){
+	u32 ret = 0;
+	for (unsigned i = 0; i < passes; i++)
+		for (auto b : data)
+			ret = ret * 31 + b;
+	return ret;
+}
+
+}
+
+// Usage: write_behind [<size in MiB> [<passes>]]
+// Writes a file (1 GiB by default) in 80 KiB pieces, the way
+// LzmaOutputStream does, running a loop of passes iterations over every piece
+// before writing it (4 by default, 0 to measure the writes alone). Compares
+// FileOutputStream with WriteBehindFileOutputStream, buffered and unbuffered,
+// and shows how long the writer waited for the disk.
+int write_behind_benchmark(int argc, char **argv){
+	u64 size = (u64)(argc >= 1 ? std::max(atoi(argv[0]), 1) : 1024) << 20;
+	unsigned passes = argc >= 2 ? (unsigned)atoi(argv[1]) : 4;
+	const char *path = "write_behind_benchmark.tmp";
+	auto wpath = widen(path);
+	auto data = random_buffer(80 << 10);
+	u32 checksum = 0;
+
+	auto run = [&](const char *name, bool unbuffered, OutStream &stream){
+		BenchmarkTimer timer;
+		for (u64 written = 0; written < size;){
+			auto n = (size_t)std::min<u64>(data.size(), size - written);
+			checksum += produce(data, passes);
+			stream.write(&data[0], n);
+			written += n;
+		}
+		stream.flush();
+		auto seconds = timer.elapsed();
+		std::cout << std::setw(14) << std::left << name << std::setw(12) << (unbuffered ? "unbuffered" : "buffered") << std::right
+			<< std::setw(8) << to_gbps(size, seconds) << " GiB/s";
+	};
+
+	std::cout << std::fixed << std::setprecision(2);
+	for (int unbuffered = 0; unbuffered < 2; unbuffered++){
+		{
+			FileOutputStream file(wpath.c_str(), !!unbuffered);
+			run("synchronous", !!unbuffered, file);
+		}
+		std::cout << std::endl;
+		remove(path);
+		{
+			WriteBehindParameters parameters;
+			parameters.unbuffered = !!unbuffered;
+			WriteBehindFileOutputStream file(wpath.c_str(), parameters);
+			run("write-behind", !!unbuffered, file);
+			std::cout << ", waited " << file.get_stalls() << " times, " << file.get_stall_seconds() << " s" << std::endl;
+		}
+		remove(path);
+	}
+
+	std::cout << "(" << std::hex << checksum << std::dec << ")\n";
+	return 0;
+}